@@ -30,6 +30,8 @@
 #include <unistd.h>
 
 #include <iomanip>
+#include <sstream>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -56,6 +58,8 @@
 #include <memory>
 
 #define MIN_LINK_MTU_SIZE 100
+/* See -H */
+#define FAILOVER_DEFAULT_TIMEOUT 200000
 
 using namespace cannelloni;
 
@@ -75,12 +79,39 @@ void printUsage() {
   std::cout << "\t -L ADDRESS \t\t listening ADDRESS, default: 0.0.0.0, ::" << std::endl;
   std::cout << "\t -r PORT \t\t remote port, default: 20000" << std::endl;
   std::cout << "\t -R ADDRESS \t\t remote ADDRESS (mandatory for UDP), default: 127.0.0.1, ::1" << std::endl;
+  std::cout << "\t -y ADDRESS \t\t remote ADDRESS of a second UDP path, every packet is sent over both paths" << std::endl;
+  std::cout << "\t -Y ADDRESS \t\t listening ADDRESS of the second UDP path (mandatory with -y, needs -L)" << std::endl;
+  std::cout << "\t -A ADDRESS \t\t remote ADDRESS to fail over to if the remote falls silent, can be given multiple times,"
+            << " with SCTP only further addresses of the peer" << std::endl;
+  std::cout << "\t -H timeout \t\t silence (us) after which the remote is considered dead, sends heartbeats while idle, default with -A: "
+            << FAILOVER_DEFAULT_TIMEOUT << std::endl;
   std::cout << "\t -I INTERFACE \t\t can interface, default: vcan0" << std::endl;
   std::cout << "\t -t timeout \t\t buffer timeout for can messages (us), default: 100000" << std::endl;
+  std::cout << "\t -a budget \t\t adapt the buffer timeout to the frame rate to fill packets, waiting at most budget (us), replaces -t" << std::endl;
   std::cout << "\t -x timeout \t\t drop CAN frames undeliverable for longer than timeout (us), 0 disables, default: 2000000" << std::endl;
+  std::cout << "\t -X timeout \t\t drop frames not sent to the network within timeout (us), 0 disables, default: 0" << std::endl;
   std::cout << "\t -T table.csv \t\t path to csv with individual timeouts" << std::endl;
+  std::cout << "\t -b frames \t\t initial size of each frame pool, default: 1000" << std::endl;
+  std::cout << "\t -B frames \t\t maximum size of each frame pool, default: 16000" << std::endl;
+  std::cout << "\t -q timeout \t\t shrink idle frame pools after timeout (us), default: keep the memory" << std::endl;
+  std::cout << "\t -M           \t\t allocate all frame pools at startup, no allocations afterwards (disables -q)" << std::endl;
+  std::cout << "\t -o policy \t\t frames to drop when a frame pool is nearly exhausted" << std::endl;
+  std::cout << "\t\t\t oldest : the oldest buffered frames" << std::endl;
+  std::cout << "\t\t\t newest : the newest buffered frames" << std::endl;
+  std::cout << "\t\t\t id     : the frames with the highest ID" << std::endl;
+  std::cout << "\t\t\t class  : the frames of the highest class (see -k)" << std::endl;
+  std::cout << "\t\t\t default: only frames that do not fit into the pool" << std::endl;
+  std::cout << "\t -k classes.csv \t path to csv with the drop class of each ID" << std::endl;
+  std::cout << "\t -c id[:mask],... \t only keep the latest frame of matching IDs pending for the network (hex, like candump)" << std::endl;
   std::cout << "\t -s           \t\t enable frame sorting" << std::endl;
   std::cout << "\t -p           \t\t no peer checking" << std::endl;
+  std::cout << "\t -U           \t\t connect the UDP socket, the kernel drops packets of other hosts and ports, not with -A" << std::endl;
+  std::cout << "\t -W workers \t\t receive UDP with this many sockets and threads (SO_REUSEPORT), default: 1" << std::endl;
+  std::cout << "\t -w           \t\t send 32 bit sequence numbers, the peer must support them" << std::endl;
+  std::cout << "\t -F packets \t\t send an FEC packet after every this many UDP packets (1 to " << FEC_MAX_GROUP_SIZE << "), the peer needs -F too" << std::endl;
+  std::cout << "\t -N packets \t\t keep this many sent UDP packets for retransmission and ask for lost ones (NACK), the peer needs -N too" << std::endl;
+  std::cout << "\t -K delay[:rate] \t pace UDP packets to what the path takes without more than delay (us) of queueing, up to rate (kbit/s), the peer needs -K too" << std::endl;
+  std::cout << "\t -O time[:packets] \t restore the order of received UDP packets, holding up to packets (default: 16, max: 64) for time (us)" << std::endl;
   std::cout << "\t -d [cubt]\t\t enable debug, can be any of these: " << std::endl;
   std::cout << "\t\t\t c : enable debugging of can frames" << std::endl;
 #ifdef SCTP_SUPPORT
@@ -93,11 +124,44 @@ void printUsage() {
   std::cout << "\t -4 \t\t\t use IPv4 (default)" << std::endl;
   std::cout << "\t -6 \t\t\t use IPv6" << std::endl;
   std::cout << "\t -m \t\t\t set MTU, default: 1500 bytes" << std::endl;
+  std::cout << "\t -G \t\t\t send UDP packets of a backlog with segmentation offload (GSO)" << std::endl;
+  std::cout << "\t -g \t\t\t receive coalesced UDP packets (GRO)" << std::endl;
   std::cout << "\t -f \t\t\t fork into background / daemon mode" << std::endl;
   std::cout << "\t -P \t\t\t pid file path (only in daemon mode), default: /var/run/cannelloni.pid" << std::endl;
   std::cout << "\t -h \t\t\t display this help text" << std::endl;
 }
 
+/* Parses a comma separated list of candump style filters
+ * (e.g. 123,12345678,100:7F0). Without a mask, three digits select a
+ * standard and more digits an extended ID. */
+bool parseIdFilters(const std::string &spec, std::vector<CANIdFilter> &filters) {
+  std::stringstream ss(spec);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    CANIdFilter filter;
+    char *end;
+    std::string::size_type colon = item.find(':');
+    std::string id = item.substr(0, colon);
+    if (id.empty())
+      return false;
+    filter.id = static_cast<uint32_t>(strtoul(id.c_str(), &end, 16));
+    if (*end != '\0')
+      return false;
+    if (colon != std::string::npos) {
+      filter.mask = static_cast<uint32_t>(strtoul(item.c_str() + colon + 1, &end, 16));
+      if (*end != '\0' || colon + 1 == item.size())
+        return false;
+    } else if (id.size() > 3) {
+      filter.id |= CAN_EFF_FLAG;
+      filter.mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_EFF_MASK;
+    } else {
+      filter.mask = CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK;
+    }
+    filters.push_back(filter);
+  }
+  return !filters.empty();
+}
+
 void daemonize(std::string pidFilePath) {
   pid_t pid = fork();
   if (pid < 0) {
@@ -160,6 +224,9 @@ void daemonize(std::string pidFilePath) {
 int main(int argc, char **argv) {
   int opt;
   bool remoteIPSupplied = false;
+  char secondRemoteIP[INET6_ADDRSTRLEN] = "";
+  char secondLocalIP[INET6_ADDRSTRLEN] = "";
+  std::vector<std::string> failoverIPs;
   bool sortUDP = false;
   bool checkPeer = true;
   bool useTCP = false;
@@ -178,15 +245,40 @@ int main(int argc, char **argv) {
   uint16_t localPort = 20000;
   std::string canInterfaceName = "vcan0";
   uint32_t bufferTimeout = 100000;
+  uint32_t latencyBudget = 0;
   uint32_t canTxStaleTimeout = 2000000; /* 2 s */
+  uint32_t netMaxAge = 0;
+  size_t framePoolSize = 1000;
+  size_t framePoolMax = 16000;
+  /* Pools keep the memory of the largest burst unless -q is given */
+  uint64_t framePoolQuietPeriod = 0;
+  bool preallocate = false;
+  bool segmentationOffload = false;
+  bool receiveOffload = false;
+  bool connectPeer = false;
+  bool wideSequence = false;
+  uint64_t reorderHoldTime = 0;
+  size_t retransmitPackets = 0;
+  size_t fecGroupSize = 0;
+  size_t reorderPackets = 16;
+  size_t receiveWorkers = 1;
+  uint64_t failoverTimeout = 0;
+  uint64_t congestionDelay = 0;
+  uint64_t congestionRate = CC_MAX_RATE * 8 / 1000;
+  bool failoverTimeoutSupplied = false;
   std::string timeoutTableFile;
+  std::string overflowPolicyName;
+  std::string dropClassTableFile;
+  std::vector<CANIdFilter> coalesceFilters;
   std::string pidFilePath = "/var/run/cannelloni.pid";
   /* Key is CAN ID, Value is timeout in us */
   std::map<uint32_t, uint32_t> timeoutTable;
+  /* Key is CAN ID, Value is the drop class, 0 is dropped last */
+  std::map<uint32_t, uint32_t> dropClassTable;
 
   struct debugOptions_t debugOptions = { /* can */ 0, /* udp */ 0, /* buffer */ 0, /* timer */ 0 };
 
-  const std::string argument_options = "C:l:L:r:R:I:t:x:T:d:m:P:hsp46f"
+  const std::string argument_options = "C:l:L:r:R:I:t:x:X:T:b:B:q:o:k:c:d:m:P:W:O:N:F:y:Y:A:H:K:a:hsp46fMGgUw"
 #ifdef SCTP_SUPPORT
   "S:";
 #else
@@ -257,18 +349,71 @@ int main(int argc, char **argv) {
         remoteIP[INET6_ADDRSTRLEN-1] = '\0';
         remoteIPSupplied = true;
         break;
+      case 'y':
+        strncpy(secondRemoteIP, optarg, INET6_ADDRSTRLEN-1);
+        secondRemoteIP[INET6_ADDRSTRLEN-1] = '\0';
+        break;
+      case 'Y':
+        strncpy(secondLocalIP, optarg, INET6_ADDRSTRLEN-1);
+        secondLocalIP[INET6_ADDRSTRLEN-1] = '\0';
+        break;
+      case 'A':
+        failoverIPs.push_back(optarg);
+        break;
+      case 'H':
+        failoverTimeout = strtoull(optarg, NULL, 10);
+        failoverTimeoutSupplied = true;
+        break;
       case 'I':
         canInterfaceName = std::string(optarg);
         break;
       case 't':
         bufferTimeout = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
         break;
+      case 'a':
+        latencyBudget = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
+        if (latencyBudget < BATCH_MIN_TIMEOUT) {
+          std::cout << "Usage Error: " << std::endl
+                    << "-a expects a latency budget of at least " << BATCH_MIN_TIMEOUT << " us" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
       case 'x':
         canTxStaleTimeout = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
         break;
+      case 'X':
+        netMaxAge = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
+        break;
       case 'T':
         timeoutTableFile = std::string(optarg);
         break;
+      case 'b':
+        framePoolSize = strtoul(optarg, NULL, 10);
+        break;
+      case 'B':
+        framePoolMax = strtoul(optarg, NULL, 10);
+        break;
+      case 'q':
+        framePoolQuietPeriod = strtoull(optarg, NULL, 10);
+        break;
+      case 'M':
+        preallocate = true;
+        break;
+      case 'o':
+        overflowPolicyName = std::string(optarg);
+        break;
+      case 'k':
+        dropClassTableFile = std::string(optarg);
+        break;
+      case 'c':
+        if (!parseIdFilters(std::string(optarg), coalesceFilters)) {
+          std::cout << "Usage Error: " << std::endl
+                    << "-c only accepts a comma separated list of id[:mask]" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
       case 'd':
         if (strchr(optarg, 'c'))
           debugOptions.can = 1;
@@ -301,6 +446,60 @@ int main(int argc, char **argv) {
       case 'f':
         forkIntoBackground = true;
         break;
+      case 'G':
+        segmentationOffload = true;
+        break;
+      case 'g':
+        receiveOffload = true;
+        break;
+      case 'U':
+        connectPeer = true;
+        break;
+      case 'O': {
+        char *end;
+        reorderHoldTime = strtoull(optarg, &end, 10);
+        if (*end == ':')
+          reorderPackets = strtoul(end + 1, &end, 10);
+        if (*end != '\0' || reorderPackets < 1 || reorderPackets > REORDER_MAX_PACKETS) {
+          std::cout << "Usage Error: " << std::endl
+                    << "-O expects time[:packets] with 1 to " << REORDER_MAX_PACKETS << " packets" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      }
+      case 'K': {
+        char *end;
+        congestionDelay = strtoull(optarg, &end, 10);
+        if (*end == ':')
+          congestionRate = strtoull(end + 1, &end, 10);
+        if (*end != '\0' || congestionDelay == 0 || congestionRate < CC_MIN_RATE * 8 / 1000) {
+          std::cout << "Usage Error: " << std::endl
+                    << "-K expects delay[:rate] with a non-zero delay and at least "
+                    << CC_MIN_RATE * 8 / 1000 << " kbit/s" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      }
+      case 'F':
+        fecGroupSize = strtoul(optarg, NULL, 10);
+        if (fecGroupSize < 1 || fecGroupSize > FEC_MAX_GROUP_SIZE) {
+          std::cout << "Usage Error: " << std::endl
+                    << "-F expects 1 to " << FEC_MAX_GROUP_SIZE << " packets" << std::endl;
+          printUsage();
+          return -1;
+        }
+        break;
+      case 'N':
+        retransmitPackets = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        wideSequence = true;
+        break;
+      case 'W':
+        receiveWorkers = strtoul(optarg, NULL, 10);
+        break;
       case 'P':
         pidFilePath = std::string(optarg);
         break;
@@ -324,6 +523,91 @@ int main(int argc, char **argv) {
     printUsage();
     return -1;
   }
+  if (receiveWorkers < 1 || receiveWorkers > UDP_MAX_RECEIVE_WORKERS) {
+    std::cout << "Usage Error: " << std::endl
+              << "The number of receive workers must be between 1 and "
+              << UDP_MAX_RECEIVE_WORKERS << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (receiveWorkers > 1 && (useTCP || useSCTP || connectPeer)) {
+    std::cout << "Usage Error: " << std::endl
+              << "Receive workers are only supported for unconnected UDP sockets" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (retransmitPackets > (wideSequence ? RETRANSMIT_MAX_PACKETS : RETRANSMIT_MAX_PACKETS_SEQ8)) {
+    std::cout << "Usage Error: " << std::endl
+              << "At most " << RETRANSMIT_MAX_PACKETS_SEQ8 << " packets (" << RETRANSMIT_MAX_PACKETS
+              << " with -w) can be kept for retransmission" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (retransmitPackets && receiveWorkers > 1) {
+    std::cout << "Usage Error: " << std::endl
+              << "Retransmission is not supported with receive workers" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (secondRemoteIP[0] || secondLocalIP[0]) {
+    const char *error = NULL;
+    if (!secondRemoteIP[0] || !secondLocalIP[0] || !localIP[0])
+      error = "A second path needs -y, -Y and -L";
+    else if (useTCP || useSCTP || receiveWorkers > 1 || !checkPeer)
+      error = "A second path is only supported for UDP without -W and -p";
+    if (error) {
+      std::cout << "Usage Error: " << std::endl
+                << error << std::endl
+                << std::endl;
+      printUsage();
+      return -1;
+    }
+  }
+  if (!failoverIPs.empty() && !failoverTimeoutSupplied)
+    failoverTimeout = FAILOVER_DEFAULT_TIMEOUT;
+  if (!failoverIPs.empty() || failoverTimeoutSupplied) {
+    const char *error = NULL;
+    if (failoverTimeout == 0)
+      error = "Only non-zero failover timeouts are allowed";
+    else if (useTCP)
+      error = "Failover is only supported for UDP and SCTP";
+    else if (receiveWorkers > 1 || secondRemoteIP[0])
+      error = "Failover is not supported with -W and -y";
+    else if (connectPeer && !failoverIPs.empty())
+      error = "A connected UDP socket (-U) can't fail over to another remote";
+    if (error) {
+      std::cout << "Usage Error: " << std::endl
+                << error << std::endl
+                << std::endl;
+      printUsage();
+      return -1;
+    }
+  }
+  if (congestionDelay && (useTCP || useSCTP || receiveWorkers > 1 || secondRemoteIP[0])) {
+    std::cout << "Usage Error: " << std::endl
+              << "Congestion control is only supported for UDP without -W and -y" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (latencyBudget && useTCP) {
+    std::cout << "Usage Error: " << std::endl
+              << "Adaptive batching is only supported for UDP and SCTP" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (connectPeer && !checkPeer) {
+    std::cout << "Usage Error: " << std::endl
+              << "Can't connect the UDP socket without peer checking" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
   if (!remoteIPSupplied && !useSCTP && !useTCP) {
     std::cout << "Usage Error: " << std::endl
               << "Remote IP not supplied" << std::endl
@@ -338,6 +622,27 @@ int main(int argc, char **argv) {
     printUsage();
     return -1;
   }
+  if (framePoolSize == 0 || framePoolMax < framePoolSize) {
+    std::cout << "Usage Error: " << std::endl
+              << "The frame pool needs a non-zero initial size that does not exceed its maximum size" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (!overflowPolicyName.empty() && !createOverflowPolicy(overflowPolicyName, dropClassTable)) {
+    std::cout << "Usage Error: " << std::endl
+              << "-o only accepts oldest, newest, id or class" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
+  if (overflowPolicyName == "class" && dropClassTableFile.empty()) {
+    std::cout << "Usage Error: " << std::endl
+              << "-o class requires a class table (-k)" << std::endl
+              << std::endl;
+    printUsage();
+    return -1;
+  }
   if (linkMtuSize < MIN_LINK_MTU_SIZE) {
     std::cout << "Usage Error: " << std::endl
               << "Specify a link mtu size greater than " << MIN_LINK_MTU_SIZE << std::endl
@@ -380,7 +685,28 @@ int main(int argc, char **argv) {
     timeoutTable = mapParser.read();
   }
 
+  if (!dropClassTableFile.empty()) {
+    CSVMapParser<uint32_t,uint32_t> mapParser;
+    if(!mapParser.open(dropClassTableFile)) {
+      lerror << "Unable to open " << dropClassTableFile << "." << std::endl;
+      return -1;
+    }
+    if(!mapParser.parse()) {
+      lerror << "Error while parsing " << dropClassTableFile << "." << std::endl;
+      return -1;
+    }
+    if(!mapParser.close()) {
+      lerror << "Error while closing" << dropClassTableFile << "." << std::endl;
+      return -1;
+    }
+    dropClassTable = mapParser.read();
+  }
+
   if (debugOptions.timer) {
+    if (latencyBudget) {
+      linfo << "Adapting the timeout of other frames to the frame rate, at most "
+            << latencyBudget << " us." << std::endl;
+    }
     if (timeoutTable.empty()) {
       linfo << "No custom timeout table specified, using "
             << bufferTimeout << " us for all frames." << std::endl;
@@ -438,12 +764,45 @@ int main(int argc, char **argv) {
     return -1;
   }
 
+  struct sockaddr_storage secondRemoteAddr;
+  struct sockaddr_storage secondLocalAddr;
+  memset(&secondRemoteAddr, 0, sizeof(sockaddr_storage));
+  memset(&secondLocalAddr, 0, sizeof(sockaddr_storage));
+  if (secondRemoteIP[0]) {
+    if (!parseAddress(secondRemoteIP, (struct sockaddr *) &secondRemoteAddr, addressFamily)) {
+      lerror << "Invalid remote address of the second path";
+      return -1;
+    }
+    if (!parseAddress(secondLocalIP, (struct sockaddr *) &secondLocalAddr, addressFamily)) {
+      lerror << "Invalid listen address of the second path";
+      return -1;
+    }
+  }
+
+  std::vector<struct sockaddr_storage> failoverAddrs(failoverIPs.size());
+  for (size_t i = 0; i < failoverIPs.size(); i++) {
+    memset(&failoverAddrs[i], 0, sizeof(sockaddr_storage));
+    if (!parseAddress(failoverIPs[i].c_str(), (struct sockaddr *) &failoverAddrs[i], addressFamily)) {
+      lerror << "Invalid failover address " << failoverIPs[i];
+      return -1;
+    }
+    if (addressFamily == AF_INET)
+      ((struct sockaddr_in *) &failoverAddrs[i])->sin_port = htons(remotePort);
+    else
+      ((struct sockaddr_in6 *) &failoverAddrs[i])->sin6_port = htons(remotePort);
+  }
+
+  /* Both paths use the same ports */
   if (addressFamily == AF_INET) {
     ((struct sockaddr_in *) &remoteAddr)->sin_port = htons(remotePort);
     ((struct sockaddr_in *) &localAddr)->sin_port = htons(localPort);
+    ((struct sockaddr_in *) &secondRemoteAddr)->sin_port = htons(remotePort);
+    ((struct sockaddr_in *) &secondLocalAddr)->sin_port = htons(localPort);
   } else if (addressFamily == AF_INET6) {
     ((struct sockaddr_in6 *) &remoteAddr)->sin6_port = htons(remotePort);
     ((struct sockaddr_in6 *) &localAddr)->sin6_port = htons(localPort);
+    ((struct sockaddr_in6 *) &secondRemoteAddr)->sin6_port = htons(remotePort);
+    ((struct sockaddr_in6 *) &secondLocalAddr)->sin6_port = htons(localPort);
   }
 
   if (forkIntoBackground) {
@@ -452,6 +811,8 @@ int main(int argc, char **argv) {
   }
 
   std::unique_ptr<ConnectionThread> netThread;
+  /* Set if netThread is a UDPThread */
+  UDPThread *udpThreadPtr = NULL;
   if (useTCP && tcpRole == TCP_SERVER) {
     netThread = std::make_unique<TCPServerThread>(debugOptions, TCPServerThreadParams {
         .remoteAddr = remoteAddr,
@@ -478,6 +839,10 @@ int main(int argc, char **argv) {
     });
     sctpThread.get()->setTimeout(bufferTimeout);
     sctpThread.get()->setTimeoutTable(timeoutTable);
+    sctpThread.get()->setLatencyBudget(latencyBudget);
+    sctpThread.get()->setFailoverTimeout(failoverTimeout);
+    for (const struct sockaddr_storage &addr : failoverAddrs)
+      sctpThread.get()->addFailoverRemote(addr);
     netThread = std::move(sctpThread);
 #endif
   } else {
@@ -493,16 +858,62 @@ int main(int argc, char **argv) {
 
     udpThread.get()->setTimeout(bufferTimeout);
     udpThread.get()->setTimeoutTable(timeoutTable);
+    udpThread.get()->setLatencyBudget(latencyBudget);
+    udpThread.get()->setSegmentationOffload(segmentationOffload);
+    udpThread.get()->setReceiveOffload(receiveOffload);
+    udpThread.get()->setConnectPeer(connectPeer);
+    udpThread.get()->setWideSequence(wideSequence);
+    udpThread.get()->setReorder(reorderHoldTime, reorderPackets);
+    udpThread.get()->setRetransmit(retransmitPackets);
+    udpThread.get()->setForwardErrorCorrection(fecGroupSize);
+    if (secondRemoteIP[0])
+      udpThread.get()->setSecondPath(secondRemoteAddr, secondLocalAddr);
+    udpThread.get()->setCongestionControl(congestionDelay, congestionRate * 1000 / 8);
+    udpThread.get()->setFailoverTimeout(failoverTimeout);
+    for (const struct sockaddr_storage &addr : failoverAddrs)
+      udpThread.get()->addFailoverRemote(addr);
+    udpThreadPtr = udpThread.get();
     netThread = std::move(udpThread);
   }
   auto canThread = std::make_unique<CANThread>(debugOptions, canInterfaceName);
   canThread->setTxStaleTimeout(canTxStaleTimeout);
-  auto netFrameBuffer = std::make_unique<FrameBuffer>(1000,16000);
-  auto canFrameBuffer = std::make_unique<FrameBuffer>(1000,16000);
+  auto netFrameBuffer = std::make_unique<FrameBuffer>(framePoolSize, framePoolMax);
+  auto canFrameBuffer = std::make_unique<FrameBuffer>(framePoolSize, framePoolMax);
+  /* Every additional UDP receive worker hands its frames to the
+   * CANThread through a buffer of its own */
+  std::vector<std::unique_ptr<FrameBuffer>> workerFrameBuffers;
+  for (size_t i = 1; i < receiveWorkers; i++) {
+    workerFrameBuffers.push_back(std::make_unique<FrameBuffer>(framePoolSize, framePoolMax));
+  }
+  std::vector<FrameBuffer*> frameBuffers = { netFrameBuffer.get(), canFrameBuffer.get() };
+  for (auto &buffer : workerFrameBuffers) {
+    frameBuffers.push_back(buffer.get());
+  }
+  /* The CAN side has its own stale check, see -x */
+  netFrameBuffer->setMaxAge(netMaxAge);
+  /* Only the frames waiting for the network are coalesced, frames to
+   * the bus are written in full */
+  netFrameBuffer->setCoalescing(coalesceFilters);
+  for (FrameBuffer *buffer : frameBuffers) {
+    /* Keep half of the initial pool free after shrinking, -M never
+     * releases memory */
+    if (framePoolQuietPeriod && !preallocate)
+      buffer->setTrimPolicy(framePoolQuietPeriod, framePoolSize / 2, framePoolSize);
+    if (!overflowPolicyName.empty()) {
+      /* Every buffer needs its own instance, policies keep scratch state */
+      buffer->setOverflowPolicy(createOverflowPolicy(overflowPolicyName, dropClassTable));
+    }
+    if (preallocate)
+      buffer->preallocate();
+  }
   netThread->setPeerThread(canThread.get());
   netThread->setFrameBuffer(netFrameBuffer.get());
   canThread->setPeerThread(netThread.get());
   canThread->setFrameBuffer(canFrameBuffer.get());
+  for (auto &buffer : workerFrameBuffers) {
+    canThread->addInputBuffer(buffer.get());
+    udpThreadPtr->addReceiveWorker(buffer.get());
+  }
   int netStartReturn = netThread->start();
   int canStartReturn = canThread->start();
 
@@ -543,8 +954,9 @@ int main(int argc, char **argv) {
   canThread->join();
 
   /* Clear/free pools once all threads are joined */
-  netFrameBuffer->clearPool();
-  canFrameBuffer->clearPool();
+  for (FrameBuffer *buffer : frameBuffers) {
+    buffer->clearPool();
+  }
 
   close(signalFD);
   return 0;
@@ -29,11 +29,20 @@ namespace cannelloni {
 #define CANNELLONI_FRAME_BASE_SIZE 5
 /* Size in byte of UDPDataPacket */
 #define CANNELLONI_DATA_PACKET_BASE_SIZE 5
+/* Size in byte of the sequence number that follows the header of DATA_SEQ32 */
+#define CANNELLONI_SEQ32_SIZE 4
 
 #define CANNELLONI_FRAME_VERSION 2
 #define CANFD_FRAME              0x80
 
-enum op_codes {DATA, ACK, NACK};
+/*
+ * NACK packets are described by CannelloniNackPacket, FEC packets by
+ * CannelloniFecPacket and FEEDBACK packets by CannelloniFeedbackPacket.
+ * DATA_SEQ32 is a DATA packet with the full 32 bit sequence number
+ * (network byte order) between the header and the first frame, seq_no
+ * holds its lowest byte
+ */
+enum op_codes {DATA, ACK, NACK, DATA_SEQ32, FEC, FEEDBACK};
 
 struct __attribute__((__packed__)) CannelloniDataPacket {
   /* Version */
@@ -46,6 +55,50 @@ struct __attribute__((__packed__)) CannelloniDataPacket {
   uint16_t count;
 };
 
+/*
+ * Asks for the retransmission of lost DATA packets. The header is the
+ * one of a data packet with op_code NACK and count 0, seq_no holds the
+ * lowest byte of first. first and mask are in network byte order.
+ */
+struct __attribute__((__packed__)) CannelloniNackPacket {
+  struct CannelloniDataPacket header;
+  /* Sequence number of the first lost packet */
+  uint32_t first;
+  /* Bit i is set if packet first + 1 + i is lost as well */
+  uint32_t mask;
+};
+
+/*
+ * Parity of the data packets first to first + count - 1, count is the
+ * one of the header. It is followed by the XOR of these packets, each
+ * padded with zeros to the longest one. seq_no holds the lowest byte
+ * of first, first and length are in network byte order.
+ */
+struct __attribute__((__packed__)) CannelloniFecPacket {
+  struct CannelloniDataPacket header;
+  uint32_t first;
+  /* XOR of the lengths of the packets */
+  uint16_t length;
+};
+
+/*
+ * Tells a sender with congestion control how its packets arrive. The
+ * header is the one of a data packet with op_code FEEDBACK and count 0,
+ * seq_no holds the lowest byte of seqNo. All fields are in network
+ * byte order.
+ */
+struct __attribute__((__packed__)) CannelloniFeedbackPacket {
+  struct CannelloniDataPacket header;
+  /* Sequence number of the newest packet received */
+  uint32_t seqNo;
+  /* Its arrival in us of the receiver's clock, which is unrelated to
+   * the one of the sender */
+  uint32_t timestamp;
+  /* Packets received and lost so far */
+  uint32_t received;
+  uint32_t lost;
+};
+
 /*
  * Since we are buffering CAN Frames, it is a good idea
  * to order them by their identifier to mimic a CAN bus
@@ -45,6 +45,7 @@ CANThread::CANThread(const struct debugOptions_t &debugOptions, const std::strin
   , m_canfd(false)
   , m_busUsable(true)
   , m_canInterfaceName(canInterfaceName)
+  , m_nextInputBuffer(0)
   , m_rxCount(0)
   , m_txCount(0)
   , m_txDropCount(0)
@@ -151,38 +152,39 @@ void CANThread::run() {
     if (FD_ISSET(m_timer.getFd(), &readfds)) {
       if (m_timer.read() > 0) {
         /* We transmit our buffer */
-        if (m_frameBuffer->getFrameBufferSize())
-          transmitBuffer();
+        transmitBuffers();
+        /* We are the producer of our peer's pool */
+        m_peerThread->getFrameBuffer()->trimPool(m_debugOptions.buffer);
       }
     }
     if (FD_ISSET(m_canSocket, &readfds)) {
-      /* Request frame from frameBuffer */
-      struct canfd_frame *frame = m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
-      if (frame == NULL) {
-        continue;
-      }
-      receivedBytes = recv(m_canSocket, frame, sizeof(struct canfd_frame), 0);
+      /* The size class of the frame is only known after reading it */
+      struct canfd_frame rxFrame;
+      receivedBytes = recv(m_canSocket, &rxFrame, sizeof(struct canfd_frame), 0);
       if (receivedBytes < 0) {
         if (errno == EWOULDBLOCK || errno == EAGAIN) {
           /* Timeout occurred */
-          m_peerThread->getFrameBuffer()->insertFramePool(frame);
           continue;
         } else if (errno == ENETDOWN || errno == ENODEV) {
           /* the interface is down, continue can come back later */
-          m_peerThread->getFrameBuffer()->insertFramePool(frame);
           continue;
         } else {
-          m_peerThread->getFrameBuffer()->insertFramePool(frame);
           lerror << "CAN read error" << std::endl;
           break;
         }
       } else if (receivedBytes == CAN_MTU || receivedBytes == CANFD_MTU) {
         /* Error frames are delivered on the same socket */
-        if (frame->can_id & CAN_ERR_FLAG) {
-          handleErrorFrame(frame);
-          m_peerThread->getFrameBuffer()->insertFramePool(frame);
+        if (rxFrame.can_id & CAN_ERR_FLAG) {
+          handleErrorFrame(&rxFrame);
+          continue;
+        }
+        /* Request frame from frameBuffer */
+        struct canfd_frame *frame = m_peerThread->getFrameBuffer()->requestFrame(
+            receivedBytes == CANFD_MTU ? FRAME_CLASS_CANFD : FRAME_CLASS_CAN, true, m_debugOptions.buffer);
+        if (frame == NULL) {
           continue;
         }
+        memcpy(frame, &rxFrame, receivedBytes);
         m_rxCount++;
         /* If it is a CAN FD frame, encode this in len */
         if (receivedBytes == CANFD_MTU) {
@@ -203,6 +205,8 @@ void CANThread::run() {
   }
   if (m_debugOptions.buffer) {
     m_frameBuffer->debug();
+    for (FrameBuffer *buffer : m_inputBuffers)
+      buffer->debug();
   }
   linfo << "Shutting down. CAN Transmission Summary: TX: " << m_txCount << " RX: " << m_rxCount << " DROP: " << m_txDropCount << std::endl;
   shutdown(m_canSocket, SHUT_RDWR);
@@ -214,20 +218,43 @@ void CANThread::transmitFrame(canfd_frame* frame) {
   fireTimer();
 }
 
-void CANThread::transmitBuffer() {
+bool CANThread::addInputBuffer(FrameBuffer *buffer) {
+  m_inputBuffers.push_back(buffer);
+  return true;
+}
+
+void CANThread::transmitFrame(FrameBuffer *buffer, canfd_frame *frame) {
+  buffer->insertFrame(frame);
+  fireTimer();
+}
+
+void CANThread::transmitBuffers() {
+  const size_t count = m_inputBuffers.size() + 1;
+  /* Rotate the first buffer, so a busy bus does not starve the others */
+  size_t first = m_nextInputBuffer;
+  m_nextInputBuffer = (m_nextInputBuffer + 1) % count;
+  for (size_t i = 0; i < count; i++) {
+    size_t index = (first + i) % count;
+    FrameBuffer *buffer = index ? m_inputBuffers[index - 1] : m_frameBuffer;
+    if (buffer->getFrameBufferSize() && !transmitBuffer(buffer))
+      break;
+  }
+}
+
+bool CANThread::transmitBuffer(FrameBuffer *buffer) {
   ssize_t transmittedBytes = 0;
   /* Loop here until buffer is empty or we cannot write anymore */
   while(1) {
-    canfd_frame *frame = m_frameBuffer->requestBufferFront();
+    canfd_frame *frame = buffer->requestBufferFront();
     bool frameIsCANFD = false;
     if (frame == NULL)
-      break;
+      return true;
     /* If the controller reports the bus as unusable (bus-off / error-passive)
      * the frame is undeliverable. Drop it instead of retrying forever and
      * flushing stale data once the bus recovers. */
     if (!m_busUsable) {
       frame->len &= ~(CANFD_FRAME);
-      m_frameBuffer->insertFramePool(frame);
+      buffer->insertFramePool(frame);
       m_txDropCount++;
       continue;
     }
@@ -248,7 +275,7 @@ void CANThread::transmitBuffer() {
         /* Something is wrong with the setup */
         lwarn << "Received a CAN FD for a socket that only supports (CAN 2.0)." << std::endl;
         frame->len &= ~(CANFD_FRAME);
-        m_frameBuffer->insertFramePool(frame);
+        buffer->insertFramePool(frame);
         continue;
       } else {
         /* No CAN FD socket, use legacy MTU */
@@ -257,7 +284,7 @@ void CANThread::transmitBuffer() {
     }
     if (transmittedBytes == CANFD_MTU || transmittedBytes == CAN_MTU) {
       /* Put frame back into pool */
-      m_frameBuffer->insertFramePool(frame);
+      buffer->insertFramePool(frame);
       m_txCount++;
       /* If we had been dropping stale frames, the bus is now usable again. */
       if (m_txStaleWarned) {
@@ -273,7 +300,7 @@ void CANThread::transmitBuffer() {
       /* ENETDOWN: the interface is down, the frame cannot be transmitted at all, drop it. */
       if (writeErrno == ENETDOWN) {
         frame->len &= ~(CANFD_FRAME);
-        m_frameBuffer->insertFramePool(frame);
+        buffer->insertFramePool(frame);
         m_txDropCount++;
         continue;
       }
@@ -295,7 +322,7 @@ void CANThread::transmitBuffer() {
           std::chrono::duration_cast<std::chrono::microseconds>(now - m_txStuckSince)
               .count() > static_cast<int64_t>(m_txStaleTimeout)) {
         frame->len &= ~(CANFD_FRAME);
-        m_frameBuffer->insertFramePool(frame);
+        buffer->insertFramePool(frame);
         m_txDropCount++;
         if (!m_txStaleWarned) {
           lwarn << "Frames undeliverable on >" << m_canInterfaceName << "< for > "
@@ -309,14 +336,14 @@ void CANThread::transmitBuffer() {
         frame->len |= CANFD_FRAME;
       }
       /* Put frame back into buffer and retry after the backoff interval. */
-      m_frameBuffer->returnFrame(frame);
+      buffer->returnFrame(frame);
       m_timer.adjust(CAN_TIMEOUT, m_retryInterval);
       if (m_debugOptions.can)
         linfo << "CAN write failed, retry in " << m_retryInterval << " us." << std::endl;
       m_retryInterval *= 2;
       if (m_retryInterval > CAN_TX_RETRY_MAX)
         m_retryInterval = CAN_TX_RETRY_MAX;
-      break;
+      return false;
     }
   }
 }
@@ -23,6 +23,7 @@
 #include <string>
 #include <stdint.h>
 #include <chrono>
+#include <vector>
 
 #include "connection.h"
 #include "timer.h"
@@ -44,12 +45,18 @@ class CANThread : public ConnectionThread {
 
     virtual void transmitFrame(canfd_frame *frame);
 
+    virtual bool addInputBuffer(FrameBuffer *buffer);
+    virtual void transmitFrame(FrameBuffer *buffer, canfd_frame *frame);
+
     /* Drop frames that have been undeliverable on a busy bus for longer than
      * timeout_us. 0 (default) disables the staleness drop. */
     void setTxStaleTimeout(uint32_t timeout_us);
 
   private:
-    void transmitBuffer();
+    /* Transmits the frames of m_frameBuffer and all input buffers */
+    void transmitBuffers();
+    /* Returns false if the bus is busy and the frame has been put back */
+    bool transmitBuffer(FrameBuffer *buffer);
     void fireTimer();
     /* Updates m_busUsable based on a received CAN error frame */
     void handleErrorFrame(canfd_frame *frame);
@@ -66,6 +73,12 @@ class CANThread : public ConnectionThread {
 
     std::string m_canInterfaceName;
 
+    /* See addInputBuffer */
+    std::vector<FrameBuffer*> m_inputBuffers;
+    /* Input buffer that is served first by the next transmitBuffers,
+     * 0 is m_frameBuffer */
+    size_t m_nextInputBuffer;
+
     /* Performance Counters */
     uint64_t m_rxCount;
     uint64_t m_txCount;
@@ -0,0 +1,200 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "congestion.h"
+
+using namespace cannelloni;
+
+/* Rate changes */
+#define CC_LOSS_DECREASE 0.7
+#define CC_TIMEOUT_DECREASE 0.5
+/* Relative change of the rate per second, at no queueing delay at all
+ * or at twice the target delay */
+#define CC_GAIN 0.2
+
+CongestionController::CongestionController(uint64_t targetDelay, uint64_t maxRate, uint16_t packetSize)
+  : m_targetDelay(std::max<uint64_t>(targetDelay, 1))
+  , m_maxRate(std::max<uint64_t>(maxRate, CC_MIN_RATE))
+  , m_packetSize(packetSize)
+  , m_rate(std::min<double>(CC_INITIAL_RATE, m_maxRate))
+  , m_tokens(2.0 * packetSize)
+  , m_lastRefill(clock())
+  , m_sent(CC_SEND_HISTORY)
+  , m_sentBytes(0)
+  , m_hasFeedback(false)
+  , m_lastFeedback(0)
+  , m_lastReceived(0)
+  , m_lastLost(0)
+  , m_lastDecrease(0)
+  , m_hasDelay(false)
+  , m_delayOrigin(0)
+  , m_baseStart(0)
+  , m_baseIndex(0)
+  , m_currentIndex(0)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+uint64_t CongestionController::clock() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CongestionController::refill(uint64_t now) {
+  if (now > m_lastRefill) {
+    const double burst = std::max(2.0 * m_packetSize, m_rate * CC_BURST_TIME / 1000000);
+    m_tokens = std::min(burst, m_tokens + m_rate * (now - m_lastRefill) / 1000000);
+    m_lastRefill = now;
+  }
+}
+
+bool CongestionController::canSend(uint64_t now) {
+  refill(now);
+  return m_tokens > 0;
+}
+
+uint64_t CongestionController::sendDelay(uint64_t now) {
+  refill(now);
+  if (m_tokens > 0)
+    return 0;
+  return static_cast<uint64_t>(-m_tokens * 1000000 / m_rate) + 1;
+}
+
+void CongestionController::onSent(uint16_t len, uint64_t now) {
+  refill(now);
+  m_tokens -= len;
+  m_sentBytes += len;
+}
+
+void CongestionController::onPacketSent(uint32_t seqNo, uint16_t len, uint64_t now) {
+  onSent(len, now);
+  SentPacket &sent = m_sent[seqNo & (CC_SEND_HISTORY - 1)];
+  sent.seqNo = seqNo;
+  sent.time = now;
+}
+
+bool CongestionController::queueDelay(uint32_t seqNo, uint8_t bits, uint32_t timestamp,
+                                      uint64_t now, uint64_t &delay) {
+  const uint32_t mask = (bits == 32) ? 0xffffffff : 0xff;
+  const SentPacket &sent = m_sent[seqNo & (CC_SEND_HISTORY - 1)];
+  if (!sent.time || (sent.seqNo & mask) != (seqNo & mask))
+    return false;
+  /* Includes the offset between the clocks, which cancels out */
+  uint32_t oneWay = timestamp - static_cast<uint32_t>(sent.time);
+  if (!m_hasDelay) {
+    m_hasDelay = true;
+    m_delayOrigin = oneWay;
+    std::fill(m_baseDelays, m_baseDelays + CC_BASE_HISTORY, INT64_MAX);
+    std::fill(m_currentDelays, m_currentDelays + CC_CURRENT_HISTORY, INT64_MAX);
+    m_baseStart = now;
+  }
+  int64_t sample = static_cast<int32_t>(oneWay - m_delayOrigin);
+  /* One minimum per second, the oldest one is forgotten */
+  if (now - m_baseStart >= 1000000) {
+    m_baseIndex = (m_baseIndex + 1) % CC_BASE_HISTORY;
+    m_baseDelays[m_baseIndex] = sample;
+    m_baseStart = now;
+  } else {
+    m_baseDelays[m_baseIndex] = std::min(m_baseDelays[m_baseIndex], sample);
+  }
+  m_currentDelays[m_currentIndex] = sample;
+  m_currentIndex = (m_currentIndex + 1) % CC_CURRENT_HISTORY;
+
+  int64_t base = *std::min_element(m_baseDelays, m_baseDelays + CC_BASE_HISTORY);
+  int64_t current = *std::min_element(m_currentDelays, m_currentDelays + CC_CURRENT_HISTORY);
+  delay = std::max<int64_t>(current - base, 0);
+  return true;
+}
+
+bool CongestionController::decrease(double factor, uint64_t interval, uint64_t now) {
+  if (m_lastDecrease && now - m_lastDecrease < interval)
+    return false;
+  m_rate = std::max<double>(m_rate * factor, CC_MIN_RATE);
+  m_lastDecrease = now;
+  return true;
+}
+
+void CongestionController::onFeedback(uint32_t seqNo, uint8_t bits, uint32_t timestamp,
+                                      uint32_t received, uint32_t lost, uint64_t now) {
+  m_stats.feedback++;
+  const bool first = !m_hasFeedback;
+  const uint64_t elapsed = now - m_lastFeedback;
+  const uint64_t receivedDelta = received - m_lastReceived;
+  /* Goes down when a packet that was counted as lost shows up */
+  const uint64_t lostDelta = std::max<int32_t>(static_cast<int32_t>(lost - m_lastLost), 0);
+  const uint64_t sentBytes = m_sentBytes;
+  m_hasFeedback = true;
+  m_lastFeedback = now;
+  m_lastReceived = received;
+  m_lastLost = lost;
+  m_sentBytes = 0;
+
+  uint64_t delay;
+  bool hasDelay = queueDelay(seqNo, bits, timestamp, now, delay);
+  if (hasDelay) {
+    m_stats.queueDelay = delay;
+    m_stats.queueDelayMax = std::max(m_stats.queueDelayMax, delay);
+  }
+  /* The counters are only meaningful as differences */
+  if (first)
+    return;
+
+  if (lostDelta * 100 > (receivedDelta + lostDelta) * CC_LOSS_THRESHOLD) {
+    if (decrease(CC_LOSS_DECREASE, CC_DECREASE_INTERVAL, now))
+      m_stats.lossDecreases++;
+  } else if (hasDelay && delay > 2 * m_targetDelay) {
+    /* Far off, back off like for a loss until the queue has drained */
+    if (decrease(CC_LOSS_DECREASE, CC_DECREASE_INTERVAL + delay, now))
+      m_stats.delayDecreases++;
+  } else if (hasDelay) {
+    /* Steer towards the target delay, in proportion to how far off it is */
+    double offTarget = (static_cast<double>(m_targetDelay) - delay) / m_targetDelay;
+    offTarget = std::max(offTarget, -1.0);
+    /* Only a rate that is actually used is known to work */
+    if (offTarget > 0 && sentBytes * 2 * 1000000 < m_rate * elapsed)
+      return;
+    double change = CC_GAIN * offTarget * std::min<uint64_t>(elapsed, CC_FEEDBACK_TIMEOUT) / 1000000;
+    m_rate = std::min(std::max<double>(m_rate * (1.0 + change), CC_MIN_RATE), m_maxRate);
+  }
+}
+
+void CongestionController::checkFeedback(uint64_t now) {
+  if (!m_hasFeedback || !m_sentBytes || now - m_lastFeedback < CC_FEEDBACK_TIMEOUT)
+    return;
+  if (decrease(CC_TIMEOUT_DECREASE, CC_FEEDBACK_TIMEOUT, now))
+    m_stats.timeoutDecreases++;
+}
+
+void CongestionController::countPaced() {
+  m_stats.paced++;
+}
+
+uint64_t CongestionController::getRate() const {
+  return m_rate;
+}
+
+const CongestionStats& CongestionController::getStats() const {
+  return m_stats;
+}
@@ -0,0 +1,145 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace cannelloni {
+
+/* Rates are in bytes per second */
+#define CC_INITIAL_RATE 125000
+#define CC_MIN_RATE 8000
+#define CC_MAX_RATE 125000000
+/* The receiver reports every interval (us) it has received packets in */
+#define CC_FEEDBACK_INTERVAL 25000
+/* No feedback for this long (us) while sending halves the rate */
+#define CC_FEEDBACK_TIMEOUT 500000
+/* Time (us) a decrease is given to take effect before the next one */
+#define CC_DECREASE_INTERVAL 100000
+/* The pacer lets bursts of this many us at the current rate through */
+#define CC_BURST_TIME 5000
+/* Send times kept to match the feedback with, a power of two */
+#define CC_SEND_HISTORY 256
+/* The base delay is the lowest one of this many seconds */
+#define CC_BASE_HISTORY 10
+/* The queueing delay is the lowest one of this many feedbacks */
+#define CC_CURRENT_HISTORY 4
+/* Loss of more than this percentage of the packets cuts the rate */
+#define CC_LOSS_THRESHOLD 5
+
+struct CongestionStats {
+  uint64_t feedback;
+  uint64_t lossDecreases;
+  uint64_t delayDecreases;
+  uint64_t timeoutDecreases;
+  /* Flushes that were cut short by the pacer */
+  uint64_t paced;
+  /* Last estimate of the queueing delay (us) */
+  uint64_t queueDelay;
+  uint64_t queueDelayMax;
+};
+
+/*
+ * Estimates the rate the network path can take from the feedback of
+ * the receiver and paces the packets to it.
+ *
+ * Every feedback carries the newest sequence number received, its
+ * arrival time on the receiver's clock and the number of packets
+ * received and lost so far. Together with the send time of that packet
+ * it gives a one-way delay sample. The clocks are not synchronized, but
+ * the lowest sample of the last CC_BASE_HISTORY seconds stands for an
+ * empty queue, so the difference to it is the queueing delay. The rate
+ * is cut when packets are lost or the queueing delay exceeds the
+ * target, and grows in proportion to how far it stays below the
+ * target otherwise. Packets are paced with a token bucket.
+ */
+class CongestionController {
+  public:
+    /* targetDelay in us, maxRate in bytes per second */
+    CongestionController(uint64_t targetDelay, uint64_t maxRate, uint16_t packetSize);
+
+    /* Whether the next packet may be sent at now */
+    bool canSend(uint64_t now);
+    /* Microseconds until the next packet may be sent, 0 if right away */
+    uint64_t sendDelay(uint64_t now);
+    /* Accounts a data packet and remembers when it was sent */
+    void onPacketSent(uint32_t seqNo, uint16_t len, uint64_t now);
+    /* Accounts any other packet, e.g. a retransmission */
+    void onSent(uint16_t len, uint64_t now);
+    /* Adjusts the rate to a feedback of the receiver, bits is the width
+     * of the sequence numbers sent (8 or 32) */
+    void onFeedback(uint32_t seqNo, uint8_t bits, uint32_t timestamp,
+                    uint32_t received, uint32_t lost, uint64_t now);
+    /* Cuts the rate if the feedback has stopped although packets have
+     * been sent, call at least every CC_FEEDBACK_INTERVAL */
+    void checkFeedback(uint64_t now);
+    void countPaced();
+
+    /* Bytes per second */
+    uint64_t getRate() const;
+    const CongestionStats& getStats() const;
+
+    /* Microseconds of a steady clock */
+    static uint64_t clock();
+
+  private:
+    struct SentPacket {
+      uint32_t seqNo;
+      uint64_t time;
+    };
+
+    void refill(uint64_t now);
+    /* Returns false if the packet is no longer known */
+    bool queueDelay(uint32_t seqNo, uint8_t bits, uint32_t timestamp,
+                    uint64_t now, uint64_t &delay);
+    /* Returns false if the last decrease is less than interval ago */
+    bool decrease(double factor, uint64_t interval, uint64_t now);
+
+  private:
+    uint64_t m_targetDelay;
+    double m_maxRate;
+    uint16_t m_packetSize;
+    double m_rate;
+    /* Token bucket of the pacer in bytes, negative after a burst */
+    double m_tokens;
+    uint64_t m_lastRefill;
+    std::vector<SentPacket> m_sent;
+    /* Bytes sent since the last feedback */
+    uint64_t m_sentBytes;
+    bool m_hasFeedback;
+    uint64_t m_lastFeedback;
+    uint32_t m_lastReceived;
+    uint32_t m_lastLost;
+    uint64_t m_lastDecrease;
+    /* One-way delays are kept relative to the first one */
+    bool m_hasDelay;
+    uint32_t m_delayOrigin;
+    int64_t m_baseDelays[CC_BASE_HISTORY];
+    uint64_t m_baseStart;
+    size_t m_baseIndex;
+    int64_t m_currentDelays[CC_CURRENT_HISTORY];
+    size_t m_currentIndex;
+    CongestionStats m_stats;
+};
+
+}
@@ -47,3 +47,11 @@ void ConnectionThread::setPeerThread(ConnectionThread *thread) {
 ConnectionThread* ConnectionThread::getPeerThread() {
   return m_peerThread;
 }
+
+bool ConnectionThread::addInputBuffer(FrameBuffer *) {
+  return false;
+}
+
+void ConnectionThread::transmitFrame(FrameBuffer *buffer, canfd_frame *frame) {
+  buffer->discardFrame(frame);
+}
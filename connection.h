@@ -47,6 +47,13 @@ class ConnectionThread : public Thread {
     void setPeerThread(ConnectionThread *thread);
     ConnectionThread* getPeerThread();
 
+    /* Registers another buffer this thread consumes from, so that a
+     * second thread can produce frames for it. Must be called before
+     * start, returns false if the thread does not support it. */
+    virtual bool addInputBuffer(FrameBuffer *buffer);
+    /* Same as transmitFrame for a frame requested from an input buffer */
+    virtual void transmitFrame(FrameBuffer *buffer, canfd_frame *frame);
+
   protected:
     FrameBuffer *m_frameBuffer;
     ConnectionThread *m_peerThread;
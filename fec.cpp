@@ -0,0 +1,164 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <arpa/inet.h>
+
+#include "cannelloni.h"
+#include "fec.h"
+#include "parser.h"
+
+using namespace cannelloni;
+
+FecEncoder::FecEncoder(size_t groupSize, size_t maxPacketSize)
+  : m_groupSize(groupSize)
+  , m_parity(maxPacketSize, 0)
+  , m_first(0)
+  , m_count(0)
+  , m_length(0)
+  , m_maxLength(0)
+{
+}
+
+bool FecEncoder::add(uint32_t seqNo, const uint8_t *packet, uint16_t len) {
+  if (!m_count)
+    m_first = seqNo;
+  len = std::min<size_t>(len, m_parity.size());
+  for (uint16_t i = 0; i < len; i++)
+    m_parity[i] ^= packet[i];
+  m_length ^= len;
+  m_maxLength = std::max(m_maxLength, len);
+  return ++m_count >= m_groupSize;
+}
+
+bool FecEncoder::pending() const {
+  return m_count;
+}
+
+uint16_t FecEncoder::finish(uint8_t *buffer) {
+  struct CannelloniFecPacket fec;
+  fec.header.version = CANNELLONI_FRAME_VERSION;
+  fec.header.op_code = FEC;
+  fec.header.seq_no = static_cast<uint8_t>(m_first);
+  fec.header.count = htons(m_count);
+  fec.first = htonl(m_first);
+  fec.length = htons(m_length);
+  memcpy(buffer, &fec, sizeof(fec));
+  memcpy(buffer + sizeof(fec), m_parity.data(), m_maxLength);
+  uint16_t len = sizeof(fec) + m_maxLength;
+
+  memset(m_parity.data(), 0, m_maxLength);
+  m_count = 0;
+  m_length = 0;
+  m_maxLength = 0;
+  return len;
+}
+
+FecDecoder::Stream::Stream(size_t maxPacketSize)
+  : bits(0)
+  /* Room for the packets of the group before the current one */
+  , packets(2 * FEC_MAX_GROUP_SIZE, maxPacketSize)
+{
+}
+
+FecDecoder::FecDecoder(size_t maxPacketSize)
+  : m_maxPacketSize(maxPacketSize)
+  , m_lastStream(NULL)
+{
+  memset(&m_lastKey, 0, sizeof(m_lastKey));
+}
+
+FecDecoder::Stream* FecDecoder::findStream(const struct sockaddr_storage *peer, bool create) {
+  PeerKey key = makePeerKey(peer);
+  if (m_lastStream && key == m_lastKey)
+    return m_lastStream;
+  auto it = m_streams.find(key);
+  if (it == m_streams.end()) {
+    if (!create)
+      return NULL;
+    it = m_streams.emplace(key, std::make_unique<Stream>(m_maxPacketSize)).first;
+  }
+  m_lastKey = key;
+  m_lastStream = it->second.get();
+  return m_lastStream;
+}
+
+void FecDecoder::store(const struct sockaddr_storage *peer, uint32_t seqNo, uint8_t bits,
+                       const uint8_t *packet, uint16_t len) {
+  /* GSO pads the segments of a batch, the parity only covers the packet */
+  uint16_t packetLength = parseDataPacketLength(len, packet);
+  if (!packetLength)
+    return;
+  Stream *stream = findStream(peer, true);
+  stream->bits = bits;
+  stream->packets.store(seqNo, packet, packetLength);
+}
+
+uint16_t FecDecoder::recover(const struct sockaddr_storage *peer, const uint8_t *buffer, uint16_t len,
+                             uint8_t *out) {
+  struct CannelloniFecPacket fec;
+  if (len < sizeof(fec))
+    return 0;
+  memcpy(&fec, buffer, sizeof(fec));
+  const uint16_t count = ntohs(fec.header.count);
+  const uint32_t first = ntohl(fec.first);
+  const uint8_t *parity = buffer + sizeof(fec);
+  const uint16_t parityLength = len - sizeof(fec);
+  if (fec.header.version != CANNELLONI_FRAME_VERSION || fec.header.op_code != FEC ||
+      !count || count > FEC_MAX_GROUP_SIZE || parityLength > m_maxPacketSize)
+    return 0;
+  Stream *stream = findStream(peer, false);
+  if (!stream)
+    return 0;
+
+  /* XOR can only make up for a single packet */
+  uint32_t missing = 0;
+  uint16_t missingCount = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    uint16_t packetLength;
+    if (!stream->packets.find(first + i, stream->bits, packetLength)) {
+      missing = first + i;
+      if (++missingCount > 1)
+        return 0;
+    }
+  }
+  if (!missingCount)
+    return 0;
+
+  memcpy(out, parity, parityLength);
+  uint16_t length = ntohs(fec.length);
+  for (uint16_t i = 0; i < count; i++) {
+    if (first + i == missing)
+      continue;
+    uint16_t packetLength;
+    const uint8_t *packet = stream->packets.find(first + i, stream->bits, packetLength);
+    if (packetLength > parityLength)
+      return 0;
+    for (uint16_t j = 0; j < packetLength; j++)
+      out[j] ^= packet[j];
+    length ^= packetLength;
+  }
+  if (length < CANNELLONI_DATA_PACKET_BASE_SIZE || length > parityLength)
+    return 0;
+  return length;
+}
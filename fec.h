@@ -0,0 +1,101 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "retransmitring.h"
+#include "sequencetracker.h"
+
+namespace cannelloni {
+
+/* Largest number of data packets protected by one FEC packet */
+#define FEC_MAX_GROUP_SIZE 32
+
+/*
+ * Builds the FEC packets of a sender. Every data packet is XORed into
+ * the parity of the current group, see CannelloniFecPacket. A single
+ * lost packet of a group can be rebuilt from the parity and the other
+ * packets of the group.
+ */
+class FecEncoder {
+  public:
+    /* maxPacketSize is the size of the largest data packet */
+    FecEncoder(size_t groupSize, size_t maxPacketSize);
+
+    /* Adds a data packet to the current group, returns true once the
+     * group is complete */
+    bool add(uint32_t seqNo, const uint8_t *packet, uint16_t len);
+    /* Whether the current group holds any packets */
+    bool pending() const;
+    /* Builds the FEC packet of the current group into buffer and
+     * starts a new group, returns the length of the packet */
+    uint16_t finish(uint8_t *buffer);
+
+  private:
+    size_t m_groupSize;
+    std::vector<uint8_t> m_parity;
+    uint32_t m_first;
+    uint16_t m_count;
+    uint16_t m_length;
+    uint16_t m_maxLength;
+};
+
+/*
+ * Keeps the last data packets of every peer to rebuild a lost one from
+ * a FEC packet.
+ */
+class FecDecoder {
+  public:
+    explicit FecDecoder(size_t maxPacketSize);
+
+    /* Remembers a data packet of peer, seqNo and bits as in
+     * SequenceTracker::track */
+    void store(const struct sockaddr_storage *peer, uint32_t seqNo, uint8_t bits,
+               const uint8_t *packet, uint16_t len);
+    /* Rebuilds the packet a FEC packet of peer protects into out if it
+     * is the only one of its group that is missing. Returns the length
+     * of the rebuilt packet, 0 if there is none. out must hold
+     * maxPacketSize bytes. */
+    uint16_t recover(const struct sockaddr_storage *peer, const uint8_t *buffer, uint16_t len,
+                     uint8_t *out);
+
+  private:
+    struct Stream {
+      uint8_t bits;
+      RetransmitRing packets;
+
+      explicit Stream(size_t maxPacketSize);
+    };
+
+    Stream* findStream(const struct sockaddr_storage *peer, bool create);
+
+  private:
+    size_t m_maxPacketSize;
+    std::map<PeerKey, std::unique_ptr<Stream>> m_streams;
+    PeerKey m_lastKey;
+    Stream *m_lastStream;
+};
+
+}
@@ -18,19 +18,113 @@
  *
  */
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "framebuffer.h"
 #include "logging.h"
 
 using namespace cannelloni;
 
+/* Size of a frame once it is encoded into a packet */
+static inline size_t encodedFrameSize(const canfd_frame *frame) {
+  size_t size = CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame);
+  /* We need one more byte for CAN_FD Frames */
+  if (frame->len & CANFD_FRAME)
+    size++;
+  return size;
+}
+
+/* Slabs are mapped directly so trimPool actually returns them to the
+ * system, over-map to align them to their size */
+static void* allocSlab() {
+  void *mem = mmap(NULL, 2 * FRAME_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  uintptr_t start = reinterpret_cast<uintptr_t>(mem);
+  uintptr_t aligned = (start + FRAME_SLAB_SIZE - 1) & ~(static_cast<uintptr_t>(FRAME_SLAB_SIZE) - 1);
+  if (aligned > start)
+    munmap(mem, aligned - start);
+  if (aligned + FRAME_SLAB_SIZE < start + 2 * FRAME_SLAB_SIZE)
+    munmap(reinterpret_cast<void*>(aligned + FRAME_SLAB_SIZE),
+           start + 2 * FRAME_SLAB_SIZE - aligned - FRAME_SLAB_SIZE);
+  return reinterpret_cast<void*>(aligned);
+}
+
+static void freeSlab(FrameSlab *slab) {
+  munmap(slab, FRAME_SLAB_SIZE);
+}
+
+/* Marks a slab in trimPool */
+#define FRAME_SLAB_RELEASE SIZE_MAX
+
+static inline FrameSlab* slabOf(canfd_frame *frame) {
+  return reinterpret_cast<FrameSlab*>(
+      reinterpret_cast<uintptr_t>(frame) & ~(static_cast<uintptr_t>(FRAME_SLAB_SIZE) - 1));
+}
+
+/* Only valid for frames carved out of a slab */
+static inline FrameSizeClass sizeClassOf(canfd_frame *frame) {
+  return slabOf(frame)->sizeClass;
+}
+
+static inline uint32_t& enqueueTimeOf(canfd_frame *frame) {
+  FrameSlab *slab = slabOf(frame);
+  size_t offset = reinterpret_cast<uint8_t*>(frame) - reinterpret_cast<uint8_t*>(slab)
+                  - FRAME_SLAB_HEADER_SIZE;
+  return slab->enqueueTimes[offset / frameSizeClassSize(slab->sizeClass)];
+}
+
+/* Microseconds, only differences are meaningful */
+static inline uint32_t enqueueClock() {
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+FrameBuffer::FramePool::FramePool(size_t capacity) :
+  ring(capacity),
+  allocCount(0),
+  returnMagazineCount(0)
+{
+  /* Reserve everything upfront, the list may not allocate later on */
+  spareFrames.reserve(std::max<size_t>(capacity, FRAME_MAGAZINE_SIZE));
+}
+
 FrameBuffer::FrameBuffer(size_t size, size_t max) :
+  m_pools{FramePool(std::max(size, max)), FramePool(std::max(size, max))},
+  m_buffer(FRAME_CLASS_COUNT * std::max(size, max)),
+  m_intermediateHead(0),
+  m_intermediateKeep(0),
+  m_preallocated(false),
+  m_maxAge(0),
+  m_overloadHigh(std::max(size, max) / 16 * FRAME_OVERLOAD_HIGH),
+  m_overloadLow(std::max(size, max) / 16 * FRAME_OVERLOAD_LOW),
+  m_coalescedCount(0),
+  m_slabs(NULL),
+  m_slabCount(0),
   m_totalAllocCount(0),
+  m_peakAllocCount(0),
+  m_initialAllocCount(size),
+  m_insertedCount(0),
+  m_releasedCount(0),
+  m_trimQuietPeriod(0),
+  m_trimLowWatermark(0),
+  m_trimHighWatermark(0),
+  m_trimIdleSince(std::chrono::steady_clock::now()),
   m_bufferSize(0),
   m_intermediateBufferSize(0),
-  m_maxAllocCount(max)
+  m_maxAllocCount(std::max(size, max))
 {
-  resizePool(size, false);
+  memset(&m_overwriteFrame, 0, sizeof(m_overwriteFrame));
+  for (auto &count : m_droppedCount)
+    count = 0;
+  /* Reserve everything upfront, the list may not allocate later on.
+   * The pools are allocated once their first frame is requested. */
+  m_intermediateBuffer.reserve(FRAME_CLASS_COUNT * m_maxAllocCount);
 }
 
 FrameBuffer::~FrameBuffer() {
@@ -39,210 +133,594 @@ FrameBuffer::~FrameBuffer() {
 }
 
 canfd_frame* FrameBuffer::requestFrame(bool overwriteLast, bool debug) {
-  std::lock_guard<std::recursive_mutex> lock(m_poolMutex);
-  if (m_framePool.empty()) {
-    bool resizePoolResult;
-    if (m_maxAllocCount > 0) {
-      if (m_maxAllocCount <= m_totalAllocCount) {
-        if (debug)
-          lerror << "Maximum of allocated frames reached." << std::endl;
-        resizePoolResult = false;
-      } else {
-        resizePoolResult = resizePool(std::min(m_maxAllocCount-m_totalAllocCount,m_totalAllocCount), debug);
-      }
-    } else {
-      /* If m_maxAllocCount is 0, we just grow the pool */
-      resizePoolResult = resizePool(m_totalAllocCount, debug);
-    }
-    if (!resizePoolResult && !overwriteLast) {
+  return requestFrame(FRAME_CLASS_CANFD, overwriteLast, debug);
+}
+
+canfd_frame* FrameBuffer::requestFrame(FrameSizeClass sizeClass, bool overwriteLast, bool debug) {
+  canfd_frame *ret;
+  FramePool &pool = m_pools[sizeClass];
+  std::vector<canfd_frame*> &spareFrames = pool.spareFrames;
+  if (spareFrames.empty()) {
+    /* Refill the local list with a whole batch */
+    spareFrames.resize(FRAME_MAGAZINE_SIZE);
+    spareFrames.resize(pool.ring.popBulk(spareFrames.data(), FRAME_MAGAZINE_SIZE));
+  }
+  if (!spareFrames.empty()) {
+    ret = spareFrames.back();
+    spareFrames.pop_back();
+    return ret;
+  }
+
+  bool resizePoolResult;
+  const size_t allocCount = pool.allocCount.load(std::memory_order_relaxed);
+  if (m_maxAllocCount <= allocCount) {
+    if (debug)
+      lerror << "Maximum of allocated frames reached." << std::endl;
+    resizePoolResult = false;
+  } else {
+    /* Start with the initial size, then grow geometrically */
+    resizePoolResult = resizePool(sizeClass, std::min<size_t>(m_maxAllocCount - allocCount,
+                                  std::max(allocCount, m_initialAllocCount)), debug);
+  }
+  if (!resizePoolResult && !overwriteLast) {
+    if (debug)
+      lerror << "Allocation failed. Not enough memory available." << std::endl;
+    /* Test whether a partial alloc was possible */
+    if (spareFrames.empty()) {
+      /* We have no frames available and return NULL */
       if (debug)
-        lerror << "Allocation failed. Not enough memory available." << std::endl;
-      /* Test whether a partial alloc was possible */
-      if (m_framePool.empty()) {
-        /* We have no frames available and return NULL */
-        if (debug)
-          lerror << "Frame Pool is depleted!!!." << std::endl;
-        return NULL;
-      }
-    } else if(!resizePoolResult && overwriteLast) {
-      std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
-      /*
-       * We did reach the limit but we are returning the last frame in the
-       * buffer. (ringbuffer behaviour)
-       */
-      return requestBufferBack();
+        lerror << "Frame Pool is depleted!!!." << std::endl;
+      return NULL;
     }
+  } else if(!resizePoolResult && overwriteLast) {
+    /*
+     * We did reach the limit, the consumer owns the frames in the buffer
+     * so we cannot take one back. Hand out the scratch frame instead,
+     * insertFrame will drop it. (ringbuffer behaviour)
+     */
+    return &m_overwriteFrame;
   }
-  /* If we reach this point, m_framePool is not depleted */
-  canfd_frame *ret = m_framePool.front();
-  /*
-   * In a benchmark, splicing between three lists showed no
-   * performance improvement over front() and pop_front(),
-   * it even was 33% slower
-   */
-  m_framePool.pop_front();
+  /* If we reach this point, spareFrames is not depleted */
+  ret = spareFrames.back();
+  spareFrames.pop_back();
   return ret;
 }
 
-void FrameBuffer::insertFramePool(canfd_frame *frame) {
-  std::lock_guard<std::recursive_mutex> lock(m_poolMutex);
-
-  m_framePool.push_back(frame);
+void FrameBuffer::discardFrame(canfd_frame *frame) {
+  if (frame == &m_overwriteFrame)
+    return;
+  m_pools[sizeClassOf(frame)].spareFrames.push_back(frame);
 }
 
 void FrameBuffer::insertFrame(canfd_frame *frame) {
-  std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
+  if (frame == &m_overwriteFrame) {
+    countDropped(DROP_POOL_DEPLETED, 1);
+    return;
+  }
+  if (m_maxAge)
+    enqueueTimeOf(frame) = enqueueClock();
+  /* Account for the frame first, the consumer subtracts once it sees it */
+  m_bufferSize.fetch_add(encodedFrameSize(frame), std::memory_order_relaxed);
+  m_insertedCount.store(m_insertedCount.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+  if (!m_buffer.push(frame)) {
+    /* Cannot happen, the ring holds every frame that can be allocated */
+    lerror << "Frame buffer overflow." << std::endl;
+  }
+}
 
-  m_buffer.push_back(frame);
-  m_bufferSize += CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame);
+size_t FrameBuffer::getFrameBufferSize() {
+  return m_bufferSize.load(std::memory_order_relaxed);
+}
 
-  /* We need one more byte for CAN_FD Frames */
-  if (frame->len & CANFD_FRAME)
-    m_bufferSize++;
+void FrameBuffer::insertFramePool(canfd_frame *frame) {
+  FramePool &pool = m_pools[sizeClassOf(frame)];
+  countReleased(1);
+  pool.returnMagazine[pool.returnMagazineCount++] = frame;
+  if (pool.returnMagazineCount == FRAME_MAGAZINE_SIZE) {
+    if (pool.ring.pushBulk(pool.returnMagazine, FRAME_MAGAZINE_SIZE) != FRAME_MAGAZINE_SIZE) {
+      /* Cannot happen, the ring holds every frame that can be allocated */
+      lerror << "Frame pool overflow." << std::endl;
+    }
+    pool.returnMagazineCount = 0;
+  }
 }
 
-void FrameBuffer::returnFrame(canfd_frame *frame) {
-  std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
+void FrameBuffer::countReleased(size_t count) {
+  m_releasedCount.store(m_releasedCount.load(std::memory_order_relaxed) + count,
+                        std::memory_order_relaxed);
+}
 
-  m_buffer.push_front(frame);
-  m_bufferSize += CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame);
-  /* We need one more byte for CAN_FD Frames */
-  if (frame->len & CANFD_FRAME)
-    m_bufferSize++;
+void FrameBuffer::countDropped(FrameDropReason reason, size_t count) {
+  m_droppedCount[reason].store(m_droppedCount[reason].load(std::memory_order_relaxed) + count,
+                               std::memory_order_relaxed);
 }
 
-canfd_frame* FrameBuffer::requestBufferFront() {
-  std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
-  if (m_buffer.empty()) {
-    return NULL;
-  }
-  else {
-    canfd_frame *ret = m_buffer.front();
-    m_buffer.pop_front();
-    m_bufferSize -= (CANNELLONI_FRAME_BASE_SIZE + canfd_len(ret));
-    /* We need one more byte for CAN_FD Frames */
-    if (ret->len & CANFD_FRAME)
-      m_bufferSize--;
-    return ret;
+size_t FrameBuffer::handleOverload() {
+  if (!m_overflowPolicy)
+    return 0;
+  /* No size class can be above the threshold if all of them together are not */
+  if (m_intermediateBuffer.size() - m_intermediateHead + m_buffer.size() <= m_overloadHigh)
+    return 0;
+  /* The policy gets to see the whole backlog of a class */
+  drainBuffer();
+  size_t backlog[FRAME_CLASS_COUNT] = {};
+  for (size_t i = m_intermediateHead; i < m_intermediateBuffer.size(); i++)
+    backlog[sizeClassOf(m_intermediateBuffer[i])]++;
+  size_t droppedSize = 0;
+  for (int sizeClass = 0; sizeClass < FRAME_CLASS_COUNT; sizeClass++) {
+    if (backlog[sizeClass] > m_overloadHigh)
+      droppedSize += handleOverload(static_cast<FrameSizeClass>(sizeClass));
   }
+  return droppedSize;
 }
 
-canfd_frame* FrameBuffer::requestBufferBack() {
-  std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
-  if (m_buffer.empty()) {
-    return NULL;
+size_t FrameBuffer::handleOverload(FrameSizeClass sizeClass) {
+  canfd_frame **frames = m_intermediateBuffer.data() + m_intermediateHead;
+  const size_t count = m_intermediateBuffer.size() - m_intermediateHead;
+  m_overloadFrames.clear();
+  for (size_t i = 0; i < count; i++) {
+    if (sizeClassOf(frames[i]) == sizeClass)
+      m_overloadFrames.push_back(frames[i]);
   }
-  else {
-    canfd_frame *ret = m_buffer.back();
-    m_buffer.pop_back();
-    m_bufferSize -= (CANNELLONI_FRAME_BASE_SIZE + canfd_len(ret));
-    /* We need one more byte for CAN_FD Frames */
-    if (ret->len & CANFD_FRAME)
-      m_bufferSize--;
-    return ret;
+  m_dropMask.assign(m_overloadFrames.size(), 0);
+  m_overflowPolicy->select(m_overloadFrames.data(), m_overloadFrames.size(),
+                           m_overloadFrames.size() - m_overloadLow, m_dropMask.data());
+
+  size_t kept = 0;
+  size_t dropped = 0;
+  size_t droppedSize = 0;
+  /* m_overloadFrames keeps the order of the backlog */
+  size_t selected = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (sizeClassOf(frames[i]) == sizeClass && m_dropMask[selected++]) {
+      droppedSize += encodedFrameSize(frames[i]);
+      releaseCoalesced(frames[i]);
+      insertFramePool(frames[i]);
+      dropped++;
+    } else {
+      frames[kept++] = frames[i];
+    }
   }
+  m_intermediateBuffer.resize(m_intermediateHead + kept);
+  countDropped(m_overflowPolicy->reason(), dropped);
+  return droppedSize;
 }
 
+canfd_frame** FrameBuffer::coalesceSlot(const canfd_frame *frame) {
+  if (frame->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))
+    return NULL;
+  if (frame->can_id & CAN_EFF_FLAG) {
+    for (const CANIdFilter &filter : m_coalesceFilters) {
+      if ((frame->can_id & filter.mask) == (filter.id & filter.mask))
+        return &m_coalesceEff[frame->can_id & CAN_EFF_MASK];
+    }
+    return NULL;
+  }
+  const uint32_t id = frame->can_id & CAN_SFF_MASK;
+  if (!m_coalesceSffMatch[id])
+    return NULL;
+  return &m_coalesceSff[id];
+}
 
+void FrameBuffer::releaseCoalesced(canfd_frame *frame) {
+  if (m_coalesceFilters.empty())
+    return;
+  canfd_frame **slot = coalesceSlot(frame);
+  if (slot && *slot == frame)
+    *slot = NULL;
+}
 
-void FrameBuffer::swapBuffers() {
-  std::unique_lock<std::recursive_mutex> lock1(m_bufferMutex, std::defer_lock);
-  std::unique_lock<std::recursive_mutex> lock2(m_intermediateBufferMutex, std::defer_lock);
-  std::lock(lock1, lock2);
+void FrameBuffer::drainBuffer() {
+  canfd_frame *frame;
+  if (m_coalesceFilters.empty()) {
+    while (m_buffer.pop(frame)) {
+      m_intermediateBuffer.push_back(frame);
+    }
+    return;
+  }
+  size_t replacedSize = 0;
+  size_t coalesced = 0;
+  while (m_buffer.pop(frame)) {
+    canfd_frame **slot = coalesceSlot(frame);
+    if (slot == NULL) {
+      m_intermediateBuffer.push_back(frame);
+    } else if (*slot == NULL) {
+      *slot = frame;
+      m_intermediateBuffer.push_back(frame);
+    } else if (frameSizeClass(frame->len) <= sizeClassOf(*slot)) {
+      /* Overwrite the pending frame, it keeps its place */
+      replacedSize += encodedFrameSize(*slot);
+      memcpy(*slot, frame, frameSizeClassSize(frameSizeClass(frame->len)));
+      if (m_maxAge)
+        enqueueTimeOf(*slot) = enqueueTimeOf(frame);
+      insertFramePool(frame);
+      coalesced++;
+    } else {
+      /* The pending frame is too small, the new one takes over */
+      *slot = frame;
+      m_intermediateBuffer.push_back(frame);
+    }
+  }
+  if (coalesced) {
+    m_bufferSize.fetch_sub(replacedSize, std::memory_order_relaxed);
+    m_coalescedCount.store(m_coalescedCount.load(std::memory_order_relaxed) + coalesced,
+                           std::memory_order_relaxed);
+  }
+}
 
-  std::swap(m_bufferSize, m_intermediateBufferSize);
-  m_buffer.swap(m_intermediateBuffer);
+size_t FrameBuffer::dropExpired() {
+  const uint32_t now = enqueueClock();
+  canfd_frame **frames = m_intermediateBuffer.data() + m_intermediateHead;
+  const size_t count = m_intermediateBuffer.size() - m_intermediateHead;
+  size_t kept = 0;
+  size_t droppedSize = 0;
+  for (size_t i = 0; i < count; i++) {
+    /* Unsigned arithmetic handles the wrap of the clock */
+    if (now - enqueueTimeOf(frames[i]) > m_maxAge) {
+      droppedSize += encodedFrameSize(frames[i]);
+      releaseCoalesced(frames[i]);
+      insertFramePool(frames[i]);
+    } else {
+      frames[kept++] = frames[i];
+    }
+  }
+  if (kept < count) {
+    m_intermediateBuffer.resize(m_intermediateHead + kept);
+    countDropped(DROP_EXPIRED, count - kept);
+  }
+  return droppedSize;
 }
 
-void FrameBuffer::sortIntermediateBuffer() {
-  std::lock_guard<std::recursive_mutex> lock(m_intermediateBufferMutex);
+void FrameBuffer::flushReturnMagazines() {
+  for (FramePool &pool : m_pools) {
+    if (pool.returnMagazineCount == 0)
+      continue;
+    if (pool.ring.pushBulk(pool.returnMagazine, pool.returnMagazineCount) != pool.returnMagazineCount) {
+      /* Cannot happen, the ring holds every frame that can be allocated */
+      lerror << "Frame pool overflow." << std::endl;
+    }
+    pool.returnMagazineCount = 0;
+  }
+}
 
-  m_intermediateBuffer.sort(canfd_frame_comp());
+void FrameBuffer::returnFrame(canfd_frame *frame) {
+  /* The consumer is going to back off, don't hold back any frames */
+  flushReturnMagazines();
+  if (!m_coalesceFilters.empty()) {
+    /* The frame is pending again, unless a newer one took its place */
+    canfd_frame **slot = coalesceSlot(frame);
+    if (slot && *slot == NULL)
+      *slot = frame;
+  }
+  if (m_intermediateHead > 0) {
+    m_intermediateBuffer[--m_intermediateHead] = frame;
+  } else {
+    m_intermediateBuffer.insert(m_intermediateBuffer.begin(), frame);
+  }
+  m_bufferSize.fetch_add(encodedFrameSize(frame), std::memory_order_relaxed);
 }
 
-void FrameBuffer::mergeIntermediateBuffer() {
-  std::unique_lock<std::recursive_mutex> lock1(m_poolMutex, std::defer_lock);
-  std::unique_lock<std::recursive_mutex> lock2(m_intermediateBufferMutex, std::defer_lock);
-  std::lock(lock1, lock2);
+canfd_frame* FrameBuffer::requestBufferFront() {
+  canfd_frame *ret;
+  /* Pending frames can only be coalesced in m_intermediateBuffer */
+  if (!m_coalesceFilters.empty())
+    drainBuffer();
+  size_t droppedSize = handleOverload();
+  if (droppedSize)
+    m_bufferSize.fetch_sub(droppedSize, std::memory_order_relaxed);
+  if (m_intermediateHead < m_intermediateBuffer.size()) {
+    ret = m_intermediateBuffer[m_intermediateHead++];
+    releaseCoalesced(ret);
+    if (m_intermediateHead == m_intermediateBuffer.size()) {
+      m_intermediateBuffer.clear();
+      m_intermediateHead = 0;
+    }
+  } else if (!m_buffer.pop(ret)) {
+    /* The consumer is idle, don't hold back any frames */
+    flushReturnMagazines();
+    return NULL;
+  }
+  m_bufferSize.fetch_sub(encodedFrameSize(ret), std::memory_order_relaxed);
+  return ret;
+}
 
-  m_framePool.splice(m_framePool.end(), m_intermediateBuffer);
+void FrameBuffer::swapBuffers() {
+  /* Drop frames that have already been taken by requestBufferFront */
+  m_intermediateBuffer.erase(m_intermediateBuffer.begin(),
+                             m_intermediateBuffer.begin() + m_intermediateHead);
+  m_intermediateHead = 0;
+  drainBuffer();
+  size_t droppedSize = handleOverload();
+  if (m_maxAge)
+    droppedSize += dropExpired();
+  if (droppedSize)
+    m_bufferSize.fetch_sub(droppedSize, std::memory_order_relaxed);
   m_intermediateBufferSize = 0;
+  for (canfd_frame *f : m_intermediateBuffer) {
+    m_intermediateBufferSize += encodedFrameSize(f);
+  }
+  m_intermediateKeep = m_intermediateBuffer.size();
+  m_bufferSize.fetch_sub(m_intermediateBufferSize, std::memory_order_relaxed);
 }
 
-void FrameBuffer::returnIntermediateBuffer(std::list<canfd_frame*>::iterator start) {
-  std::unique_lock<std::recursive_mutex> lock1(m_intermediateBufferMutex, std::defer_lock);
-  std::unique_lock<std::recursive_mutex> lock2(m_bufferMutex, std::defer_lock);
-  std::lock(lock1,lock2);
+void FrameBuffer::sortIntermediateBuffer() {
+  m_sorter.sort(m_intermediateBuffer.data() + m_intermediateHead,
+                m_intermediateBuffer.size() - m_intermediateHead);
+}
 
-  /* Don't splice since we need to keep track of the size */
-  for (std::list<canfd_frame*>::iterator it = start;
-                                         it != m_intermediateBuffer.end();) {
-    canfd_frame *frame = *it;
-    it = m_intermediateBuffer.erase(it);
-    returnFrame(frame);
+void FrameBuffer::mergeIntermediateBuffer() {
+  for (size_t i = m_intermediateHead; i < m_intermediateKeep; i++) {
+    m_intermediateBufferSize -= encodedFrameSize(m_intermediateBuffer[i]);
+    releaseCoalesced(m_intermediateBuffer[i]);
+    insertFramePool(m_intermediateBuffer[i]);
   }
+  flushReturnMagazines();
+  m_intermediateBuffer.erase(m_intermediateBuffer.begin(),
+                             m_intermediateBuffer.begin() + m_intermediateKeep);
+  m_intermediateHead = 0;
+  m_intermediateKeep = m_intermediateBuffer.size();
+  /* The remaining frames are part of the buffer again */
+  m_bufferSize.fetch_add(m_intermediateBufferSize, std::memory_order_relaxed);
+  m_intermediateBufferSize = 0;
 }
 
-std::list<canfd_frame*>* FrameBuffer::getIntermediateBuffer() {
-  /* We need to lock m_intermediateBuffer here */
-  m_intermediateBufferMutex.lock();
-  return &m_intermediateBuffer;
+void FrameBuffer::returnIntermediateBuffer(std::vector<canfd_frame*>::iterator start) {
+  m_intermediateKeep = start - m_intermediateBuffer.begin();
 }
 
-void FrameBuffer::unlockIntermediateBuffer() {
-  m_intermediateBufferMutex.unlock();
+std::vector<canfd_frame*>* FrameBuffer::getIntermediateBuffer() {
+  return &m_intermediateBuffer;
 }
 
 void FrameBuffer::debug() {
-  linfo << "FramePool: " << m_framePool.size() << std::endl;
+  FrameBufferStats stats = getStats();
+  linfo << "FramePool: " << stats.free << " (" << stats.allocated << " allocated, "
+        << stats.peak << " peak, " << stats.memory << " bytes)" << std::endl;
+  linfo << "FramePool classes: " << stats.allocatedByClass[FRAME_CLASS_CAN] << " CAN, "
+        << stats.allocatedByClass[FRAME_CLASS_CANFD] << " CAN FD (allocated)" << std::endl;
   linfo << "Buffer: " << m_buffer.size() << " (elements) "
-        << m_bufferSize << " (bytes)" <<  std::endl;
-  linfo << "intermediateBuffer: " << m_intermediateBuffer.size() << std::endl;
+        << getFrameBufferSize() << " (bytes)" <<  std::endl;
+  linfo << "intermediateBuffer: " << m_intermediateBuffer.size() - m_intermediateHead << std::endl;
+  for (int reason = 0; reason < DROP_REASON_COUNT; reason++) {
+    if (stats.dropped[reason])
+      linfo << "Dropped (" << frameDropReasonName(static_cast<FrameDropReason>(reason))
+            << "): " << stats.dropped[reason] << std::endl;
+  }
+  if (stats.coalesced)
+    linfo << "Coalesced: " << stats.coalesced << std::endl;
 }
 
 void FrameBuffer::reset() {
-  std::unique_lock<std::recursive_mutex> lock1(m_poolMutex, std::defer_lock);
-  std::unique_lock<std::recursive_mutex> lock2(m_bufferMutex, std::defer_lock);
-  std::unique_lock<std::recursive_mutex> lock3(m_intermediateBufferMutex, std::defer_lock);
-  std::lock(lock1, lock2, lock3);
-
-  /* Splice everything back into the pool */
-  m_framePool.splice(m_framePool.end(), m_intermediateBuffer);
-  m_framePool.splice(m_framePool.end(), m_buffer);
-
+  canfd_frame *frame;
+  size_t size = 0;
+  /* Move everything back into the pool */
+  for (size_t i = m_intermediateHead; i < m_intermediateBuffer.size(); i++) {
+    size += encodedFrameSize(m_intermediateBuffer[i]);
+    releaseCoalesced(m_intermediateBuffer[i]);
+    insertFramePool(m_intermediateBuffer[i]);
+  }
+  m_intermediateBuffer.clear();
+  m_intermediateHead = 0;
+  m_intermediateKeep = 0;
+  /* Frames in the intermediate buffer have been subtracted already */
+  size -= m_intermediateBufferSize;
   m_intermediateBufferSize = 0;
-  m_bufferSize = 0;
+
+  while (m_buffer.pop(frame)) {
+    size += encodedFrameSize(frame);
+    insertFramePool(frame);
+  }
+  flushReturnMagazines();
+  m_bufferSize.fetch_sub(size, std::memory_order_relaxed);
 }
 
 void FrameBuffer::clearPool() {
-  std::unique_lock<std::recursive_mutex> lock1(m_poolMutex, std::defer_lock);
-  std::unique_lock<std::recursive_mutex> lock2(m_bufferMutex, std::defer_lock);
-  std::unique_lock<std::recursive_mutex> lock3(m_intermediateBufferMutex, std::defer_lock);
-  std::lock(lock1, lock2, lock3);
-
+  canfd_frame *frame;
   reset();
 
-  for (canfd_frame *f : m_framePool) {
-    delete f;
+  /* Every frame lives in a slab, so we only need to empty the lists */
+  for (FramePool &pool : m_pools) {
+    while (pool.ring.pop(frame)) {}
+    pool.spareFrames.clear();
+    pool.allocCount = 0;
+  }
+
+  while (m_slabs) {
+    FrameSlab *next = m_slabs->next;
+    freeSlab(m_slabs);
+    m_slabs = next;
   }
-  m_framePool.clear();
+  m_slabCount = 0;
   m_totalAllocCount = 0;
 }
 
-size_t FrameBuffer::getFrameBufferSize() {
-  std::lock_guard<std::recursive_mutex> lock(m_bufferMutex);
-  return m_bufferSize;
+size_t FrameBuffer::getPoolMemorySize() {
+  return m_slabCount.load(std::memory_order_relaxed) * FRAME_SLAB_SIZE;
+}
+
+FrameBufferStats FrameBuffer::getStats() {
+  FrameBufferStats stats;
+  /* Load the released count first, it can only fall behind */
+  uint64_t released = m_releasedCount.load(std::memory_order_relaxed);
+  uint64_t inserted = m_insertedCount.load(std::memory_order_relaxed);
+  stats.allocated = m_totalAllocCount.load(std::memory_order_relaxed);
+  for (int sizeClass = 0; sizeClass < FRAME_CLASS_COUNT; sizeClass++)
+    stats.allocatedByClass[sizeClass] = m_pools[sizeClass].allocCount.load(std::memory_order_relaxed);
+  stats.buffered = std::min<uint64_t>(inserted - released, stats.allocated);
+  stats.free = stats.allocated - stats.buffered;
+  stats.peak = m_peakAllocCount.load(std::memory_order_relaxed);
+  stats.memory = getPoolMemorySize();
+  for (int reason = 0; reason < DROP_REASON_COUNT; reason++)
+    stats.dropped[reason] = m_droppedCount[reason].load(std::memory_order_relaxed);
+  stats.coalesced = m_coalescedCount.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void FrameBuffer::setTrimPolicy(uint64_t quietPeriod_us, size_t lowWatermark, size_t highWatermark) {
+  m_trimQuietPeriod = quietPeriod_us;
+  m_trimLowWatermark = lowWatermark;
+  m_trimHighWatermark = std::max(lowWatermark, highWatermark);
+}
+
+void FrameBuffer::setOverflowPolicy(std::unique_ptr<OverflowPolicy> policy) {
+  m_overflowPolicy = std::move(policy);
+  if (m_overflowPolicy) {
+    m_dropMask.reserve(m_maxAllocCount);
+    m_overloadFrames.reserve(m_maxAllocCount);
+    if (m_preallocated)
+      m_overflowPolicy->reserve(m_maxAllocCount);
+  }
+}
+
+void FrameBuffer::setMaxAge(uint32_t maxAge_us) {
+  m_maxAge = maxAge_us;
 }
 
-bool FrameBuffer::resizePool(std::size_t size, bool debug) {
-  std::lock_guard<std::recursive_mutex> lock(m_poolMutex);
-  for (size_t i=0; i<size; i++) {
-      auto f = new canfd_frame;
-      memset(f, 0, sizeof(*f));
-      m_framePool.push_back(f);
+void FrameBuffer::preallocate() {
+  m_preallocated = true;
+  m_trimQuietPeriod = 0;
+  for (int sizeClass = 0; sizeClass < FRAME_CLASS_COUNT; sizeClass++) {
+    size_t allocCount = m_pools[sizeClass].allocCount;
+    if (allocCount < m_maxAllocCount)
+      resizePool(static_cast<FrameSizeClass>(sizeClass), m_maxAllocCount - allocCount);
+  }
+  /* Fault the slabs in now rather than on first use */
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  for (FrameSlab *slab = m_slabs; slab; slab = slab->next) {
+    volatile uint8_t *mem = reinterpret_cast<volatile uint8_t*>(slab);
+    for (size_t offset = 0; offset < FRAME_SLAB_SIZE; offset += pageSize)
+      mem[offset] = mem[offset];
   }
-  m_totalAllocCount += size;
+  m_sorter.reserve(FRAME_CLASS_COUNT * m_maxAllocCount);
+  /* The policy only sees the backlog of one size class */
+  if (m_overflowPolicy)
+    m_overflowPolicy->reserve(m_maxAllocCount);
+}
+
+void FrameBuffer::setCoalescing(const std::vector<CANIdFilter> &filters) {
+  m_coalesceFilters = filters;
+  m_coalesceSffMatch.assign(CAN_SFF_MASK + 1, 0);
+  m_coalesceSff.assign(CAN_SFF_MASK + 1, NULL);
+  m_coalesceEff.clear();
+  if (filters.empty())
+    return;
+  for (uint32_t id = 0; id <= CAN_SFF_MASK; id++) {
+    for (const CANIdFilter &filter : filters) {
+      if ((id & filter.mask) == (filter.id & filter.mask)) {
+        m_coalesceSffMatch[id] = 1;
+        break;
+      }
+    }
+  }
+}
+
+void FrameBuffer::trimPool(bool debug) {
+  if (m_trimQuietPeriod == 0)
+    return;
+  auto now = std::chrono::steady_clock::now();
+  FrameBufferStats stats = getStats();
+  bool trimmable = false;
+  for (int sizeClass = 0; sizeClass < FRAME_CLASS_COUNT; sizeClass++)
+    trimmable |= stats.allocatedByClass[sizeClass] > m_initialAllocCount;
+  if (stats.free <= m_trimHighWatermark || !trimmable) {
+    m_trimIdleSince = now;
+    return;
+  }
+  if (std::chrono::duration_cast<std::chrono::microseconds>(now - m_trimIdleSince).count()
+      < static_cast<int64_t>(m_trimQuietPeriod))
+    return;
+  m_trimIdleSince = now;
+
+  /* Collect every free frame in the local lists */
+  for (FramePool &pool : m_pools) {
+    const size_t allocCount = pool.allocCount.load(std::memory_order_relaxed);
+    size_t spare = pool.spareFrames.size();
+    pool.spareFrames.resize(allocCount);
+    pool.spareFrames.resize(spare + pool.ring.popBulk(pool.spareFrames.data() + spare,
+                                                      allocCount - spare));
+  }
+  /* Find the slabs that are completely idle */
+  for (FrameSlab *slab = m_slabs; slab; slab = slab->next)
+    slab->freeCount = 0;
+  for (FramePool &pool : m_pools) {
+    for (canfd_frame *frame : pool.spareFrames)
+      slabOf(frame)->freeCount++;
+  }
+
+  size_t releasable = stats.free - m_trimLowWatermark;
+  size_t released = 0;
+  size_t releasedByClass[FRAME_CLASS_COUNT] = {};
+  for (FrameSlab *slab = m_slabs; slab; slab = slab->next) {
+    const size_t remaining = m_pools[slab->sizeClass].allocCount - releasedByClass[slab->sizeClass];
+    if (slab->freeCount == slab->frameCount && released + slab->frameCount <= releasable &&
+        remaining >= m_initialAllocCount + slab->frameCount) {
+      released += slab->frameCount;
+      releasedByClass[slab->sizeClass] += slab->frameCount;
+      /* Mark the slab, its frames are removed from the lists below */
+      slab->freeCount = FRAME_SLAB_RELEASE;
+    }
+  }
+  if (released == 0)
+    return;
+
+  for (FramePool &pool : m_pools) {
+    pool.spareFrames.erase(std::remove_if(pool.spareFrames.begin(), pool.spareFrames.end(),
+                             [](canfd_frame *frame) { return slabOf(frame)->freeCount == FRAME_SLAB_RELEASE; }),
+                           pool.spareFrames.end());
+  }
+  FrameSlab **link = &m_slabs;
+  while (*link) {
+    FrameSlab *slab = *link;
+    if (slab->freeCount == FRAME_SLAB_RELEASE) {
+      *link = slab->next;
+      freeSlab(slab);
+      m_slabCount--;
+    } else {
+      link = &slab->next;
+    }
+  }
+  for (int sizeClass = 0; sizeClass < FRAME_CLASS_COUNT; sizeClass++)
+    m_pools[sizeClass].allocCount -= releasedByClass[sizeClass];
+  m_totalAllocCount -= released;
+  if (debug)
+    linfo << "Trimmed pool by " << released << " frames, new Poolsize:"
+          << m_totalAllocCount << " (" << m_slabCount << " slabs)" << std::endl;
+}
+
+bool FrameBuffer::resizePool(FrameSizeClass sizeClass, std::size_t size, bool debug) {
+  FramePool &pool = m_pools[sizeClass];
+  const size_t frameSize = frameSizeClassSize(sizeClass);
+  size_t allocated = 0;
+  do {
+    void *mem = allocSlab();
+    if (mem == NULL) {
+      if (debug)
+        lerror << "Could not allocate slab." << std::endl;
+      break;
+    }
+    /* Fresh mappings are zeroed, no need for a memset */
+    FrameSlab *slab = new (mem) FrameSlab;
+    slab->frameCount = std::min(FRAME_SLAB_FRAME_COUNT(sizeClass), m_maxAllocCount - pool.allocCount);
+    slab->freeCount = 0;
+    slab->sizeClass = sizeClass;
+    slab->enqueueTimes = reinterpret_cast<uint32_t*>(
+        static_cast<uint8_t*>(mem) + FRAME_SLAB_HEADER_SIZE + slab->frameCount * frameSize);
+    slab->next = m_slabs;
+    m_slabs = slab;
+    m_slabCount++;
+
+    uint8_t *frames = static_cast<uint8_t*>(mem) + FRAME_SLAB_HEADER_SIZE;
+    for (size_t i = 0; i < slab->frameCount; i++) {
+      pool.spareFrames.push_back(reinterpret_cast<canfd_frame*>(frames + i * frameSize));
+    }
+    allocated += slab->frameCount;
+    pool.allocCount += slab->frameCount;
+    m_totalAllocCount += slab->frameCount;
+  } while (allocated < size && pool.allocCount < m_maxAllocCount);
+  if (m_totalAllocCount > m_peakAllocCount)
+    m_peakAllocCount = m_totalAllocCount.load();
   if (debug)
-    linfo << "New Poolsize:" << m_totalAllocCount << std::endl;
-  return true;
+    linfo << "New Poolsize:" << m_totalAllocCount << " (" << m_slabCount << " slabs)" << std::endl;
+  return allocated > 0;
 }
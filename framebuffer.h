@@ -20,9 +20,15 @@
 
 #pragma once
 
-#include <list>
-#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include "cannelloni.h"
+#include "framesort.h"
+#include "overflowpolicy.h"
+#include "spscring.h"
 
 namespace cannelloni {
 
@@ -32,44 +38,200 @@ namespace cannelloni {
  * UDPThread and stores them in a queue until an event occurs that leads to
  * flushing the buffer (e.g. timeout in UDPThread).
  *
- * When this happens, the buffers will be swapped to minimize the
- * time a Thread can be locked by a mutex.
- * All sorting should take place on the intermediate buffer to make
- * the whole operation as non-blocking as possible for the producer thread.
+ * Every FrameBuffer has exactly one producer, the peer thread that
+ * requests frames from the pool, fills them and inserts them, and
+ * exactly one consumer, the thread that owns the buffer and puts the
+ * frames back into the pool once they have been transmitted.
+ * Both the buffer and the pool are therefore bounded
+ * single-producer/single-consumer rings (see spscring.h) and no
+ * mutex is involved on either path:
  *
- * Only the intermediate buffer is exposed and should only be accessed
- * by one party at a time.
+ *   producer: requestFrame -> m_pools[].ring (pop)
+ *             insertFrame  -> m_buffer (push)
+ *   consumer: swapBuffers / requestBufferFront -> m_buffer (pop)
+ *             mergeIntermediateBuffer / insertFramePool -> m_pools[].ring (push)
+ *
+ * When flushing, the consumer drains m_buffer into the intermediate
+ * buffer, a contiguous array only the consumer ever touches. All
+ * sorting takes place on the intermediate buffer, frames that did not
+ * fit into a packet stay at its front until the next flush.
  *
  * If the producer is a lot faster than the receiver, in our case
  * UDPThread >> CANThread, frames can also be extracted one at a time
  * if the interface blocks and writing is deferred.
  *
- * Currently there are a lot of mutex locks involved which need to be checked
- * again at a later time.
+ * The rings are sized to the maximum number of frames, so a push can
+ * never fail. New frames are only allocated by the producer, frames it
+ * requested but does not use are kept in a producer local list.
+ *
+ * Similar to the per-thread caches of tcmalloc, neither side exchanges
+ * single frames with the pool rings. The producer refills its local list
+ * with up to FRAME_MAGAZINE_SIZE frames at once and the consumer
+ * collects returned frames in a magazine that is handed over as a
+ * whole, either once it is full or once the consumer runs out of work.
+ * Frames held in a magazine are still accounted for by m_maxAllocCount.
+ *
+ * Frames are not allocated one by one but carved out of slabs of
+ * FRAME_SLAB_SIZE bytes. Growing the pool adds whole slabs, frames that
+ * travel CAN->net->CAN stay close to each other in memory and the
+ * memory footprint of a FrameBuffer is simply the number of slabs
+ * times FRAME_SLAB_SIZE.
+ *
+ * A pool starts with its initial size once the first frame of its
+ * class is requested. It grows geometrically during a burst but never
+ * shrinks below its initial size. Once more than the high watermark of frames has been
+ * idle for the quiet period, the producer gives fully idle slabs back
+ * to the system until only the low watermark of free frames is left
+ * (see trimPool).
  *
- * The goal is to have FrameBuffer 100% thread-safe to support further
- * use-cases of cannelloni.
+ * Since the consumer owns every buffered frame, the producer can only
+ * drop the frame it is about to insert once the pool is exhausted. To
+ * let an OverflowPolicy decide which frames are lost instead, the
+ * consumer checks the backlog of every size class whenever it drains
+ * m_buffer. Once it holds more than FRAME_OVERLOAD_HIGH of the class
+ * maximum, the consumer hands it to the policy and drops frames of that
+ * class until FRAME_OVERLOAD_LOW is reached, which keeps enough frames
+ * of the pool free for the producer to continue meanwhile.
+ *
+ * For cyclic IDs only the latest value matters. If coalescing is
+ * enabled, the consumer remembers the pending frame of every selected
+ * ID while draining m_buffer. A newer frame with the same ID is copied
+ * over the pending one, which keeps its place in the queue, and the
+ * newer frame goes straight back to the pool.
+ *
+ * On classic CAN only the first sizeof(can_frame) bytes of a
+ * canfd_frame carry information. Frames are therefore kept in pools of
+ * different size classes, each with its own slabs, ring and magazines.
+ * The producer picks the class when it requests a frame, the consumer
+ * finds it through the header of the frame's slab when it returns one.
+ * A frame may only be accessed within the bytes of its class.
+ *
+ * If a maximum age is set, the producer stamps every frame with the
+ * time it has been inserted. The stamps are kept in an array at the end
+ * of each slab, so the frames themselves stay compact. swapBuffers
+ * drops frames that have been waiting for too long before they are
+ * handed to the consumer.
  */
 
+/* Size of a slab, slabs are aligned to their size */
+#define FRAME_SLAB_SIZE (64*1024)
+
+/* Size classes of the frame pools */
+enum FrameSizeClass {
+  /* struct can_frame, 16 bytes */
+  FRAME_CLASS_CAN,
+  /* struct canfd_frame, 72 bytes */
+  FRAME_CLASS_CANFD,
+  FRAME_CLASS_COUNT
+};
+
+/* Smallest class holding a frame of len, including the CANFD_FRAME bit */
+inline FrameSizeClass frameSizeClass(uint8_t len) {
+  if ((len & CANFD_FRAME) || (len & ~CANFD_FRAME) > CAN_MAX_DLEN)
+    return FRAME_CLASS_CANFD;
+  return FRAME_CLASS_CAN;
+}
+
+/* Bytes of a frame of sizeClass that may be accessed */
+inline size_t frameSizeClassSize(FrameSizeClass sizeClass) {
+  return sizeClass == FRAME_CLASS_CAN ? sizeof(struct can_frame) : sizeof(struct canfd_frame);
+}
+
+/* Header at the beginning of every slab, frames follow at
+ * FRAME_SLAB_HEADER_SIZE */
+struct FrameSlab {
+  FrameSlab *next;
+  /* Number of frames carved out of this slab */
+  size_t frameCount;
+  /* Only used by trimPool */
+  size_t freeCount;
+  FrameSizeClass sizeClass;
+  /* Insertion time of every frame (us, wraps), see setMaxAge */
+  uint32_t *enqueueTimes;
+};
+
+/* Number of frames exchanged with the pool at once */
+#define FRAME_MAGAZINE_SIZE 64
+
+/* Thresholds of the overflow policy, in 1/16th of the
+ * maximum number of frames of a size class */
+#define FRAME_OVERLOAD_HIGH 15
+#define FRAME_OVERLOAD_LOW 14
+
+#define FRAME_SLAB_HEADER_SIZE CANNELLONI_CACHE_LINE_SIZE
+#define FRAME_SLAB_FRAME_COUNT(sizeClass) \
+  ((FRAME_SLAB_SIZE - FRAME_SLAB_HEADER_SIZE) / (frameSizeClassSize(sizeClass) + sizeof(uint32_t)))
+
+/* Selects CAN IDs like a SocketCAN filter,
+ * a frame matches if (can_id & mask) == (id & mask) */
+struct CANIdFilter {
+  uint32_t id;
+  uint32_t mask;
+};
+
+/* Snapshot of the pool state, all values are frames unless noted */
+struct FrameBufferStats {
+  /* carved out of slabs */
+  size_t allocated;
+  /* allocated by FrameSizeClass */
+  size_t allocatedByClass[FRAME_CLASS_COUNT];
+  /* available in the pool */
+  size_t free;
+  /* inserted but not yet put back into the pool */
+  size_t buffered;
+  /* maximum of allocated */
+  size_t peak;
+  /* bytes used by the slabs */
+  size_t memory;
+  /* dropped frames by FrameDropReason */
+  uint64_t dropped[DROP_REASON_COUNT];
+  /* frames replaced by a newer one with the same ID */
+  uint64_t coalesced;
+};
+
 class FrameBuffer {
   public:
     FrameBuffer(size_t size, size_t max);
     ~FrameBuffer();
-    /* Locks m_poolMutex and takes a free frame from m_framePool,
-     * will grow the buffer if no frame is available
+
+    /*
+     * Producer side
+     */
+
+    /* Takes a free frame of sizeClass from its pool,
+     * will grow the pool if no frame is available
      *
      * will return NULL if no memory is available and overwriteLast is false
-     * will return the last frame in the buffer when overwriteLast is true
-     *
+     * will return a scratch frame when overwriteLast is true, the scratch
+     * frame is dropped by insertFrame (tail drop)
      */
+    canfd_frame* requestFrame(FrameSizeClass sizeClass, bool overwriteLast, bool debug = false);
+
+    /* Same as above, the frame can hold any CAN FD frame */
     canfd_frame* requestFrame(bool overwriteLast, bool debug = false);
 
     /* If a read fails we need to give the frame back */
-    void insertFramePool(canfd_frame *frame);
+    void discardFrame(canfd_frame *frame);
 
     /* Inserts a frame into the frameBuffer (back) */
     void insertFrame(canfd_frame *frame);
 
+    /* Size of all buffered frames in their encoded form (bytes),
+     * may be called by either side */
+    size_t getFrameBufferSize();
+
+    /* Releases idle slabs, should be called periodically.
+     * See setTrimPolicy */
+    void trimPool(bool debug = false);
+
+    /*
+     * Consumer side
+     */
+
+    /* Puts a frame that has been consumed back into the pool,
+     * the frame is handed over together with the next frames */
+    void insertFramePool(canfd_frame *frame);
+
     /* Inserts a frame into the frameBuffer (front) */
     void returnFrame(canfd_frame *frame);
 
@@ -81,61 +243,183 @@ class FrameBuffer {
      */
     canfd_frame* requestBufferFront();
 
-    canfd_frame* requestBufferBack();
-
-    /* Swaps m_Buffer with m_intermediateBuffer */
+    /* Moves all frames of m_buffer behind the frames that remained
+     * in m_intermediateBuffer */
     void swapBuffers();
 
-    /* Sorts m_intermediateBuffer by canfd_frame->id */
+    /* Sorts m_intermediateBuffer by canfd_frame->id (see framesort.h) */
     void sortIntermediateBuffer();
 
-    /* merges m_intermediateBuffer back into m_poolMutex */
+    /* merges m_intermediateBuffer back into the pools, except
+     * the frames marked by returnIntermediateBuffer */
     void mergeIntermediateBuffer();
 
-    /* merges parts of m_intermediateBuffer back into m_buffer */
-    void returnIntermediateBuffer(std::list<canfd_frame*>::iterator start);
+    /* keeps the frames starting at start in m_intermediateBuffer
+     * for the next flush */
+    void returnIntermediateBuffer(std::vector<canfd_frame*>::iterator start);
+
+    /* Accounts frames dropped for reason, only the producer may count
+     * DROP_POOL_DEPLETED and only the consumer all others */
+    void countDropped(FrameDropReason reason, size_t count);
 
     /* This will return a pointer to the current intermediateBuffer.
-     * Once the operation is done the caller MUST call
-     * unlockIntermediateBuffer to unlock the mutex in order to
-     * prevent a deadlock!
+     * It is only ever accessed by the consumer so no locking is needed.
      */
-    std::list<canfd_frame*>* getIntermediateBuffer();
-
-    void unlockIntermediateBuffer();
+    std::vector<canfd_frame*>* getIntermediateBuffer();
 
     void debug();
 
-    /* Moves all frames back into m_framePool and sets the size to 0 */
+    /* Moves all frames back into their pools and sets the size to 0 */
     void reset();
 
+    /* Frees all frames, all threads must have been joined */
     void clearPool();
 
-    size_t getFrameBufferSize();
+    /* Memory used by the frame slabs (bytes) */
+    size_t getPoolMemorySize();
+
+    /* May be called by any thread, free can be off by the frames
+     * that are currently being filled or returned */
+    FrameBufferStats getStats();
+
+    /* Once more than highWatermark frames have been free for
+     * quietPeriod_us, trimPool releases slabs until no more than
+     * lowWatermark frames are free. The pool never shrinks below its
+     * initial size. A quiet period of 0 (default) disables trimming. */
+    void setTrimPolicy(uint64_t quietPeriod_us, size_t lowWatermark, size_t highWatermark);
+
+    /* Decides which buffered frames are dropped once the backlog
+     * grows too large. Without a policy (default) only the frames
+     * that do not fit into the exhausted pool are dropped.
+     * Must be set before the threads are started. */
+    void setOverflowPolicy(std::unique_ptr<OverflowPolicy> policy);
+
+    /* Keeps at most one pending frame for every ID matching one of
+     * filters, see Design Notes. RTR and error frames are never
+     * coalesced. Must be set before the threads are started. */
+    void setCoalescing(const std::vector<CANIdFilter> &filters);
+
+    /* Allocates every pool up to its maximum and reserves all scratch
+     * space, so the buffer does not allocate or release memory later
+     * on. Disables trimming. Must be called before the threads are
+     * started. */
+    void preallocate();
+
+    /* swapBuffers drops frames that have been inserted more than
+     * maxAge_us ago. 0 (default) disables the check, must be set
+     * before the threads are started. */
+    void setMaxAge(uint32_t maxAge_us);
 
   private:
-    bool resizePool(std::size_t size, bool debug = false);
+    /* Adds enough slabs to hold at least size frames of sizeClass */
+    bool resizePool(FrameSizeClass sizeClass, std::size_t size, bool debug = false);
+    /* Consumer side, count frames going back to the pool */
+    void countReleased(size_t count);
+
+    /* Hands the consumer's magazines over to the pools */
+    void flushReturnMagazines();
+
+    /* Consumer side, applies m_overflowPolicy to the backlog of every
+     * overloaded size class, returns the number of bytes dropped */
+    size_t handleOverload();
+    size_t handleOverload(FrameSizeClass sizeClass);
+
+    /* Consumer side, moves all frames of m_buffer to the end of
+     * m_intermediateBuffer and coalesces them */
+    void drainBuffer();
+    /* Slot of the pending frame with the ID of frame,
+     * NULL if frame is not coalesced */
+    canfd_frame** coalesceSlot(const canfd_frame *frame);
+    /* Forgets frame if it is the pending frame of its ID */
+    void releaseCoalesced(canfd_frame *frame);
+    /* Consumer side, drops frames older than m_maxAge from
+     * m_intermediateBuffer, returns the number of bytes dropped */
+    size_t dropExpired();
 
   private:
-    std::list<canfd_frame*> m_framePool;
-    std::list<canfd_frame*> m_buffer;
-    std::list<canfd_frame*> m_intermediateBuffer;
-
-    uint64_t m_totalAllocCount;
-    /* When filling/swapping the buffers we currently need a mutex */
-    std::recursive_mutex m_bufferMutex;
-    std::recursive_mutex m_intermediateBufferMutex;
-    std::recursive_mutex m_poolMutex;
+    /* Free frames of one size class */
+    struct FramePool {
+      explicit FramePool(size_t capacity);
+      SPSCRing<canfd_frame*> ring;
+      /* Producer local, frames that have been allocated or discarded */
+      std::vector<canfd_frame*> spareFrames;
+      /* Written by the producer */
+      std::atomic<size_t> allocCount;
+      /* Consumer local, frames waiting to be returned to ring */
+      canfd_frame *returnMagazine[FRAME_MAGAZINE_SIZE];
+      size_t returnMagazineCount;
+    };
+
+    FramePool m_pools[FRAME_CLASS_COUNT];
+    SPSCRing<canfd_frame*> m_buffer;
+    /* Consumer local */
+    std::vector<canfd_frame*> m_intermediateBuffer;
+    /* Consumer local, orders m_intermediateBuffer */
+    FrameSorter m_sorter;
+    /* Consumer local, frames before this index have already been taken */
+    size_t m_intermediateHead;
+    /* Consumer local, frames from this index on are kept on merge */
+    size_t m_intermediateKeep;
+
+    /* Returned by requestFrame if the pool is depleted */
+    canfd_frame m_overwriteFrame;
+    /* Indexed by FrameDropReason, DROP_POOL_DEPLETED is only written
+     * by the producer, all others only by the consumer */
+    std::atomic<uint64_t> m_droppedCount[DROP_REASON_COUNT];
+
+    /* See preallocate */
+    bool m_preallocated;
+    /* See setMaxAge */
+    uint32_t m_maxAge;
+
+    /* Consumer local, see setOverflowPolicy */
+    std::unique_ptr<OverflowPolicy> m_overflowPolicy;
+    std::vector<uint8_t> m_dropMask;
+    /* Backlog of the size class handed to the policy */
+    std::vector<canfd_frame*> m_overloadFrames;
+    size_t m_overloadHigh;
+    size_t m_overloadLow;
+
+    /* Consumer local, see setCoalescing */
+    std::vector<CANIdFilter> m_coalesceFilters;
+    /* Indexed by standard ID */
+    std::vector<uint8_t> m_coalesceSffMatch;
+    std::vector<canfd_frame*> m_coalesceSff;
+    /* Entries are reset but never erased, so the map only allocates
+     * the first time an extended ID shows up */
+    std::unordered_map<uint32_t, canfd_frame*> m_coalesceEff;
+    std::atomic<uint64_t> m_coalescedCount;
+
+    /* Producer local, list of all slabs */
+    FrameSlab *m_slabs;
+    std::atomic<size_t> m_slabCount;
+
+    /* Sum of the allocCount of all pools */
+    std::atomic<size_t> m_totalAllocCount;
+    std::atomic<size_t> m_peakAllocCount;
+    /* Per size class */
+    size_t m_initialAllocCount;
+    /* Frames inserted by the producer and released by the consumer,
+     * each only written by one side */
+    alignas(CANNELLONI_CACHE_LINE_SIZE) std::atomic<uint64_t> m_insertedCount;
+    alignas(CANNELLONI_CACHE_LINE_SIZE) std::atomic<uint64_t> m_releasedCount;
+
+    /* Producer local, see setTrimPolicy */
+    uint64_t m_trimQuietPeriod;
+    size_t m_trimLowWatermark;
+    size_t m_trimHighWatermark;
+    std::chrono::steady_clock::time_point m_trimIdleSince;
+
     /* Track current frame buffer size */
-    size_t m_bufferSize;
+    std::atomic<size_t> m_bufferSize;
     size_t m_intermediateBufferSize;
     /*
      * This is the maximum of frames that will be
-     * allocated. This guarantees that cannelloni stays
-     * within a fixed memory bounds.
+     * allocated per size class. This guarantees that cannelloni
+     * stays within a fixed memory bounds.
      *
-     * a size of zero means that the buffer can grow
-     * unlimited
+     * It also determines the capacity of the rings, a size of
+     * zero limits the pool to the initial size.
      */
     size_t m_maxAllocCount;
 };
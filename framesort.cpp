@@ -0,0 +1,114 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <cstring>
+
+#include "framesort.h"
+
+using namespace cannelloni;
+
+#define FRAME_SORT_DIGIT_BITS 8
+#define FRAME_SORT_BUCKETS (1 << FRAME_SORT_DIGIT_BITS)
+/* 29 bit IDs need four 8 bit digits */
+#define FRAME_SORT_DIGITS 4
+
+/* Same key canfd_frame_comp compares */
+static inline uint32_t frameSortKey(const canfd_frame *frame) {
+  if (frame->can_id & CAN_EFF_FLAG)
+    return frame->can_id & CAN_EFF_MASK;
+  else
+    return frame->can_id & CAN_SFF_MASK;
+}
+
+FrameSorter::FrameSorter() {}
+
+void FrameSorter::reserve(size_t count) {
+  if (m_entries.size() < count) {
+    m_entries.resize(count);
+    m_scratch.resize(count);
+  }
+}
+
+void FrameSorter::sort(canfd_frame **frames, size_t count) {
+  if (count < 2)
+    return;
+  reserve(count);
+  Entry *src = m_entries.data();
+  Entry *dst = m_scratch.data();
+
+  if (count < FRAME_SORT_INSERTION_THRESHOLD) {
+    for (size_t i = 0; i < count; i++) {
+      src[i].key = frameSortKey(frames[i]);
+      src[i].frame = frames[i];
+    }
+    insertionSort(src, count);
+    for (size_t i = 0; i < count; i++)
+      frames[i] = src[i].frame;
+    return;
+  }
+
+  /* Precompute the keys and all histograms in a single pass */
+  uint32_t histogram[FRAME_SORT_DIGITS][FRAME_SORT_BUCKETS];
+  memset(histogram, 0, sizeof(histogram));
+  for (size_t i = 0; i < count; i++) {
+    uint32_t key = frameSortKey(frames[i]);
+    src[i].key = key;
+    src[i].frame = frames[i];
+    for (int d = 0; d < FRAME_SORT_DIGITS; d++)
+      histogram[d][(key >> (d * FRAME_SORT_DIGIT_BITS)) & (FRAME_SORT_BUCKETS - 1)]++;
+  }
+
+  for (int d = 0; d < FRAME_SORT_DIGITS; d++) {
+    const unsigned int shift = d * FRAME_SORT_DIGIT_BITS;
+    uint32_t *buckets = histogram[d];
+    /* If all frames share this digit the pass would not change anything */
+    if (buckets[(src[0].key >> shift) & (FRAME_SORT_BUCKETS - 1)] == count)
+      continue;
+    /* Turn the histogram into start offsets */
+    uint32_t offset = 0;
+    for (int b = 0; b < FRAME_SORT_BUCKETS; b++) {
+      uint32_t n = buckets[b];
+      buckets[b] = offset;
+      offset += n;
+    }
+    /* Scatter in order, this keeps the sort stable */
+    for (size_t i = 0; i < count; i++)
+      dst[buckets[(src[i].key >> shift) & (FRAME_SORT_BUCKETS - 1)]++] = src[i];
+    Entry *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+
+  for (size_t i = 0; i < count; i++)
+    frames[i] = src[i].frame;
+}
+
+void FrameSorter::insertionSort(Entry *entries, size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    Entry entry = entries[i];
+    size_t j = i;
+    /* Strictly greater, equal keys keep their order */
+    while (j > 0 && entries[j-1].key > entry.key) {
+      entries[j] = entries[j-1];
+      j--;
+    }
+    entries[j] = entry;
+  }
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "cannelloni.h"
+
+namespace cannelloni {
+
+/* Below this number of frames an insertion sort is cheaper */
+#define FRAME_SORT_INSERTION_THRESHOLD 24
+
+/*
+ * Orders frames by their arbitration ID exactly like a stable sort
+ * with canfd_frame_comp would.
+ *
+ * The masked IDs are computed once and stored next to the frame
+ * pointers in a contiguous array, which is then sorted with a stable
+ * LSD radix sort using 8 bit digits. Digits that are identical for
+ * all frames are skipped, so a bus that only uses 11 bit IDs takes at
+ * most two passes and a packet of 29 bit IDs at most four.
+ *
+ * The scratch arrays grow to the largest number of frames sorted and
+ * are reused afterwards.
+ */
+class FrameSorter {
+  public:
+    FrameSorter();
+
+    void sort(canfd_frame **frames, size_t count);
+
+    /* Grows the scratch arrays to count frames upfront */
+    void reserve(size_t count);
+
+  private:
+    struct Entry {
+      uint32_t key;
+      canfd_frame *frame;
+    };
+
+    void insertionSort(Entry *entries, size_t count);
+
+  private:
+    std::vector<Entry> m_entries;
+    std::vector<Entry> m_scratch;
+};
+
+}
@@ -0,0 +1,149 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <algorithm>
+
+#include "overflowpolicy.h"
+
+using namespace cannelloni;
+
+static inline uint32_t maskedId(const canfd_frame *frame) {
+  if (frame->can_id & CAN_EFF_FLAG)
+    return frame->can_id & CAN_EFF_MASK;
+  else
+    return frame->can_id & CAN_SFF_MASK;
+}
+
+const char* cannelloni::frameDropReasonName(FrameDropReason reason) {
+  switch (reason) {
+    case DROP_POOL_DEPLETED:
+      return "pool depleted";
+    case DROP_OLDEST:
+      return "oldest";
+    case DROP_NEWEST:
+      return "newest";
+    case DROP_HIGHEST_ID:
+      return "highest id";
+    case DROP_ID_CLASS:
+      return "id class";
+    case DROP_EXPIRED:
+      return "expired";
+    case DROP_OVERSIZED:
+      return "oversized";
+    default:
+      return "unknown";
+  }
+}
+
+OverflowPolicy::~OverflowPolicy() {}
+
+void OverflowPolicy::reserve(size_t) {}
+
+void DropOldestPolicy::select(canfd_frame **, size_t, size_t excess, uint8_t *drop) {
+  std::fill(drop, drop + excess, 1);
+}
+
+FrameDropReason DropOldestPolicy::reason() const {
+  return DROP_OLDEST;
+}
+
+void DropNewestPolicy::select(canfd_frame **, size_t count, size_t excess, uint8_t *drop) {
+  std::fill(drop + count - excess, drop + count, 1);
+}
+
+FrameDropReason DropNewestPolicy::reason() const {
+  return DROP_NEWEST;
+}
+
+void DropLargestKeyPolicy::reserve(size_t count) {
+  m_keys.reserve(count);
+  m_sortedKeys.reserve(count);
+}
+
+void DropLargestKeyPolicy::select(canfd_frame **frames, size_t count, size_t excess, uint8_t *drop) {
+  if (excess == 0)
+    return;
+  m_keys.resize(count);
+  for (size_t i = 0; i < count; i++)
+    m_keys[i] = key(frames[i]);
+  /* Find the smallest key that still has to go */
+  m_sortedKeys.assign(m_keys.begin(), m_keys.end());
+  auto threshold = m_sortedKeys.begin() + (count - excess);
+  std::nth_element(m_sortedKeys.begin(), threshold, m_sortedKeys.end());
+  const uint32_t limit = *threshold;
+
+  size_t dropped = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (m_keys[i] > limit) {
+      drop[i] = 1;
+      dropped++;
+    }
+  }
+  /* Fill up with the oldest frames carrying the threshold key */
+  for (size_t i = 0; i < count && dropped < excess; i++) {
+    if (m_keys[i] == limit) {
+      drop[i] = 1;
+      dropped++;
+    }
+  }
+}
+
+FrameDropReason DropHighestIdPolicy::reason() const {
+  return DROP_HIGHEST_ID;
+}
+
+uint32_t DropHighestIdPolicy::key(const canfd_frame *frame) {
+  return maskedId(frame);
+}
+
+DropIdClassPolicy::DropIdClassPolicy(const std::map<uint32_t,uint32_t> &classes, uint32_t defaultClass)
+  : m_classes(classes)
+  , m_defaultClass(defaultClass)
+{
+}
+
+FrameDropReason DropIdClassPolicy::reason() const {
+  return DROP_ID_CLASS;
+}
+
+uint32_t DropIdClassPolicy::key(const canfd_frame *frame) {
+  auto it = m_classes.find(maskedId(frame));
+  if (it == m_classes.end())
+    return m_defaultClass;
+  return it->second;
+}
+
+std::unique_ptr<OverflowPolicy> cannelloni::createOverflowPolicy(const std::string &name,
+    const std::map<uint32_t,uint32_t> &classes) {
+  if (name == "oldest")
+    return std::make_unique<DropOldestPolicy>();
+  if (name == "newest")
+    return std::make_unique<DropNewestPolicy>();
+  if (name == "id")
+    return std::make_unique<DropHighestIdPolicy>();
+  if (name == "class") {
+    /* Unlisted IDs are the least important ones */
+    uint32_t defaultClass = 0;
+    for (auto &entry : classes)
+      defaultClass = std::max(defaultClass, entry.second + 1);
+    return std::make_unique<DropIdClassPolicy>(classes, defaultClass);
+  }
+  return std::unique_ptr<OverflowPolicy>();
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "cannelloni.h"
+
+namespace cannelloni {
+
+/* Why a frame has been dropped by a FrameBuffer */
+enum FrameDropReason {
+  /* The pool was exhausted before the consumer could make room */
+  DROP_POOL_DEPLETED,
+  DROP_OLDEST,
+  DROP_NEWEST,
+  DROP_HIGHEST_ID,
+  DROP_ID_CLASS,
+  /* Waited longer than the maximum age, see FrameBuffer::setMaxAge */
+  DROP_EXPIRED,
+  /* Too large for a packet of the transport */
+  DROP_OVERSIZED,
+  DROP_REASON_COUNT
+};
+
+const char* frameDropReasonName(FrameDropReason reason);
+
+/*
+ * Decides which frames are dropped once a FrameBuffer is overloaded.
+ *
+ * select() gets the whole backlog in arrival order and has to mark
+ * exactly excess frames in drop. The FrameBuffer then removes the
+ * marked frames while keeping the order of the remaining ones.
+ * A policy is only ever called by the consumer of its FrameBuffer, so
+ * it may keep scratch state.
+ */
+class OverflowPolicy {
+  public:
+    virtual ~OverflowPolicy();
+    virtual void select(canfd_frame **frames, size_t count, size_t excess, uint8_t *drop) = 0;
+    virtual FrameDropReason reason() const = 0;
+    /* Allocates the scratch state for a backlog of count frames upfront */
+    virtual void reserve(size_t count);
+};
+
+class DropOldestPolicy : public OverflowPolicy {
+  public:
+    virtual void select(canfd_frame **frames, size_t count, size_t excess, uint8_t *drop);
+    virtual FrameDropReason reason() const;
+};
+
+class DropNewestPolicy : public OverflowPolicy {
+  public:
+    virtual void select(canfd_frame **frames, size_t count, size_t excess, uint8_t *drop);
+    virtual FrameDropReason reason() const;
+};
+
+/*
+ * Drops the frames with the largest key first, the oldest frame
+ * first among frames with the same key.
+ */
+class DropLargestKeyPolicy : public OverflowPolicy {
+  public:
+    virtual void select(canfd_frame **frames, size_t count, size_t excess, uint8_t *drop);
+    virtual void reserve(size_t count);
+
+  protected:
+    virtual uint32_t key(const canfd_frame *frame) = 0;
+
+  private:
+    std::vector<uint32_t> m_keys;
+    std::vector<uint32_t> m_sortedKeys;
+};
+
+/* Drops the lowest priority frames (highest arbitration ID) first */
+class DropHighestIdPolicy : public DropLargestKeyPolicy {
+  public:
+    virtual FrameDropReason reason() const;
+
+  protected:
+    virtual uint32_t key(const canfd_frame *frame);
+};
+
+/*
+ * Every ID belongs to a class, 0 being the most important one.
+ * Frames of the highest class are dropped first, IDs that are not
+ * listed belong to defaultClass.
+ */
+class DropIdClassPolicy : public DropLargestKeyPolicy {
+  public:
+    DropIdClassPolicy(const std::map<uint32_t,uint32_t> &classes, uint32_t defaultClass);
+    virtual FrameDropReason reason() const;
+
+  protected:
+    virtual uint32_t key(const canfd_frame *frame);
+
+  private:
+    std::map<uint32_t,uint32_t> m_classes;
+    uint32_t m_defaultClass;
+};
+
+/* Creates a policy by its name (oldest, newest, id, class),
+ * returns an empty pointer if the name is unknown */
+std::unique_ptr<OverflowPolicy> createOverflowPolicy(const std::string &name,
+                                                     const std::map<uint32_t,uint32_t> &classes);
+
+}
@@ -6,88 +6,10 @@
 #include <stdexcept>
 #include <sys/types.h>
 
-ssize_t parseCANFrame(canfd_frame* frame, const uint8_t* rawData, const uint8_t* rawDataEnd) {
-  using namespace cannelloni;
-  const uint8_t* rawDataOrig = rawData;
-  canid_t tmp;
-  memcpy(&tmp, rawData, sizeof (canid_t));
-  frame->can_id = ntohl(tmp);
-  /* += 4 */
-  rawData += sizeof (canid_t);
-  frame->len = *rawData;
-  /* += 1 */
-  rawData += sizeof (frame->len);
-  /*
-   * Reject invalid frame lengths larger than CANFD_MAX_DLEN to prevent
-   * out-of-bounds writes
-   */
-  if (canfd_len(frame) > CANFD_MAX_DLEN)
-  {
-      frame->len = 0;
-      return -1;
-  }
-  /* If this is a CAN FD frame, also retrieve the flags */
-  if (frame->len & CANFD_FRAME)
-  {
-      frame->flags = *rawData;
-      /* += 1 */
-      rawData += sizeof (frame->flags);
-  }
-  /* RTR Frames have no data section although they have a dlc */
-  if ((frame->can_id & CAN_RTR_FLAG) == 0)
-  {
-      /* Check again now that we know the dlc */
-      if (rawData + canfd_len(frame) > rawDataEnd)
-      {
-          frame->len = 0;
-          return -1;
-      }
-
-      memcpy(frame->data, rawData, canfd_len(frame));
-      rawData += canfd_len(frame);
-  }
-  return rawData-rawDataOrig;
-}
-
 void parseFrames(uint16_t len, const uint8_t* buffer, std::function<canfd_frame*()> frameAllocator,
         std::function<void(canfd_frame*, bool)> frameReceiver)
 {
-    using namespace cannelloni;
-
-    const struct CannelloniDataPacket* data;
-    /* Check for OP Code */
-    data = reinterpret_cast<const struct CannelloniDataPacket*> (buffer);
-    if (data->version != CANNELLONI_FRAME_VERSION)
-        throw std::runtime_error("Received wrong version");
-
-    if (data->op_code != DATA)
-        throw std::runtime_error("Received wrong OP code");
-
-    if (ntohs(data->count) == 0)
-        return; // Empty packets silently ignored
-
-    const uint8_t* rawData = buffer + CANNELLONI_DATA_PACKET_BASE_SIZE;
-    const uint8_t* bufferEnd = buffer + len;
-
-    for (uint16_t i = 0; i < ntohs(data->count); i++)
-    {
-        if (rawData - buffer + CANNELLONI_FRAME_BASE_SIZE > len)
-            throw std::runtime_error("Received incomplete packet");
-
-        /* We got at least a complete canfd_frame header */
-        canfd_frame* frame = frameAllocator();
-        if (!frame)
-            throw std::runtime_error("Allocation error.");
-
-        ssize_t bytesParsed = parseCANFrame(frame, rawData, bufferEnd);
-        rawData+=bytesParsed;
-        if (bytesParsed > 0) {
-            frameReceiver(frame, true);
-        } else {
-            frameReceiver(frame, false);
-            throw std::runtime_error("Received incomplete packet / can header corrupt!");
-        }
-    }
+    parseFrames(len, buffer, [&frameAllocator](uint8_t) { return frameAllocator(); }, frameReceiver);
 }
 
 size_t encodeFrame(uint8_t *data, canfd_frame *frame) {
@@ -113,15 +35,137 @@ size_t encodeFrame(uint8_t *data, canfd_frame *frame) {
     return data-dataOrig;
 }
 
-uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
-        std::list<canfd_frame*>& frames, uint8_t seqNo,
-        std::function<void(std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator)> handleOverflow)
+uint8_t parseSequenceNumber(uint16_t len, const uint8_t* buffer, uint32_t& seqNo)
+{
+    using namespace cannelloni;
+
+    if (len < CANNELLONI_DATA_PACKET_BASE_SIZE)
+        return 0;
+    const struct CannelloniDataPacket* data = reinterpret_cast<const struct CannelloniDataPacket*> (buffer);
+    if (data->version != CANNELLONI_FRAME_VERSION)
+        return 0;
+    if (data->op_code == DATA) {
+        seqNo = data->seq_no;
+        return 8;
+    }
+    if (data->op_code == DATA_SEQ32 && len >= CANNELLONI_DATA_PACKET_BASE_SIZE + CANNELLONI_SEQ32_SIZE) {
+        uint32_t tmp;
+        memcpy(&tmp, buffer + CANNELLONI_DATA_PACKET_BASE_SIZE, sizeof(tmp));
+        seqNo = ntohl(tmp);
+        return 32;
+    }
+    return 0;
+}
+
+uint16_t parseDataPacketLength(uint16_t len, const uint8_t* buffer)
+{
+    using namespace cannelloni;
+
+    uint32_t seqNo;
+    uint8_t bits = parseSequenceNumber(len, buffer, seqNo);
+    if (!bits)
+        return 0;
+    const struct CannelloniDataPacket* data = reinterpret_cast<const struct CannelloniDataPacket*> (buffer);
+    size_t offset = CANNELLONI_DATA_PACKET_BASE_SIZE + (bits == 32 ? CANNELLONI_SEQ32_SIZE : 0);
+    for (uint16_t i = 0; i < ntohs(data->count); i++)
+    {
+        if (offset + CANNELLONI_FRAME_BASE_SIZE > len)
+            return 0;
+        canid_t id;
+        memcpy(&id, buffer + offset, sizeof(canid_t));
+        uint8_t frameLen = buffer[offset + sizeof(canid_t)];
+        offset += CANNELLONI_FRAME_BASE_SIZE;
+        if (frameLen & CANFD_FRAME)
+            offset += sizeof(canfd_frame::flags);
+        /* RTR Frames have no data section although they have a dlc */
+        if ((ntohl(id) & CAN_RTR_FLAG) == 0)
+            offset += frameLen & ~(CANFD_FRAME);
+    }
+    if (offset > len)
+        return 0;
+    return offset;
+}
+
+uint8_t* buildNack(uint8_t* packetBuffer, uint32_t first, uint32_t mask)
+{
+    using namespace cannelloni;
+
+    struct CannelloniNackPacket nack;
+    nack.header.version = CANNELLONI_FRAME_VERSION;
+    nack.header.op_code = NACK;
+    nack.header.seq_no = static_cast<uint8_t>(first);
+    nack.header.count = 0;
+    nack.first = htonl(first);
+    nack.mask = htonl(mask);
+    memcpy(packetBuffer, &nack, sizeof(nack));
+    return packetBuffer + sizeof(nack);
+}
+
+bool parseNack(uint16_t len, const uint8_t* buffer, uint32_t& first, uint32_t& mask)
+{
+    using namespace cannelloni;
+
+    struct CannelloniNackPacket nack;
+    if (len < sizeof(nack))
+        return false;
+    memcpy(&nack, buffer, sizeof(nack));
+    if (nack.header.version != CANNELLONI_FRAME_VERSION || nack.header.op_code != NACK)
+        return false;
+    first = ntohl(nack.first);
+    mask = ntohl(nack.mask);
+    return true;
+}
+
+uint8_t* buildFeedback(uint8_t* packetBuffer, uint32_t seqNo, uint32_t timestamp,
+                       uint32_t received, uint32_t lost)
+{
+    using namespace cannelloni;
+
+    struct CannelloniFeedbackPacket feedback;
+    feedback.header.version = CANNELLONI_FRAME_VERSION;
+    feedback.header.op_code = FEEDBACK;
+    feedback.header.seq_no = static_cast<uint8_t>(seqNo);
+    feedback.header.count = 0;
+    feedback.seqNo = htonl(seqNo);
+    feedback.timestamp = htonl(timestamp);
+    feedback.received = htonl(received);
+    feedback.lost = htonl(lost);
+    memcpy(packetBuffer, &feedback, sizeof(feedback));
+    return packetBuffer + sizeof(feedback);
+}
+
+bool parseFeedback(uint16_t len, const uint8_t* buffer, uint32_t& seqNo, uint32_t& timestamp,
+                   uint32_t& received, uint32_t& lost)
+{
+    using namespace cannelloni;
+
+    struct CannelloniFeedbackPacket feedback;
+    if (len < sizeof(feedback))
+        return false;
+    memcpy(&feedback, buffer, sizeof(feedback));
+    if (feedback.header.version != CANNELLONI_FRAME_VERSION || feedback.header.op_code != FEEDBACK)
+        return false;
+    seqNo = ntohl(feedback.seqNo);
+    timestamp = ntohl(feedback.timestamp);
+    received = ntohl(feedback.received);
+    lost = ntohl(feedback.lost);
+    return true;
+}
+
+template <class Iterator>
+static uint8_t* buildPacketRange(uint16_t len, uint8_t* packetBuffer,
+        Iterator& it, Iterator last, uint32_t seqNo, bool wideSequence = false)
 {
     using namespace cannelloni;
 
     uint16_t frameCount = 0;
     uint8_t* data = packetBuffer + CANNELLONI_DATA_PACKET_BASE_SIZE;
-    for (auto it = frames.begin(); it != frames.end(); it++)
+    if (wideSequence) {
+        uint32_t tmp = htonl(seqNo);
+        memcpy(data, &tmp, sizeof(tmp));
+        data += CANNELLONI_SEQ32_SIZE;
+    }
+    for (; it != last; it++)
     {
         canfd_frame* frame = *it;
         /* Check for packet overflow */
@@ -129,7 +173,6 @@ uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
                 + ((frame->len & CANFD_FRAME) ? sizeof(frame->flags) : 0))
                 > len)
         {
-            handleOverflow(frames, it);
             break;
         }
         data += encodeFrame(data, frame);
@@ -138,9 +181,43 @@ uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
     struct CannelloniDataPacket* dataPacket;
     dataPacket = (struct CannelloniDataPacket*) (packetBuffer);
     dataPacket->version = CANNELLONI_FRAME_VERSION;
-    dataPacket->op_code = DATA;
-    dataPacket->seq_no = seqNo;
+    dataPacket->op_code = wideSequence ? DATA_SEQ32 : DATA;
+    dataPacket->seq_no = static_cast<uint8_t>(seqNo);
     dataPacket->count = htons(frameCount);
 
     return data;
 }
+
+template <class Container>
+static uint8_t* buildPacketImpl(uint16_t len, uint8_t* packetBuffer,
+        Container& frames, uint8_t seqNo,
+        std::function<void(Container&, typename Container::iterator)>& handleOverflow)
+{
+    auto it = frames.begin();
+    uint8_t* data = buildPacketRange(len, packetBuffer, it, frames.end(), seqNo);
+    if (it != frames.end())
+        handleOverflow(frames, it);
+    return data;
+}
+
+uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
+        std::list<canfd_frame*>& frames, uint8_t seqNo,
+        std::function<void(std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator)> handleOverflow)
+{
+    return buildPacketImpl(len, packetBuffer, frames, seqNo, handleOverflow);
+}
+
+uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
+        std::vector<canfd_frame*>& frames, uint8_t seqNo,
+        std::function<void(std::vector<canfd_frame*>&, std::vector<canfd_frame*>::iterator)> handleOverflow)
+{
+    return buildPacketImpl(len, packetBuffer, frames, seqNo, handleOverflow);
+}
+
+uint8_t* buildPacket(uint16_t len, uint8_t* packetBuffer,
+        std::vector<canfd_frame*>::iterator& first,
+        std::vector<canfd_frame*>::iterator last, uint32_t seqNo,
+        bool wideSequence)
+{
+    return buildPacketRange(len, packetBuffer, first, last, seqNo, wideSequence);
+}
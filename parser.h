@@ -3,11 +3,63 @@
 
 #include "cannelloni.h"
 
+#include <arpa/inet.h>
 #include <linux/can.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include <functional>
 #include <list>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Parses a single CAN frame, returns the number of bytes consumed or
+ * -1 if the frame is corrupt (frame->len is set to 0 then)
+ */
+inline ssize_t parseCANFrame(canfd_frame* frame, const uint8_t* rawData, const uint8_t* rawDataEnd) {
+  using namespace cannelloni;
+  const uint8_t* rawDataOrig = rawData;
+  canid_t tmp;
+  memcpy(&tmp, rawData, sizeof (canid_t));
+  frame->can_id = ntohl(tmp);
+  /* += 4 */
+  rawData += sizeof (canid_t);
+  frame->len = *rawData;
+  /* += 1 */
+  rawData += sizeof (frame->len);
+  /*
+   * Reject invalid frame lengths larger than CANFD_MAX_DLEN to prevent
+   * out-of-bounds writes
+   */
+  if (canfd_len(frame) > CANFD_MAX_DLEN)
+  {
+      frame->len = 0;
+      return -1;
+  }
+  /* If this is a CAN FD frame, also retrieve the flags */
+  if (frame->len & CANFD_FRAME)
+  {
+      frame->flags = *rawData;
+      /* += 1 */
+      rawData += sizeof (frame->flags);
+  }
+  /* RTR Frames have no data section although they have a dlc */
+  if ((frame->can_id & CAN_RTR_FLAG) == 0)
+  {
+      /* Check again now that we know the dlc */
+      if (rawData + canfd_len(frame) > rawDataEnd)
+      {
+          frame->len = 0;
+          return -1;
+      }
+
+      memcpy(frame->data, rawData, canfd_len(frame));
+      rawData += canfd_len(frame);
+  }
+  return rawData-rawDataOrig;
+}
 
 /**
  * Parses Cannelloni packet and extracts CAN frames
@@ -31,6 +83,112 @@ void parseFrames(uint16_t len, const uint8_t* buffer,
         std::function<canfd_frame*()> frameAllocator,
         std::function<void(canfd_frame*, bool)> frameReceiver);
 
+/**
+ * Same as above but frameAllocator is passed the len field of the
+ * frame (including the CANFD_FRAME bit), the returned frame only
+ * needs to hold a frame of that length.
+ * The callbacks are template arguments so they can be inlined into the
+ * receive loop.
+ */
+template <class Allocator, class Receiver,
+          class = std::enable_if_t<std::is_invocable_r_v<canfd_frame*, Allocator&, uint8_t>>>
+void parseFrames(uint16_t len, const uint8_t* buffer,
+        Allocator&& frameAllocator, Receiver&& frameReceiver)
+{
+    using namespace cannelloni;
+
+    const struct CannelloniDataPacket* data;
+    if (len < CANNELLONI_DATA_PACKET_BASE_SIZE)
+        throw std::runtime_error("Received incomplete packet");
+    /* Check for OP Code */
+    data = reinterpret_cast<const struct CannelloniDataPacket*> (buffer);
+    if (data->version != CANNELLONI_FRAME_VERSION)
+        throw std::runtime_error("Received wrong version");
+
+    const uint8_t* rawData = buffer + CANNELLONI_DATA_PACKET_BASE_SIZE;
+    if (data->op_code == DATA_SEQ32)
+    {
+        if (len < CANNELLONI_DATA_PACKET_BASE_SIZE + CANNELLONI_SEQ32_SIZE)
+            throw std::runtime_error("Received incomplete packet");
+        rawData += CANNELLONI_SEQ32_SIZE;
+    }
+    else if (data->op_code != DATA)
+        throw std::runtime_error("Received wrong OP code");
+
+    if (ntohs(data->count) == 0)
+        return; // Empty packets silently ignored
+
+    const uint8_t* bufferEnd = buffer + len;
+
+    for (uint16_t i = 0; i < ntohs(data->count); i++)
+    {
+        if (rawData - buffer + CANNELLONI_FRAME_BASE_SIZE > len)
+            throw std::runtime_error("Received incomplete packet");
+
+        /* We got at least a complete canfd_frame header,
+         * tell the allocator how large the frame is going to be */
+        canfd_frame* frame = frameAllocator(rawData[sizeof(canid_t)]);
+        if (!frame)
+            throw std::runtime_error("Allocation error.");
+
+        ssize_t bytesParsed = parseCANFrame(frame, rawData, bufferEnd);
+        rawData+=bytesParsed;
+        if (bytesParsed > 0) {
+            frameReceiver(frame, true);
+        } else {
+            frameReceiver(frame, false);
+            throw std::runtime_error("Received incomplete packet / can header corrupt!");
+        }
+    }
+}
+
+/**
+ * Reads the sequence number of a DATA or DATA_SEQ32 packet
+ * @param len Buffer length
+ * @param buffer Pointer to buffer containing Cannelloni packet
+ * @param seqNo Set to the sequence number
+ * @return Number of bits of the sequence number (8 or 32), 0 if the
+ * buffer does not hold a data packet
+ */
+uint8_t parseSequenceNumber(uint16_t len, const uint8_t* buffer, uint32_t& seqNo);
+
+/**
+ * Length of the DATA or DATA_SEQ32 packet at the start of buffer,
+ * without the padding of a GSO segment
+ * @param len Buffer length
+ * @param buffer Pointer to buffer containing Cannelloni packet
+ * @return Length of the packet, 0 if it is incomplete or no data packet
+ */
+uint16_t parseDataPacketLength(uint16_t len, const uint8_t* buffer);
+
+/**
+ * Builds a NACK packet, see CannelloniNackPacket
+ * @param packetBuffer Buffer of at least sizeof(CannelloniNackPacket) bytes
+ * @return End of the packet
+ */
+uint8_t *buildNack(uint8_t *packetBuffer, uint32_t first, uint32_t mask);
+
+/**
+ * Reads a NACK packet
+ * @return false if the buffer does not hold a NACK packet
+ */
+bool parseNack(uint16_t len, const uint8_t* buffer, uint32_t& first, uint32_t& mask);
+
+/**
+ * Builds a FEEDBACK packet, see CannelloniFeedbackPacket
+ * @param packetBuffer Buffer of at least sizeof(CannelloniFeedbackPacket) bytes
+ * @return End of the packet
+ */
+uint8_t *buildFeedback(uint8_t *packetBuffer, uint32_t seqNo, uint32_t timestamp,
+                       uint32_t received, uint32_t lost);
+
+/**
+ * Reads a FEEDBACK packet
+ * @return false if the buffer does not hold a FEEDBACK packet
+ */
+bool parseFeedback(uint16_t len, const uint8_t* buffer, uint32_t& seqNo, uint32_t& timestamp,
+                   uint32_t& received, uint32_t& lost);
+
 /**
  * Encodes a CAN frame into its binary data format.
  *
@@ -59,4 +217,27 @@ uint8_t *buildPacket(uint16_t len, uint8_t *packetBuffer,
                                             std::list<canfd_frame *>::iterator)>
                              handleOverflow);
 
+/**
+ * Same as above but operates on a contiguous array of frames
+ */
+uint8_t *buildPacket(uint16_t len, uint8_t *packetBuffer,
+                         std::vector<canfd_frame *> &frames, uint8_t seqNo,
+                         std::function<void(std::vector<canfd_frame *> &,
+                                            std::vector<canfd_frame *>::iterator)>
+                             handleOverflow);
+
+/**
+ * Builds a Cannelloni packet from the frames in [first, last)
+ * @param first Iterator to the first frame, points to the first frame
+ * that did't fit into the packet (or last) afterwards
+ * @param last End of the frames
+ * @param wideSequence Build a DATA_SEQ32 packet that carries all 32
+ * bits of seqNo, otherwise only the lowest byte is sent
+ * @return End of the packet
+ */
+uint8_t *buildPacket(uint16_t len, uint8_t *packetBuffer,
+                         std::vector<canfd_frame *>::iterator &first,
+                         std::vector<canfd_frame *>::iterator last, uint32_t seqNo,
+                         bool wideSequence = false);
+
 #endif /* PARSER_H_ */
@@ -0,0 +1,218 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "reorderbuffer.h"
+
+using namespace cannelloni;
+
+static size_t roundUpPow2(size_t value) {
+  size_t ret = 1;
+  while (ret < value)
+    ret <<= 1;
+  return ret;
+}
+
+ReorderBuffer::ReorderBuffer(uint64_t holdTime, size_t packets, size_t slotSize)
+  : m_holdTime(holdTime)
+  , m_packets(roundUpPow2(std::min<size_t>(std::max<size_t>(packets, 1), REORDER_MAX_PACKETS)))
+  , m_slotSize(slotSize)
+  , m_lastStream(NULL)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+  memset(&m_lastKey, 0, sizeof(m_lastKey));
+}
+
+uint64_t ReorderBuffer::clock() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ReorderBuffer::Stream& ReorderBuffer::findStream(const struct sockaddr_storage *peer) {
+  PeerKey key = makePeerKey(peer);
+  if (!m_lastStream || !(key == m_lastKey)) {
+    std::unique_ptr<Stream> &stream = m_streams[key];
+    if (!stream)
+      stream.reset(new Stream(m_packets, m_slotSize, m_stats));
+    m_lastKey = key;
+    m_lastStream = stream.get();
+  }
+  return *m_lastStream;
+}
+
+uint64_t ReorderBuffer::nextExpiry() {
+  uint64_t oldest = UINT64_MAX;
+  for (auto &entry : m_streams) {
+    if (entry.second->heldCount())
+      oldest = std::min(oldest, entry.second->oldestArrival());
+  }
+  if (oldest == UINT64_MAX)
+    return 0;
+  uint64_t now = clock();
+  if (oldest + m_holdTime <= now)
+    return 1;
+  return oldest + m_holdTime - now;
+}
+
+uint64_t ReorderBuffer::getHoldTime() const {
+  return m_holdTime;
+}
+
+const ReorderStats& ReorderBuffer::getStats() const {
+  return m_stats;
+}
+
+ReorderBuffer::Stream::Stream(size_t packets, size_t slotSize, ReorderStats &stats)
+  : m_stats(stats)
+  , m_storage(packets * slotSize)
+  , m_slots(packets)
+  , m_held(0)
+  , m_bits(0)
+  , m_mask(0xffffffff)
+  , m_next(0)
+  , m_horizon(0)
+{
+  for (size_t i = 0; i < packets; i++) {
+    m_slots[i].used = false;
+    m_slots[i].len = slotSize;
+    m_slots[i].data = m_storage.data() + i * slotSize;
+  }
+}
+
+bool ReorderBuffer::Stream::isResync(uint32_t seqNo, uint8_t bits, bool restart) const {
+  if (restart || bits != m_bits)
+    return true;
+  int64_t distance = sequenceDistance(seqNo, m_next, bits);
+  return bits == 32 && (distance > SEQUENCE_RESYNC_DISTANCE || distance < -SEQUENCE_RESYNC_DISTANCE);
+}
+
+bool ReorderBuffer::Stream::makeRoom(uint32_t seqNo, uint8_t bits, bool restart) {
+  if (isResync(seqNo, bits, restart)) {
+    if (!m_held)
+      return false;
+    /* Everything held belongs to the old sequence */
+    m_horizon = (m_next + m_slots.size()) & m_mask;
+    return true;
+  }
+  int64_t distance = sequenceDistance(seqNo, m_next, bits);
+  if (distance < static_cast<int64_t>(m_slots.size()))
+    return false;
+  m_horizon = (seqNo - m_slots.size() + 1) & m_mask;
+  return true;
+}
+
+bool ReorderBuffer::Stream::hold(uint32_t seqNo, uint8_t bits, bool restart, const uint8_t *buffer,
+                                 uint16_t len, uint64_t now) {
+  if (isResync(seqNo, bits, restart)) {
+    /* makeRoom has released the held packets */
+    m_bits = bits;
+    m_mask = (bits == 32) ? 0xffffffff : 0xff;
+    m_next = (seqNo + 1) & m_mask;
+    m_horizon = m_next;
+    return false;
+  }
+  seqNo &= m_mask;
+  int64_t distance = sequenceDistance(seqNo, m_next, bits);
+  if (distance < 0) {
+    m_stats.late++;
+    return false;
+  }
+  if (distance == 0) {
+    m_next = (m_next + 1) & m_mask;
+    if (sequenceDistance(m_horizon, m_next, m_bits) < 0)
+      m_horizon = m_next;
+    return false;
+  }
+  Slot &slot = m_slots[seqNo & (m_slots.size() - 1)];
+  if (slot.used) {
+    m_stats.duplicate++;
+    return true;
+  }
+  /* Does not fit, better unordered than not at all */
+  if (len > m_storage.size() / m_slots.size())
+    return false;
+  memcpy(slot.data, buffer, len);
+  slot.used = true;
+  slot.seqNo = seqNo;
+  slot.len = len;
+  slot.arrival = now;
+  m_held++;
+  m_stats.held++;
+  return true;
+}
+
+void ReorderBuffer::Stream::expire(uint64_t now, uint64_t holdTime) {
+  bool expired = false;
+  uint32_t last = 0;
+  for (const Slot &slot : m_slots) {
+    if (!slot.used || now - slot.arrival < holdTime)
+      continue;
+    if (!expired || sequenceDistance(slot.seqNo, last, m_bits) > 0)
+      last = slot.seqNo;
+    expired = true;
+  }
+  if (expired && sequenceDistance((last + 1) & m_mask, m_horizon, m_bits) > 0)
+    m_horizon = (last + 1) & m_mask;
+}
+
+const ReorderBuffer::Slot* ReorderBuffer::Stream::release(uint64_t now) {
+  while (true) {
+    Slot &slot = m_slots[m_next & (m_slots.size() - 1)];
+    if (slot.used && slot.seqNo == m_next) {
+      slot.used = false;
+      m_held--;
+      m_next = (m_next + 1) & m_mask;
+      uint64_t holdTime = now - slot.arrival;
+      m_stats.holdTimeTotal += holdTime;
+      m_stats.holdTimeMax = std::max(m_stats.holdTimeMax, holdTime);
+      return &slot;
+    }
+    int64_t distance = sequenceDistance(m_horizon, m_next, m_bits);
+    if (distance <= 0) {
+      m_horizon = m_next;
+      return NULL;
+    }
+    if (!m_held) {
+      m_stats.skipped += distance;
+      m_next = m_horizon;
+      return NULL;
+    }
+    /* Give up this gap */
+    m_stats.skipped++;
+    m_next = (m_next + 1) & m_mask;
+  }
+}
+
+uint64_t ReorderBuffer::Stream::oldestArrival() const {
+  uint64_t oldest = UINT64_MAX;
+  for (const Slot &slot : m_slots) {
+    if (slot.used)
+      oldest = std::min(oldest, slot.arrival);
+  }
+  return oldest;
+}
+
+size_t ReorderBuffer::Stream::heldCount() const {
+  return m_held;
+}
@@ -0,0 +1,174 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "sequencetracker.h"
+
+namespace cannelloni {
+
+/* Upper limit of the packets held per peer */
+#define REORDER_MAX_PACKETS 64
+
+struct ReorderStats {
+  /* Packets that arrived before their predecessor */
+  uint64_t held;
+  /* Missing packets that were given up on */
+  uint64_t skipped;
+  /* Copies of a held packet */
+  uint64_t duplicate;
+  /* Passed on unordered, their slot was already released */
+  uint64_t late;
+  uint64_t holdTimeTotal;
+  uint64_t holdTimeMax;
+};
+
+/*
+ * Puts the packets of every peer back into sequence order.
+ *
+ * A packet that arrives before its predecessors is copied into a slot
+ * and held until the gap in front of it has been filled or the packet
+ * has been held for the hold time. Then the gap is given up and the
+ * held packets are passed on in sequence order. At most packets are
+ * held per peer, a packet even further ahead pushes the oldest ones
+ * out early. Packets are passed to a callback with the signature
+ * void(const uint8_t *buffer, uint16_t len).
+ */
+class ReorderBuffer {
+  public:
+    /* packets is rounded up to the next power of two, slotSize is the
+     * largest packet that can be held */
+    ReorderBuffer(uint64_t holdTime, size_t packets, size_t slotSize);
+
+    /* Passes the packet on or holds it, along with the held packets it
+     * makes due. seqNo and bits as in SequenceTracker::track, restart
+     * if the tracker has resynced to the packet */
+    template <class Deliver>
+    void insert(const struct sockaddr_storage *peer, uint32_t seqNo, uint8_t bits, bool restart,
+                const uint8_t *buffer, uint16_t len, Deliver &&deliver);
+
+    /* Passes on all packets that have been held for the hold time */
+    template <class Deliver>
+    void expire(Deliver &&deliver);
+
+    /* Microseconds until the next packet expires, 0 if none is held */
+    uint64_t nextExpiry();
+
+    uint64_t getHoldTime() const;
+    const ReorderStats& getStats() const;
+
+    /* Microseconds of a steady clock */
+    static uint64_t clock();
+
+  private:
+    struct Slot {
+      bool used;
+      uint32_t seqNo;
+      uint16_t len;
+      uint64_t arrival;
+      uint8_t *data;
+    };
+
+    class Stream {
+      public:
+        Stream(size_t packets, size_t slotSize, ReorderStats &stats);
+
+        /* Moves the horizon so the packet fits, returns true if
+         * held packets have to be released first */
+        bool makeRoom(uint32_t seqNo, uint8_t bits, bool restart);
+        /* Returns false if the packet has to be passed on right away */
+        bool hold(uint32_t seqNo, uint8_t bits, bool restart, const uint8_t *buffer, uint16_t len,
+                  uint64_t now);
+        /* Gives up the gaps in front of expired packets */
+        void expire(uint64_t now, uint64_t holdTime);
+        /* Next packet in sequence order that is due, NULL if there is
+         * none. It stays valid until the next hold */
+        const Slot* release(uint64_t now);
+        /* Arrival of the oldest held packet */
+        uint64_t oldestArrival() const;
+        size_t heldCount() const;
+
+      private:
+        bool isResync(uint32_t seqNo, uint8_t bits, bool restart) const;
+
+      private:
+        ReorderStats &m_stats;
+        std::vector<uint8_t> m_storage;
+        std::vector<Slot> m_slots;
+        size_t m_held;
+        uint8_t m_bits;
+        uint32_t m_mask;
+        /* Expected sequence number */
+        uint32_t m_next;
+        /* Gaps before this sequence number are given up */
+        uint32_t m_horizon;
+    };
+
+    Stream& findStream(const struct sockaddr_storage *peer);
+    template <class Deliver>
+    void releaseDue(Stream &stream, uint64_t now, Deliver &deliver);
+
+  private:
+    uint64_t m_holdTime;
+    size_t m_packets;
+    size_t m_slotSize;
+    ReorderStats m_stats;
+    std::map<PeerKey, std::unique_ptr<Stream>> m_streams;
+    PeerKey m_lastKey;
+    Stream *m_lastStream;
+};
+
+template <class Deliver>
+void ReorderBuffer::releaseDue(Stream &stream, uint64_t now, Deliver &deliver) {
+  const Slot *slot;
+  while ((slot = stream.release(now)))
+    deliver(slot->data, slot->len);
+}
+
+template <class Deliver>
+void ReorderBuffer::insert(const struct sockaddr_storage *peer, uint32_t seqNo, uint8_t bits, bool restart,
+                           const uint8_t *buffer, uint16_t len, Deliver &&deliver) {
+  Stream &stream = findStream(peer);
+  const uint64_t now = clock();
+  if (stream.makeRoom(seqNo, bits, restart))
+    releaseDue(stream, now, deliver);
+  if (!stream.hold(seqNo, bits, restart, buffer, len, now))
+    deliver(buffer, len);
+  releaseDue(stream, now, deliver);
+}
+
+template <class Deliver>
+void ReorderBuffer::expire(Deliver &&deliver) {
+  const uint64_t now = clock();
+  for (auto &entry : m_streams) {
+    Stream &stream = *entry.second;
+    if (!stream.heldCount())
+      continue;
+    stream.expire(now, m_holdTime);
+    releaseDue(stream, now, deliver);
+  }
+}
+
+}
@@ -0,0 +1,124 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <string.h>
+
+#include <chrono>
+
+#include "retransmitring.h"
+
+using namespace cannelloni;
+
+static size_t roundUpPow2(size_t value) {
+  size_t ret = 1;
+  while (ret < value)
+    ret <<= 1;
+  return ret;
+}
+
+uint32_t cannelloni::nackMask(uint32_t first, uint32_t end, uint8_t bits) {
+  int64_t count = sequenceDistance(end, first, bits);
+  uint32_t mask = 0;
+  for (int64_t i = 1; i < count && i <= 32; i++)
+    mask |= static_cast<uint32_t>(1) << (i - 1);
+  return mask;
+}
+
+RetransmitRing::RetransmitRing(size_t packets, size_t packetSize)
+  : m_mask(roundUpPow2(packets) - 1)
+  , m_packetSize(packetSize)
+  , m_storage((m_mask + 1) * packetSize)
+  , m_seqNo(m_mask + 1)
+  /* Empty slots never match */
+  , m_len(m_mask + 1, 0)
+{
+}
+
+void RetransmitRing::store(uint32_t seqNo, const uint8_t *packet, uint16_t len) {
+  size_t slot = seqNo & m_mask;
+  if (len > m_packetSize)
+    len = 0;
+  memcpy(m_storage.data() + slot * m_packetSize, packet, len);
+  m_seqNo[slot] = seqNo;
+  m_len[slot] = len;
+}
+
+const uint8_t* RetransmitRing::find(uint32_t seqNo, uint8_t bits, uint16_t &len) const {
+  const uint32_t mask = (bits == 32) ? 0xffffffff : 0xff;
+  size_t slot = seqNo & m_mask;
+  if (!m_len[slot] || ((m_seqNo[slot] ^ seqNo) & mask))
+    return NULL;
+  len = m_len[slot];
+  return m_storage.data() + slot * m_packetSize;
+}
+
+NackList::NackList(size_t packets)
+  : m_window(roundUpPow2(packets))
+  , m_count(0)
+{
+}
+
+void NackList::received(const struct sockaddr_storage *peer, uint32_t seqNo, uint8_t bits) {
+  /* Nothing to look up as long as no packet is missing */
+  if (!m_count)
+    return;
+  auto it = m_peers.find(makePeerKey(peer));
+  if (it == m_peers.end() || it->second.bits != bits)
+    return;
+  Peer &state = it->second;
+  if (sequenceDistance(seqNo, state.newest, bits) > 0)
+    state.newest = seqNo;
+  for (auto missing = state.missing.begin(); missing != state.missing.end(); ++missing) {
+    if (missing->seqNo == seqNo) {
+      state.missing.erase(missing);
+      m_count--;
+      break;
+    }
+  }
+}
+
+void NackList::reset(const struct sockaddr_storage *peer) {
+  auto it = m_peers.find(makePeerKey(peer));
+  if (it == m_peers.end())
+    return;
+  m_count -= it->second.missing.size();
+  it->second.missing.clear();
+}
+
+void NackList::expire(Peer &peer) {
+  size_t before = peer.missing.size();
+  peer.missing.erase(std::remove_if(peer.missing.begin(), peer.missing.end(),
+                                    [this, &peer](const Missing &missing) {
+                                      return missing.tries >= NACK_MAX_TRIES ||
+                                             sequenceDistance(peer.newest, missing.seqNo, peer.bits) >=
+                                             static_cast<int64_t>(m_window);
+                                    }),
+                     peer.missing.end());
+  m_count -= before - peer.missing.size();
+}
+
+bool NackList::empty() const {
+  return m_count == 0;
+}
+
+uint64_t NackList::clock() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
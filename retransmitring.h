@@ -0,0 +1,208 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "sequencetracker.h"
+
+namespace cannelloni {
+
+/* Packets a RetransmitRing can hold, with 8 bit sequence numbers it
+ * is limited to RETRANSMIT_MAX_PACKETS_SEQ8 */
+#define RETRANSMIT_MAX_PACKETS 1024
+#define RETRANSMIT_MAX_PACKETS_SEQ8 128
+/* An unanswered NACK is sent again after this many us */
+#define NACK_RETRY_INTERVAL 10000
+/* NACKs sent for a packet before it is given up, the peer may be gone */
+#define NACK_MAX_TRIES 20
+/* Packets a NACK asks for, the first one and those of the mask */
+#define NACK_PACKETS 33
+
+/* Mask of a NACK for the lost packets from first up to end, see
+ * CannelloniNackPacket. It only covers the first NACK_PACKETS of a
+ * larger gap */
+uint32_t nackMask(uint32_t first, uint32_t end, uint8_t bits);
+
+/*
+ * Keeps copies of the most recently sent packets so they can be sent
+ * again when the peer reports them lost, FecDecoder does the same for
+ * received ones. A packet is overwritten by the one sent packets
+ * later. The number of packets is rounded up to the next power of two,
+ * which lets lookups with only the lowest 8 bits of a sequence number
+ * find the right slot.
+ */
+class RetransmitRing {
+  public:
+    RetransmitRing(size_t packets, size_t packetSize);
+
+    void store(uint32_t seqNo, const uint8_t *packet, uint16_t len);
+    /* Returns the packet whose lowest bits (8 or 32) match seqNo, NULL
+     * if it has been overwritten already */
+    const uint8_t* find(uint32_t seqNo, uint8_t bits, uint16_t &len) const;
+
+  private:
+    size_t m_mask;
+    size_t m_packetSize;
+    std::vector<uint8_t> m_storage;
+    std::vector<uint32_t> m_seqNo;
+    std::vector<uint16_t> m_len;
+};
+
+/*
+ * The packets of every peer that have been asked for with a NACK but
+ * not received yet.
+ *
+ * A gap is asked for with as many NACKs as it takes. The NACKs for the
+ * packets that are still missing are repeated every NACK_RETRY_INTERVAL
+ * until the packets arrive, have been overwritten in the RetransmitRing
+ * of the peer or NACK_MAX_TRIES NACKs went unanswered. The ring of the
+ * peer is taken to be as large as the local one. NACKs are passed to a
+ * callback with the signature
+ * void(const struct sockaddr_storage *peer, uint32_t first, uint32_t mask).
+ */
+class NackList {
+  public:
+    /* packets as passed to the RetransmitRing */
+    explicit NackList(size_t packets);
+
+    /* The packets of peer from first up to end (exclusive) are missing,
+     * end is the newest packet. Asks for those the peer still has */
+    template <class Send>
+    void lost(const struct sockaddr_storage *peer, uint32_t first, uint32_t end, uint8_t bits,
+              uint64_t now, Send &&send);
+    /* Packet seqNo of peer has arrived */
+    void received(const struct sockaddr_storage *peer, uint32_t seqNo, uint8_t bits);
+    /* Forgets the missing packets of peer, it has restarted its sequence */
+    void reset(const struct sockaddr_storage *peer);
+    /* Repeats the NACKs that have gone unanswered for NACK_RETRY_INTERVAL */
+    template <class Send>
+    void retry(uint64_t now, Send &&send);
+    /* Whether any packet is missing */
+    bool empty() const;
+
+    /* Microseconds of a steady clock */
+    static uint64_t clock();
+
+  private:
+    struct Missing {
+      uint32_t seqNo;
+      /* Time of the last NACK */
+      uint64_t nacked;
+      uint8_t tries;
+    };
+
+    struct Peer {
+      uint8_t bits;
+      /* Newest packet received */
+      uint32_t newest;
+      /* In sequence order */
+      std::vector<Missing> missing;
+    };
+
+    /* Drops the packets the peer no longer has or that were asked for
+     * too often */
+    void expire(Peer &peer);
+    /* Asks again for the packets last asked for at due or before */
+    template <class Send>
+    void sendDue(const struct sockaddr_storage *address, Peer &peer, uint64_t due, uint64_t now,
+                 Send &send);
+
+  private:
+    size_t m_window;
+    size_t m_count;
+    std::map<PeerKey, Peer> m_peers;
+};
+
+template <class Send>
+void NackList::sendDue(const struct sockaddr_storage *address, Peer &peer, uint64_t due, uint64_t now,
+                       Send &send) {
+  bool pending = false;
+  uint32_t first = 0;
+  uint32_t mask = 0;
+  for (Missing &missing : peer.missing) {
+    if (missing.nacked > due)
+      continue;
+    int64_t offset = sequenceDistance(missing.seqNo, first, peer.bits);
+    if (pending && offset > 0 && offset < NACK_PACKETS) {
+      mask |= static_cast<uint32_t>(1) << (offset - 1);
+    } else {
+      if (pending)
+        send(address, first, mask);
+      pending = true;
+      first = missing.seqNo;
+      mask = 0;
+    }
+    missing.nacked = now;
+    missing.tries++;
+  }
+  if (pending)
+    send(address, first, mask);
+}
+
+template <class Send>
+void NackList::lost(const struct sockaddr_storage *peer, uint32_t first, uint32_t end, uint8_t bits,
+                    uint64_t now, Send &&send) {
+  Peer &state = m_peers[makePeerKey(peer)];
+  if (state.bits != bits) {
+    m_count -= state.missing.size();
+    state.missing.clear();
+    state.missing.reserve(m_window);
+    state.bits = bits;
+  }
+  state.newest = end;
+  expire(state);
+  /* The ring of the peer ends with end */
+  int64_t count = sequenceDistance(end, first, bits);
+  if (count >= static_cast<int64_t>(m_window)) {
+    first += count - (m_window - 1);
+    count = m_window - 1;
+  }
+  const uint32_t mask = (bits == 32) ? 0xffffffff : 0xff;
+  for (int64_t i = 0; i < count; i++)
+    state.missing.push_back(Missing { (first + static_cast<uint32_t>(i)) & mask, now, 1 });
+  m_count += count;
+  for (int64_t i = 0; i < count; i += NACK_PACKETS) {
+    uint32_t chunk = (first + static_cast<uint32_t>(i)) & mask;
+    uint32_t chunkEnd = first + static_cast<uint32_t>(std::min<int64_t>(count, i + NACK_PACKETS));
+    send(peer, chunk, nackMask(chunk, chunkEnd, bits));
+  }
+}
+
+template <class Send>
+void NackList::retry(uint64_t now, Send &&send) {
+  if (!m_count)
+    return;
+  for (auto &entry : m_peers) {
+    Peer &peer = entry.second;
+    expire(peer);
+    if (peer.missing.empty() || now < NACK_RETRY_INTERVAL)
+      continue;
+    struct sockaddr_storage address = peerKeyAddress(entry.first);
+    sendDue(&address, peer, now - NACK_RETRY_INTERVAL, now, send);
+  }
+}
+
+}
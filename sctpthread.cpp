@@ -65,9 +65,9 @@ SCTPThread::SCTPThread(const struct debugOptions_t &debugOptions,
 
 int SCTPThread::start() {
   /*
-   * Since we are currently not using multihoming and/or
-   * one-to-many connections, we can also use SOCK_STREAM
-   * instead of SOCK_SEQPACKET
+   * Since we are currently not using one-to-many connections,
+   * we can also use SOCK_STREAM instead of SOCK_SEQPACKET,
+   * multihoming works either way
    */
   if (m_role == SCTP_SERVER) {
     m_serverSocket = socket(m_addressFamily, SOCK_STREAM, IPPROTO_SCTP);
@@ -79,6 +79,9 @@ int SCTPThread::start() {
       lerror << "Could not bind to address" << std::endl;
       return -1;
     }
+    /* Accepted associations inherit the settings */
+    if (m_failoverTimeout.count())
+      setupFailover(m_serverSocket);
   }
   /*
    * UDPThread::parsePacket will check the remote address. Using SCTP, a packet
@@ -97,7 +100,7 @@ void SCTPThread::run() {
   socklen_t clientAddrLen = sizeof(struct sockaddr_storage);
 
   /* Set interval to m_timeout */
-  m_transmitTimer.adjust(m_timeout, m_timeout);
+  m_transmitTimer.adjust(currentTimeout(), currentTimeout());
   m_blockTimer.adjust(SELECT_TIMEOUT, SELECT_TIMEOUT);
 
   while (m_started) {
@@ -137,8 +140,12 @@ void SCTPThread::run() {
          * the user specified as the peer unless m_checkPeerConnect is false
          */
         if (m_checkPeerConnect) {
-          if ((m_addressFamily == AF_INET && (memcmp(&((struct sockaddr_in *) &connAddr)->sin_addr, &((struct sockaddr_in *) &m_remoteAddr)->sin_addr, sizeof(struct in_addr)) != 0)) || 
-              (m_addressFamily == AF_INET6 && (memcmp(&((struct sockaddr_in6 *) &connAddr)->sin6_addr, &((struct sockaddr_in6 *) &m_remoteAddr)->sin6_addr, sizeof(struct in6_addr)) != 0))) {
+          bool known = false;
+          for (const FailoverRemote &remote : m_remotes) {
+            if (isSameHost(&connAddr, &remote.addr))
+              known = true;
+          }
+          if (!known) {
             lwarn << "Got a connection attempt from " << formatSocketAddress(getSocketAddress(&connAddr))
                   << ", which is not set as a remote. Restart with -p argument to override." << std::endl;
             close(m_socket);
@@ -148,10 +155,17 @@ void SCTPThread::run() {
           }
         }
         linfo << "Got a connection from " << formatSocketAddress(getSocketAddress(&connAddr)) << std::endl;
+        /* Ends the thread, the socket is closed below */
+        if (m_checkPeerConnect && !isOnePeer())
+          break;
         /* At this point we have a valid connection */
         m_connected = true;
-        /* Clear the old entries in frameBuffer */
-        m_frameBuffer->reset();
+        /* Clear the old entries in frameBuffer, unless they have
+         * been kept for the next association */
+        if (!m_failoverTimeout.count())
+          m_frameBuffer->reset();
+        else if (m_frameBuffer->getFrameBufferSize())
+          m_transmitTimer.fire();
         /* Disable Nagle for this connection */
         if (setsockopt(m_socket, IPPROTO_SCTP, SCTP_NODELAY, &nagle, sizeof(nagle))) {
           lerror << "Could not disable Nagle." << std::endl;
@@ -167,16 +181,37 @@ void SCTPThread::run() {
         if (setsockopt(m_socket, IPPROTO_SCTP, SCTP_NODELAY, &nagle, sizeof(nagle))) {
           lerror << "Could not disable Nagle." << std::endl;
         }
+        if (m_failoverTimeout.count())
+          setupFailover(m_socket);
+        /*
+         * The failover remotes are further addresses of the peer, SCTP
+         * tries them in order and switches paths on its own.
+         * sctp_connectx expects them packed without padding.
+         */
+        std::vector<uint8_t> addrs;
+        const size_t addrLen = (m_addressFamily == AF_INET) ? sizeof(struct sockaddr_in)
+                                                            : sizeof(struct sockaddr_in6);
+        for (const FailoverRemote &remote : m_remotes) {
+          const uint8_t *addr = reinterpret_cast<const uint8_t*>(&remote.addr);
+          addrs.insert(addrs.end(), addr, addr + addrLen);
+        }
         linfo << "Connecting..." << std::endl;
-        if (sctp_connectx(m_socket, (struct sockaddr *) &m_remoteAddr, 1, &m_assoc_id) < 0) {
+        if (sctp_connectx(m_socket, (struct sockaddr *) addrs.data(), m_remotes.size(), &m_assoc_id) < 0) {
           close(m_socket);
           linfo << "Connect failed." << std::endl;
           /* Wait here for some time */
-          std::this_thread::sleep_for(std::chrono::seconds(2));
+          if (m_failoverTimeout.count())
+            std::this_thread::sleep_for(m_failoverTimeout);
+          else
+            std::this_thread::sleep_for(std::chrono::seconds(2));
           continue;
         } else {
           linfo << "Connected!" << std::endl;
+          if (!isOnePeer())
+            break;
           m_connected = true;
+          if (m_frameBuffer->getFrameBufferSize())
+            m_transmitTimer.fire();
         }
       }
     } else { /* m_connected == true */
@@ -206,6 +241,8 @@ void SCTPThread::run() {
       }
       if (FD_ISSET(m_blockTimer.getFd(), &readfds)) {
         m_blockTimer.read();
+        /* We are the producer of our peer's pool */
+        m_peerThread->getFrameBuffer()->trimPool(m_debugOptions.buffer);
       }
       if (FD_ISSET(m_socket, &readfds)) {
         struct sctp_sndrcvinfo sinfo;
@@ -242,18 +279,131 @@ void SCTPThread::run() {
   }
 }
 
+void SCTPThread::setupFailover(int socket) {
+  /*
+   * SCTP detects dead paths and peers with heartbeats and retransmissions
+   * on its own, scale them down to the failover timeout (ms here)
+   */
+  const uint32_t timeout = std::max<uint32_t>(m_failoverTimeout.count() / 1000, 2 * FAILOVER_HEARTBEATS);
+  struct sctp_rtoinfo rtoInfo;
+  struct sctp_paddrparams addrParams;
+  struct sctp_assocparams assocParams;
+  struct sctp_initmsg initMsg;
+  socklen_t len;
+  bool success = true;
+
+  memset(&rtoInfo, 0, sizeof(rtoInfo));
+  len = sizeof(rtoInfo);
+  if (getsockopt(socket, IPPROTO_SCTP, SCTP_RTOINFO, &rtoInfo, &len) == 0) {
+    rtoInfo.srto_min = timeout / (2 * FAILOVER_HEARTBEATS);
+    rtoInfo.srto_initial = timeout / FAILOVER_HEARTBEATS;
+    rtoInfo.srto_max = timeout / 2;
+    success &= setsockopt(socket, IPPROTO_SCTP, SCTP_RTOINFO, &rtoInfo, sizeof(rtoInfo)) == 0;
+  } else {
+    success = false;
+  }
+
+  memset(&addrParams, 0, sizeof(addrParams));
+  len = sizeof(addrParams);
+  if (getsockopt(socket, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &addrParams, &len) == 0) {
+    addrParams.spp_hbinterval = timeout / FAILOVER_HEARTBEATS;
+    /* A path is down after the second missed heartbeat */
+    addrParams.spp_pathmaxrxt = 1;
+    addrParams.spp_flags = SPP_HB_ENABLE;
+    success &= setsockopt(socket, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &addrParams, sizeof(addrParams)) == 0;
+  } else {
+    success = false;
+  }
+
+  memset(&assocParams, 0, sizeof(assocParams));
+  len = sizeof(assocParams);
+  if (getsockopt(socket, IPPROTO_SCTP, SCTP_ASSOCINFO, &assocParams, &len) == 0) {
+    /* Give up the association once all paths are down */
+    assocParams.sasoc_asocmaxrxt = 2 * m_remotes.size();
+    success &= setsockopt(socket, IPPROTO_SCTP, SCTP_ASSOCINFO, &assocParams, sizeof(assocParams)) == 0;
+  } else {
+    success = false;
+  }
+
+  memset(&initMsg, 0, sizeof(initMsg));
+  len = sizeof(initMsg);
+  if (getsockopt(socket, IPPROTO_SCTP, SCTP_INITMSG, &initMsg, &len) == 0) {
+    /* Every remote gets one attempt to answer */
+    initMsg.sinit_max_attempts = m_remotes.size() + 1;
+    initMsg.sinit_max_init_timeo = timeout / 2;
+    success &= setsockopt(socket, IPPROTO_SCTP, SCTP_INITMSG, &initMsg, sizeof(initMsg)) == 0;
+  } else {
+    success = false;
+  }
+
+  if (!success)
+    lwarn << "Could not adjust the SCTP timeouts to the failover timeout" << std::endl;
+}
+
+bool SCTPThread::isOnePeer() {
+  if (m_remotes.size() < 2)
+    return true;
+  struct sockaddr *addrs;
+  int count = sctp_getpaddrs(m_socket, 0, &addrs);
+  if (count <= 0) {
+    lerror << "Could not get the addresses of the SCTP peer" << std::endl;
+    return false;
+  }
+  bool result = true;
+  for (const FailoverRemote &remote : m_remotes) {
+    bool found = false;
+    uint8_t *addr = reinterpret_cast<uint8_t*>(addrs);
+    for (int i = 0; i < count; i++) {
+      struct sockaddr_storage peer;
+      memset(&peer, 0, sizeof(peer));
+      const size_t addrLen = (reinterpret_cast<struct sockaddr*>(addr)->sa_family == AF_INET)
+                             ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+      memcpy(&peer, addr, addrLen);
+      addr += addrLen;
+      if (peer.ss_family == m_addressFamily && isSameHost(&peer, &remote.addr))
+        found = true;
+    }
+    if (!found) {
+      lerror << "The remote " << formatSocketAddress(getSocketAddress(&remote.addr))
+             << " is not an address of the SCTP peer, with SCTP -A only takes further"
+             << " addresses of a multihomed peer" << std::endl;
+      result = false;
+    }
+  }
+  sctp_freepaddrs(addrs);
+  return result;
+}
+
 void SCTPThread::transmitFrame(canfd_frame *frame) {
   if (m_connected) {
     UDPThread::transmitFrame(frame);
+  } else if (m_failoverTimeout.count()) {
+    /* Keep it for the next association */
+    m_frameBuffer->insertFrame(frame);
   } else {
     /* We need to drop that frame, since we are not connected */
-    m_frameBuffer->insertFramePool(frame);
+    m_frameBuffer->discardFrame(frame);
     if (m_debugOptions.udp) {
       linfo << "Not connected. Dropping frame" << std::endl;
     }
   }
 }
 
+size_t SCTPThread::sendPackets(size_t count) {
+  size_t sent = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint8_t *buffer = static_cast<uint8_t*>(m_sendIovecs[i].iov_base);
+    ssize_t len = m_sendIovecs[i].iov_len;
+    if (sendBuffer(buffer, len) != len) {
+      lerror << "SCTP Socket error. Error while transmitting" << std::endl;
+    } else {
+      sent++;
+    }
+  }
+  m_txCount += sent;
+  return sent;
+}
+
 ssize_t SCTPThread::sendBuffer(uint8_t *buffer, uint16_t len) {
   struct sctp_sndrcvinfo sinfo;
   memset(&sinfo, 0, sizeof(sinfo));
@@ -66,8 +66,14 @@ class SCTPThread : public UDPThread {
     virtual void transmitFrame(canfd_frame *frame);
 
   protected:
-    virtual ssize_t sendBuffer(uint8_t *buffer, uint16_t len);
+    virtual size_t sendPackets(size_t count);
   private:
+    ssize_t sendBuffer(uint8_t *buffer, uint16_t len);
+    /* Scales the SCTP heartbeats and timeouts to the failover timeout */
+    void setupFailover(int socket);
+    /* Whether every remote is an address of the peer of the association,
+     * -A only adds the further addresses of a multihomed peer */
+    bool isOnePeer();
     bool isConnected();
 
   private:
@@ -0,0 +1,218 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <netinet/in.h>
+
+#include "sequencetracker.h"
+
+using namespace cannelloni;
+
+const char* cannelloni::sequenceResultName(SequenceResult result) {
+  switch (result) {
+    case SEQUENCE_IN_ORDER:
+      return "in order";
+    case SEQUENCE_GAP:
+      return "after a gap";
+    case SEQUENCE_REORDERED:
+      return "reordered";
+    case SEQUENCE_DUPLICATE:
+      return "a duplicate";
+    case SEQUENCE_LATE:
+      return "late";
+    case SEQUENCE_RESYNC:
+      return "a resync";
+    default:
+      return "unknown";
+  }
+}
+
+SequenceTracker::SequenceTracker()
+  : m_lastPeer(NULL)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+  memset(&m_lastKey, 0, sizeof(m_lastKey));
+}
+
+bool PeerKey::operator<(const PeerKey &other) const {
+  if (family != other.family)
+    return family < other.family;
+  if (port != other.port)
+    return port < other.port;
+  return memcmp(address, other.address, sizeof(address)) < 0;
+}
+
+bool PeerKey::operator==(const PeerKey &other) const {
+  return family == other.family && port == other.port &&
+         memcmp(address, other.address, sizeof(address)) == 0;
+}
+
+struct sockaddr_storage cannelloni::peerKeyAddress(const PeerKey &key) {
+  struct sockaddr_storage peer;
+  memset(&peer, 0, sizeof(peer));
+  peer.ss_family = key.family;
+  if (key.family == AF_INET) {
+    struct sockaddr_in *in = reinterpret_cast<struct sockaddr_in*>(&peer);
+    in->sin_port = key.port;
+    memcpy(&in->sin_addr, key.address, sizeof(in->sin_addr));
+  } else if (key.family == AF_INET6) {
+    struct sockaddr_in6 *in6 = reinterpret_cast<struct sockaddr_in6*>(&peer);
+    in6->sin6_port = key.port;
+    memcpy(&in6->sin6_addr, key.address, sizeof(in6->sin6_addr));
+  }
+  return peer;
+}
+
+PeerKey cannelloni::makePeerKey(const struct sockaddr_storage *peer) {
+  PeerKey key;
+  memset(&key, 0, sizeof(key));
+  key.family = peer->ss_family;
+  if (peer->ss_family == AF_INET) {
+    const struct sockaddr_in *in = reinterpret_cast<const struct sockaddr_in*>(peer);
+    key.port = in->sin_port;
+    memcpy(key.address, &in->sin_addr, sizeof(in->sin_addr));
+  } else if (peer->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = reinterpret_cast<const struct sockaddr_in6*>(peer);
+    key.port = in6->sin6_port;
+    memcpy(key.address, &in6->sin6_addr, sizeof(in6->sin6_addr));
+  }
+  return key;
+}
+
+/* The packet is taken as padded with zeros, like the packets of a GSO
+ * datagram, so a padded copy has the same fingerprint */
+static uint32_t fingerprint(const uint8_t *buffer, uint16_t len) {
+  uint64_t words[SEQUENCE_FINGERPRINT_SIZE / sizeof(uint64_t)];
+  memset(words, 0, sizeof(words));
+  if (buffer)
+    memcpy(words, buffer, std::min<size_t>(len, sizeof(words)));
+  uint64_t hash = len ? 1 : 0;
+  for (uint64_t word : words) {
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+SequenceResult SequenceTracker::track(const struct sockaddr_storage *peer, uint32_t seqNo, uint8_t bits,
+                                      const uint8_t *buffer, uint16_t len, uint32_t *expected) {
+  PeerKey key = makePeerKey(peer);
+  if (!m_lastPeer || !(key == m_lastKey)) {
+    /* bits is 0 for a new peer, which forces a resync */
+    auto it = m_peers.emplace(key, PeerState { 0, 0, 0, std::vector<HistoryEntry>(), SequenceStats() }).first;
+    m_lastKey = key;
+    m_lastPeer = &it->second;
+  }
+  PeerState &state = *m_lastPeer;
+  count(state, &SequenceStats::received, 1);
+
+  const uint32_t mask = (bits == 32) ? 0xffffffff : 0xff;
+  seqNo &= mask;
+  if (expected)
+    *expected = state.next;
+  int64_t distance = sequenceDistance(seqNo, state.next, bits);
+  uint32_t print = fingerprint(buffer, len);
+
+  if (state.bits != bits ||
+      (bits == 32 && (distance > SEQUENCE_RESYNC_DISTANCE || distance < -SEQUENCE_RESYNC_DISTANCE))) {
+    resync(state, seqNo, bits, print);
+    return SEQUENCE_RESYNC;
+  }
+
+  if (distance >= 0) {
+    /* Everything between next and seqNo is missing for now */
+    count(state, &SequenceStats::lost, distance);
+    state.serial += distance;
+    record(state, state.serial, print);
+    state.serial++;
+    state.next = (seqNo + 1) & mask;
+    return distance ? SEQUENCE_GAP : SEQUENCE_IN_ORDER;
+  }
+
+  uint32_t serial = state.serial + distance;
+  const HistoryEntry &entry = state.history[serial & (state.history.size() - 1)];
+  if (entry.serial == serial) {
+    if (entry.fingerprint != print) {
+      /* Not the packet received with this sequence number */
+      resync(state, seqNo, bits, print);
+      return SEQUENCE_RESYNC;
+    }
+    count(state, &SequenceStats::duplicate, 1);
+    return SEQUENCE_DUPLICATE;
+  }
+  record(state, serial, print);
+  /* Unless it was sent before the packet we resynced to */
+  if (state.stats.lost) {
+    state.stats.lost--;
+    m_stats.lost--;
+  }
+  if (-distance > SEQUENCE_WINDOW_SIZE) {
+    count(state, &SequenceStats::late, 1);
+    return SEQUENCE_LATE;
+  }
+  count(state, &SequenceStats::reordered, 1);
+  return SEQUENCE_REORDERED;
+}
+
+void SequenceTracker::resync(PeerState &state, uint32_t seqNo, uint8_t bits, uint32_t fingerprint) {
+  size_t historySize = (bits == 32) ? SEQUENCE_RESYNC_DISTANCE : 256;
+  if (state.history.size() != historySize)
+    state.history.assign(historySize, HistoryEntry { 0, 0 });
+  /* Far enough from the old serials that none of them is matched */
+  state.serial += 2 * historySize;
+  state.bits = bits;
+  state.next = (seqNo + 1) & ((bits == 32) ? 0xffffffff : 0xff);
+  record(state, state.serial, fingerprint);
+  state.serial++;
+}
+
+void SequenceTracker::record(PeerState &state, uint32_t serial, uint32_t fingerprint) {
+  HistoryEntry &entry = state.history[serial & (state.history.size() - 1)];
+  entry.serial = serial;
+  entry.fingerprint = fingerprint;
+}
+
+void SequenceTracker::count(PeerState &state, uint64_t SequenceStats::*field, uint64_t value) {
+  state.stats.*field += value;
+  m_stats.*field += value;
+}
+
+const SequenceStats& SequenceTracker::getStats() const {
+  return m_stats;
+}
+
+const SequenceStats* SequenceTracker::getPeerStats(const struct sockaddr_storage *peer) const {
+  auto it = m_peers.find(makePeerKey(peer));
+  return it == m_peers.end() ? NULL : &it->second.stats;
+}
+
+void SequenceTracker::collectPeerStats(std::map<PeerKey, SequenceStats> &stats) const {
+  for (const auto &peer : m_peers) {
+    SequenceStats &total = stats[peer.first];
+    total.received += peer.second.stats.received;
+    total.lost += peer.second.stats.lost;
+    total.duplicate += peer.second.stats.duplicate;
+    total.late += peer.second.stats.late;
+    total.reordered += peer.second.stats.reordered;
+  }
+}
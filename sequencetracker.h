@@ -0,0 +1,148 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace cannelloni {
+
+/* Packets behind the newest one that are still told apart */
+#define SEQUENCE_WINDOW_SIZE 64
+/* A jump of a 32 bit sequence number by more than this is taken for a
+ * restart of the peer and not counted as loss */
+#define SEQUENCE_RESYNC_DISTANCE 4096
+/* Leading bytes of a packet that tell it apart from another one with
+ * the same sequence number */
+#define SEQUENCE_FINGERPRINT_SIZE 64
+
+enum SequenceResult {
+  /* The packet that was expected next */
+  SEQUENCE_IN_ORDER,
+  /* Newer than expected, the packets in between are counted as lost */
+  SEQUENCE_GAP,
+  /* Fills a gap within the window */
+  SEQUENCE_REORDERED,
+  /* Already received */
+  SEQUENCE_DUPLICATE,
+  /* Fills a gap older than the window */
+  SEQUENCE_LATE,
+  /* First packet of a peer, or the peer has restarted its sequence */
+  SEQUENCE_RESYNC
+};
+
+const char* sequenceResultName(SequenceResult result);
+
+/* Signed distance from b to a modulo 2^bits, bits is 8 or 32 */
+inline int64_t sequenceDistance(uint32_t a, uint32_t b, uint8_t bits) {
+  if (bits == 32)
+    return static_cast<int32_t>(a - b);
+  return static_cast<int8_t>(static_cast<uint8_t>(a - b));
+}
+
+/* Identifies a peer by its address and port */
+struct PeerKey {
+  sa_family_t family;
+  uint16_t port;
+  uint8_t address[16];
+
+  bool operator<(const PeerKey &other) const;
+  bool operator==(const PeerKey &other) const;
+};
+
+PeerKey makePeerKey(const struct sockaddr_storage *peer);
+/* The address and port of key */
+struct sockaddr_storage peerKeyAddress(const PeerKey &key);
+
+struct SequenceStats {
+  uint64_t received;
+  uint64_t lost;
+  uint64_t duplicate;
+  uint64_t late;
+  uint64_t reordered;
+};
+
+/*
+ * Follows the sequence numbers of the packets of every peer.
+ *
+ * Each peer has the sequence number it is expected to send next and a
+ * history with a fingerprint of every packet received before it, as far
+ * back as a sequence number can be told apart (256 packets with 8 bits,
+ * SEQUENCE_RESYNC_DISTANCE with 32 bits). Sequence numbers are compared
+ * modulo 2^8 or 2^32 depending on the packet, so a gap of more than 127
+ * packets is misjudged without DATA_SEQ32.
+ * A packet that fills a gap later on is no longer counted as lost.
+ * A packet with the sequence number of one received before but another
+ * fingerprint comes from a peer that has restarted or wrapped its
+ * sequence during an outage, the tracker resyncs to it.
+ * The statistics are kept for every peer and in total.
+ */
+class SequenceTracker {
+  public:
+    SequenceTracker();
+
+    /* Accounts the packet buffer of len bytes from peer, bits is the
+     * width of seqNo (8 or 32). expected is set to the sequence number
+     * that was expected, which is the first lost one of a SEQUENCE_GAP. */
+    SequenceResult track(const struct sockaddr_storage *peer, uint32_t seqNo, uint8_t bits,
+                         const uint8_t *buffer, uint16_t len, uint32_t *expected = NULL);
+    /* Totals of all peers */
+    const SequenceStats& getStats() const;
+    /* NULL if nothing has been received from peer */
+    const SequenceStats* getPeerStats(const struct sockaddr_storage *peer) const;
+    /* Adds the statistics of every peer to stats */
+    void collectPeerStats(std::map<PeerKey, SequenceStats> &stats) const;
+
+  private:
+    struct HistoryEntry {
+      /* Serial of the packet, 0 if none */
+      uint32_t serial;
+      uint32_t fingerprint;
+    };
+
+    struct PeerState {
+      uint8_t bits;
+      /* Expected sequence number */
+      uint32_t next;
+      /* Counts up without wrapping, unlike next */
+      uint32_t serial;
+      /* Received packets by serial modulo its size */
+      std::vector<HistoryEntry> history;
+      SequenceStats stats;
+    };
+
+    /* Adds value to field of the peer and the totals */
+    void count(PeerState &state, uint64_t SequenceStats::*field, uint64_t value);
+    void resync(PeerState &state, uint32_t seqNo, uint8_t bits, uint32_t fingerprint);
+    void record(PeerState &state, uint32_t serial, uint32_t fingerprint);
+
+  private:
+    SequenceStats m_stats;
+    std::map<PeerKey, PeerState> m_peers;
+    /* Usually all packets come from the same peer */
+    PeerKey m_lastKey;
+    PeerState *m_lastPeer;
+};
+
+}
@@ -0,0 +1,186 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace cannelloni {
+
+#define CANNELLONI_CACHE_LINE_SIZE 64
+
+/*
+ * Bounded single-producer/single-consumer ring buffer.
+ *
+ * Exactly one thread may call push() and exactly one (other) thread
+ * may call pop(). Neither side ever blocks or takes a lock, the
+ * indices are published with acquire/release semantics.
+ *
+ * The head (consumer) and tail (producer) indices live on separate
+ * cache lines. Each side additionally keeps a private copy of the
+ * other side's index and only reloads it when the ring looks full
+ * (producer) or empty (consumer), which keeps the cache lines from
+ * bouncing between the two cores on every operation.
+ *
+ * The capacity is rounded up to the next power of two.
+ */
+
+template <class T>
+class SPSCRing {
+  public:
+    explicit SPSCRing(size_t capacity);
+
+    SPSCRing(const SPSCRing&) = delete;
+    SPSCRing& operator=(const SPSCRing&) = delete;
+
+    /* Producer side, returns false if the ring is full */
+    bool push(const T &value);
+    /* Consumer side, returns false if the ring is empty */
+    bool pop(T &value);
+
+    /* Producer side, pushes up to count values with a single index
+     * update, returns the number of values pushed */
+    size_t pushBulk(const T *values, size_t count);
+    /* Consumer side, pops up to count values with a single index
+     * update, returns the number of values popped */
+    size_t popBulk(T *values, size_t count);
+
+    /* Number of elements, only exact when called by either side */
+    size_t size() const;
+    bool empty() const;
+    size_t capacity() const;
+
+  private:
+    static size_t roundUp(size_t value);
+
+  private:
+    const size_t m_mask;
+    std::unique_ptr<T[]> m_slots;
+
+    alignas(CANNELLONI_CACHE_LINE_SIZE) std::atomic<size_t> m_head;
+    /* Consumer's copy of m_tail */
+    size_t m_cachedTail;
+
+    alignas(CANNELLONI_CACHE_LINE_SIZE) std::atomic<size_t> m_tail;
+    /* Producer's copy of m_head */
+    size_t m_cachedHead;
+
+    char m_pad[CANNELLONI_CACHE_LINE_SIZE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+};
+
+template <class T>
+SPSCRing<T>::SPSCRing(size_t capacity)
+  : m_mask(roundUp(capacity) - 1)
+  , m_slots(new T[m_mask + 1])
+  , m_head(0)
+  , m_cachedTail(0)
+  , m_tail(0)
+  , m_cachedHead(0)
+{
+}
+
+template <class T>
+bool SPSCRing<T>::push(const T &value) {
+  const size_t tail = m_tail.load(std::memory_order_relaxed);
+  if (tail - m_cachedHead > m_mask) {
+    m_cachedHead = m_head.load(std::memory_order_acquire);
+    if (tail - m_cachedHead > m_mask)
+      return false;
+  }
+  m_slots[tail & m_mask] = value;
+  m_tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+template <class T>
+bool SPSCRing<T>::pop(T &value) {
+  const size_t head = m_head.load(std::memory_order_relaxed);
+  if (head == m_cachedTail) {
+    m_cachedTail = m_tail.load(std::memory_order_acquire);
+    if (head == m_cachedTail)
+      return false;
+  }
+  value = m_slots[head & m_mask];
+  m_head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+template <class T>
+size_t SPSCRing<T>::pushBulk(const T *values, size_t count) {
+  const size_t tail = m_tail.load(std::memory_order_relaxed);
+  size_t free = m_mask + 1 - (tail - m_cachedHead);
+  if (free < count) {
+    m_cachedHead = m_head.load(std::memory_order_acquire);
+    free = m_mask + 1 - (tail - m_cachedHead);
+    if (free < count)
+      count = free;
+  }
+  for (size_t i = 0; i < count; i++) {
+    m_slots[(tail + i) & m_mask] = values[i];
+  }
+  m_tail.store(tail + count, std::memory_order_release);
+  return count;
+}
+
+template <class T>
+size_t SPSCRing<T>::popBulk(T *values, size_t count) {
+  const size_t head = m_head.load(std::memory_order_relaxed);
+  size_t available = m_cachedTail - head;
+  if (available < count) {
+    m_cachedTail = m_tail.load(std::memory_order_acquire);
+    available = m_cachedTail - head;
+    if (available < count)
+      count = available;
+  }
+  for (size_t i = 0; i < count; i++) {
+    values[i] = m_slots[(head + i) & m_mask];
+  }
+  m_head.store(head + count, std::memory_order_release);
+  return count;
+}
+
+template <class T>
+size_t SPSCRing<T>::size() const {
+  /* Load head first, the tail can only move ahead of it */
+  const size_t head = m_head.load(std::memory_order_acquire);
+  return m_tail.load(std::memory_order_acquire) - head;
+}
+
+template <class T>
+bool SPSCRing<T>::empty() const {
+  return size() == 0;
+}
+
+template <class T>
+size_t SPSCRing<T>::capacity() const {
+  return m_mask + 1;
+}
+
+template <class T>
+size_t SPSCRing<T>::roundUp(size_t value) {
+  size_t ret = 1;
+  while (ret < value)
+    ret <<= 1;
+  return ret;
+}
+
+}
@@ -121,6 +121,8 @@ void TCPThread::run() {
            that have not been signaled through the pipe due to blocking
         */
         flushFrameBuffer();
+        /* We are the producer of our peer's pool */
+        m_peerThread->getFrameBuffer()->trimPool(m_debugOptions.buffer);
       }
       if (FD_ISSET(m_framebufferHasDataPipe[SIGNAL_PIPE_READ], &readfds)) {
         int signal;
@@ -173,9 +175,10 @@ void TCPThread::run() {
         } else {
           m_decoder.expectedBytes = decodeFrame(buffer, receivedBytes, &m_decoder.tempFrame, &m_decoder.state);
           if (m_decoder.expectedBytes == 0) {
-            canfd_frame *frameBufferFrame = m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
+            FrameSizeClass sizeClass = frameSizeClass(m_decoder.tempFrame.len);
+            canfd_frame *frameBufferFrame = m_peerThread->getFrameBuffer()->requestFrame(sizeClass, true, m_debugOptions.buffer);
             if (frameBufferFrame != NULL) {
-              memcpy(frameBufferFrame, &m_decoder.tempFrame, sizeof(m_decoder.tempFrame));
+              memcpy(frameBufferFrame, &m_decoder.tempFrame, frameSizeClassSize(sizeClass));
               m_peerThread->transmitFrame(frameBufferFrame);
             } else {
               lerror << "Dropping frame due to framebuffer issue." << std::endl;
@@ -209,7 +212,7 @@ void TCPThread::disconnect() {
 
 void TCPThread::transmitFrame(canfd_frame *frame) {
   if (m_connect_state != NEGOTIATED) {
-    m_frameBuffer->insertFramePool(frame);
+    m_frameBuffer->discardFrame(frame);
     return;
   }
   m_frameBuffer->insertFrame(frame);
@@ -233,7 +236,7 @@ void TCPThread::flushFrameBuffer() {
   }
   uint8_t transmitBuffer[MAX_TRANSMIT_BUFFER_SIZE_BYTES];
   m_frameBuffer->swapBuffers();
-  std::list<canfd_frame*> *frames = m_frameBuffer->getIntermediateBuffer();
+  std::vector<canfd_frame*> *frames = m_frameBuffer->getIntermediateBuffer();
   for (auto it = frames->begin(); it != frames->end(); it++) {
     canfd_frame* frame = *it;
     ssize_t encodedBytes = encodeFrame(transmitBuffer, frame);
@@ -244,7 +247,6 @@ void TCPThread::flushFrameBuffer() {
     }
     m_txCount++;
   }
-  m_frameBuffer->unlockIntermediateBuffer();
   m_frameBuffer->mergeIntermediateBuffer();
 }
 
@@ -0,0 +1,225 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Runs two UDPThreads back to back over the loopback interface. Each
+ * one is paired with a stand-in for CANThread that injects frames and
+ * consumes the frames arriving from the other side, so both the
+ * CAN->UDP and the UDP->CAN path are exercised. Once the loop is warmed
+ * up, every call to malloc fails the test.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "connection.h"
+#include "framebuffer.h"
+#include "udpthread.h"
+
+using namespace cannelloni;
+
+/* Counts heap allocations while armed */
+static std::atomic<bool> s_armed(false);
+static std::atomic<uint64_t> s_allocations(0);
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+static inline void countAllocation() {
+  if (s_armed.load(std::memory_order_relaxed))
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void *malloc(size_t size) {
+  countAllocation();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  countAllocation();
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  countAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  countAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  countAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  countAllocation();
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+}
+
+/* Stands in for CANThread */
+class LoopbackCANThread : public ConnectionThread {
+  public:
+    LoopbackCANThread() : m_injected(0), m_target(0), m_received(0) {}
+
+    virtual void run() {
+      while (m_started) {
+        /* Inject at most a burst per round, like a busy bus would */
+        for (int i = 0; i < 20 && m_injected < m_target; i++) {
+          uint64_t seq = m_injected;
+          uint8_t len = (seq % 4 == 0) ? (CANFD_FRAME | 12) : (seq % 9);
+          canfd_frame *frame = m_peerThread->getFrameBuffer()->requestFrame(frameSizeClass(len), true);
+          frame->can_id = seq % 2 ? (seq & CAN_SFF_MASK) : ((seq & CAN_EFF_MASK) | CAN_EFF_FLAG);
+          frame->len = len;
+          frame->flags = 0;
+          memset(frame->data, static_cast<uint8_t>(seq), len & ~CANFD_FRAME);
+          m_peerThread->transmitFrame(frame);
+          m_injected++;
+        }
+        canfd_frame *frame;
+        while ((frame = m_frameBuffer->requestBufferFront())) {
+          m_received++;
+          m_frameBuffer->insertFramePool(frame);
+        }
+        usleep(200);
+      }
+    }
+
+    virtual void transmitFrame(canfd_frame *frame) {
+      m_frameBuffer->insertFrame(frame);
+    }
+
+    std::atomic<uint64_t> m_injected;
+    std::atomic<uint64_t> m_target;
+    std::atomic<uint64_t> m_received;
+};
+
+static struct sockaddr_storage loopbackAddress(uint16_t port) {
+  struct sockaddr_storage addr;
+  memset(&addr, 0, sizeof(addr));
+  struct sockaddr_in *in = reinterpret_cast<struct sockaddr_in*>(&addr);
+  in->sin_family = AF_INET;
+  in->sin_port = htons(port);
+  in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return addr;
+}
+
+/* Waits until both sides have received everything the other side injected */
+static bool settle(LoopbackCANThread &a, LoopbackCANThread &b, uint64_t count) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+  while (a.m_received < count || b.m_received < count) {
+    if (std::chrono::steady_clock::now() > deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return true;
+}
+
+int main() {
+  const uint64_t warmup = 20000;
+  const uint64_t measured = 100000;
+  struct debugOptions_t debugOptions = { 0, 0, 0, 0 };
+  struct sockaddr_storage addrA = loopbackAddress(29871);
+  struct sockaddr_storage addrB = loopbackAddress(29872);
+
+  UDPThread udpA(debugOptions, UDPThreadParams {
+    .remoteAddr = addrB, .localAddr = addrA, .addressFamily = AF_INET,
+    .sortFrames = true, .checkPeer = true, .linkMtuSize = 1500 });
+  UDPThread udpB(debugOptions, UDPThreadParams {
+    .remoteAddr = addrA, .localAddr = addrB, .addressFamily = AF_INET,
+    .sortFrames = false, .checkPeer = true, .linkMtuSize = 1500 });
+  udpA.setTimeout(1000);
+  udpB.setTimeout(1000);
+  LoopbackCANThread canA;
+  LoopbackCANThread canB;
+
+  FrameBuffer udpBufferA(1000, 16000), udpBufferB(1000, 16000);
+  FrameBuffer canBufferA(1000, 16000), canBufferB(1000, 16000);
+  for (FrameBuffer *buffer : { &udpBufferA, &udpBufferB, &canBufferA, &canBufferB })
+    buffer->preallocate();
+
+  udpA.setFrameBuffer(&udpBufferA);
+  udpA.setPeerThread(&canA);
+  canA.setFrameBuffer(&canBufferA);
+  canA.setPeerThread(&udpA);
+  udpB.setFrameBuffer(&udpBufferB);
+  udpB.setPeerThread(&canB);
+  canB.setFrameBuffer(&canBufferB);
+  canB.setPeerThread(&udpB);
+
+  if (udpA.start() || udpB.start() || canA.start() || canB.start()) {
+    fprintf(stderr, "Could not start threads\n");
+    return 1;
+  }
+
+  canA.m_target = warmup;
+  canB.m_target = warmup;
+  bool warmedUp = settle(canA, canB, warmup);
+
+  s_armed = true;
+  canA.m_target = warmup + measured;
+  canB.m_target = warmup + measured;
+  bool settled = warmedUp && settle(canA, canB, warmup + measured);
+  s_armed = false;
+
+  canA.stop();
+  canB.stop();
+  udpA.stop();
+  udpB.stop();
+  canA.join();
+  canB.join();
+  udpA.join();
+  udpB.join();
+
+  if (!settled) {
+    fprintf(stderr, "Frames got lost: %lu/%lu received\n",
+            static_cast<unsigned long>(canA.m_received + canB.m_received),
+            static_cast<unsigned long>(2 * (warmup + measured)));
+    return 1;
+  }
+  if (s_allocations) {
+    fprintf(stderr, "%lu allocations after warm-up\n",
+            static_cast<unsigned long>(s_allocations.load()));
+    return 1;
+  }
+  printf("No allocations for %lu frames\n", static_cast<unsigned long>(2 * measured));
+  return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Checks for the unit tests, which are standalone programs. A failed
+ * CHECK is reported and counted, the test goes on so one run shows all
+ * of them. main returns checkResult.
+ */
+
+#pragma once
+
+#include <cstdio>
+
+static int s_failures = 0;
+
+static inline void check(bool condition, const char *what, int line) {
+  if (!condition) {
+    fprintf(stderr, "line %d: %s\n", line, what);
+    s_failures++;
+  }
+}
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+/* Exit code of the test, name is reported if all checks passed */
+static inline int checkResult(const char *name) {
+  if (s_failures) {
+    fprintf(stderr, "%d checks failed\n", s_failures);
+    return 1;
+  }
+  printf("%s passed\n", name);
+  return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Drives CongestionController with a simulated clock: checks the limits
+ * of the token bucket pacer and how the rate follows the queueing delay,
+ * loss and missing feedback.
+ */
+
+#include "congestion.h"
+#include "check.h"
+
+using namespace cannelloni;
+
+#define PACKET_SIZE 1000
+#define TARGET_DELAY 20000
+/* Steps of the simulated clock (us) while waiting for the pacer */
+#define TICK 100
+
+/* A sender and the receiver's feedback over a path with a queue */
+class Path {
+  public:
+    explicit Path(uint64_t maxRate = CC_MAX_RATE, uint16_t packetSize = PACKET_SIZE)
+      : m_controller(TARGET_DELAY, maxRate, packetSize)
+      , m_packetSize(packetSize)
+      , m_now(CongestionController::clock())
+      , m_seqNo(0)
+      , m_lastSent(0)
+      , m_received(0)
+      , m_lost(0)
+      , m_sentBytes(0)
+    {
+    }
+
+    /* Advances the clock by duration, sending whatever the pacer lets
+     * through if busy */
+    void run(uint64_t duration, bool busy = true) {
+      const uint64_t end = m_now + duration;
+      while (m_now < end) {
+        if (busy && m_controller.canSend(m_now)) {
+          m_controller.onPacketSent(m_seqNo++, m_packetSize, m_now);
+          m_lastSent = m_now;
+          m_received++;
+          m_sentBytes += m_packetSize;
+        } else {
+          m_now += TICK;
+        }
+      }
+    }
+
+    /* The receiver reports the newest packet, which waited queue us
+     * behind the others, and lost more packets */
+    void feedback(uint64_t queue, uint32_t lost = 0) {
+      m_lost += lost;
+      /* The clocks are off by a constant */
+      uint32_t timestamp = static_cast<uint32_t>(m_lastSent + 123456 + queue);
+      m_controller.onFeedback(m_seqNo - 1, 32, timestamp, m_received, m_lost, m_now);
+    }
+
+    /* Runs for duration with a feedback every CC_FEEDBACK_INTERVAL */
+    void steady(uint64_t duration, uint64_t queue, bool busy = true) {
+      for (uint64_t time = 0; time < duration; time += CC_FEEDBACK_INTERVAL) {
+        run(CC_FEEDBACK_INTERVAL, busy);
+        feedback(queue);
+      }
+    }
+
+    CongestionController& controller() { return m_controller; }
+    uint64_t now() const { return m_now; }
+    uint64_t sentBytes() const { return m_sentBytes; }
+
+  private:
+    CongestionController m_controller;
+    uint16_t m_packetSize;
+    uint64_t m_now;
+    uint32_t m_seqNo;
+    uint64_t m_lastSent;
+    uint32_t m_received;
+    uint32_t m_lost;
+    uint64_t m_sentBytes;
+};
+
+static bool near(uint64_t a, double b) {
+  return a + 1 >= b && a <= b + 1;
+}
+
+static void testPacing() {
+  Path path;
+  CongestionController &controller = path.controller();
+  const uint64_t now = path.now();
+  CHECK(controller.getRate() == CC_INITIAL_RATE);
+  /* The bucket holds at least two packets */
+  CHECK(controller.canSend(now));
+  controller.onPacketSent(0, PACKET_SIZE, now);
+  CHECK(controller.canSend(now));
+  controller.onPacketSent(1, PACKET_SIZE, now);
+  CHECK(!controller.canSend(now));
+  /* A packet sent anyway has to be paid back */
+  controller.onSent(PACKET_SIZE, now);
+  const uint64_t delay = PACKET_SIZE * 1000000ULL / CC_INITIAL_RATE;
+  CHECK(controller.sendDelay(now) == delay + 1);
+  CHECK(!controller.canSend(now + delay));
+  CHECK(controller.canSend(now + delay + 1));
+  CHECK(controller.sendDelay(now + delay + 1) == 0);
+
+  /* An idle pacer does not save up more than the burst */
+  const uint64_t later = now + 1000000;
+  int burst = 0;
+  while (controller.canSend(later)) {
+    controller.onSent(PACKET_SIZE, later);
+    burst++;
+  }
+  CHECK(burst == 2);
+
+  /* Small packets get CC_BURST_TIME worth of the rate */
+  Path small(CC_MAX_RATE, 100);
+  const uint64_t idle = small.now() + 1000000;
+  burst = 0;
+  while (small.controller().canSend(idle)) {
+    small.controller().onSent(100, idle);
+    burst++;
+  }
+  CHECK(burst == (CC_INITIAL_RATE * CC_BURST_TIME / 1000000 + 99) / 100);
+
+  /* Over time the pacer sticks to the rate */
+  Path busy;
+  busy.run(1000000);
+  CHECK(busy.sentBytes() >= CC_INITIAL_RATE);
+  CHECK(busy.sentBytes() <= CC_INITIAL_RATE + 3 * PACKET_SIZE);
+
+  /* The maximum rate caps the initial one */
+  Path capped(10000);
+  CHECK(capped.controller().getRate() == 10000);
+}
+
+static void testDelayGradient() {
+  /* Below the target the rate grows, but only while it is used */
+  Path idle;
+  idle.run(CC_FEEDBACK_INTERVAL);
+  idle.steady(2000000, 0, false);
+  CHECK(idle.controller().getRate() == CC_INITIAL_RATE);
+
+  Path path;
+  path.steady(2000000, 0);
+  uint64_t rate = path.controller().getRate();
+  CHECK(rate > CC_INITIAL_RATE * 1.3);
+  CHECK(path.controller().getStats().delayDecreases == 0);
+
+  /* Above the target it shrinks gradually */
+  path.steady(1000000, TARGET_DELAY * 3 / 2);
+  uint64_t shrunk = path.controller().getRate();
+  CHECK(shrunk < rate);
+  CHECK(shrunk > rate * 0.8);
+  CHECK(path.controller().getStats().queueDelay == TARGET_DELAY * 3 / 2);
+  CHECK(path.controller().getStats().delayDecreases == 0);
+
+  /* Twice the target cuts it like a loss, once per decrease interval
+   * plus the delay, so the queue can drain */
+  const uint64_t queue = TARGET_DELAY * 3;
+  uint64_t before = 0;
+  /* Takes a few feedbacks to show, see CC_CURRENT_HISTORY */
+  for (int i = 0; i < CC_CURRENT_HISTORY; i++) {
+    path.run(CC_FEEDBACK_INTERVAL);
+    before = path.controller().getRate();
+    path.feedback(queue);
+  }
+  CHECK(path.controller().getStats().delayDecreases == 1);
+  CHECK(near(path.controller().getRate(), before * 0.7));
+  path.steady(CC_DECREASE_INTERVAL + queue - CC_FEEDBACK_INTERVAL, queue);
+  CHECK(path.controller().getStats().delayDecreases == 1);
+  path.steady(CC_FEEDBACK_INTERVAL, queue);
+  CHECK(path.controller().getStats().delayDecreases == 2);
+
+  /* Never beyond the maximum */
+  Path capped(CC_INITIAL_RATE + 1000);
+  capped.steady(2000000, 0);
+  CHECK(capped.controller().getRate() == CC_INITIAL_RATE + 1000);
+}
+
+static void testLoss() {
+  Path path;
+  path.steady(CC_FEEDBACK_INTERVAL * 4, 0);
+  /* A single loss among many packets is tolerated */
+  path.run(CC_FEEDBACK_INTERVAL * 8);
+  path.feedback(0, 1);
+  CHECK(path.controller().getStats().lossDecreases == 0);
+  uint64_t rate = path.controller().getRate();
+
+  path.run(CC_FEEDBACK_INTERVAL);
+  path.feedback(0, 2);
+  CHECK(path.controller().getStats().lossDecreases == 1);
+  CHECK(near(path.controller().getRate(), rate * 0.7));
+
+  /* Repeated cuts bottom out */
+  for (int i = 0; i < 100; i++) {
+    path.run(CC_DECREASE_INTERVAL);
+    path.feedback(0, 10);
+  }
+  CHECK(path.controller().getRate() == CC_MIN_RATE);
+}
+
+static void testFeedbackTimeout() {
+  Path path;
+  path.steady(CC_FEEDBACK_INTERVAL * 4, 0);
+  uint64_t rate = path.controller().getRate();
+  /* Nothing sent, nothing to complain about */
+  path.run(CC_FEEDBACK_TIMEOUT * 2, false);
+  path.controller().checkFeedback(path.now());
+  CHECK(path.controller().getRate() == rate);
+
+  path.feedback(0);
+  rate = path.controller().getRate();
+  for (uint64_t time = 0; time < CC_FEEDBACK_TIMEOUT; time += CC_FEEDBACK_INTERVAL) {
+    path.controller().checkFeedback(path.now());
+    path.run(CC_FEEDBACK_INTERVAL);
+  }
+  CHECK(path.controller().getStats().timeoutDecreases == 0);
+  path.controller().checkFeedback(path.now());
+  CHECK(path.controller().getStats().timeoutDecreases == 1);
+  CHECK(near(path.controller().getRate(), rate * 0.5));
+}
+
+int main() {
+  testPacing();
+  testDelayGradient();
+  testLoss();
+  testFeedbackTimeout();
+  return checkResult("CongestionController");
+}
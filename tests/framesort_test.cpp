@@ -0,0 +1,100 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Sorts randomized buffers with FrameSorter, std::stable_sort and
+ * std::list::sort and fails unless all three agree frame by frame.
+ * IDs are drawn from small ranges so that many frames share a key and
+ * the stability of the sort matters.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <list>
+#include <random>
+#include <vector>
+
+#include "framesort.h"
+
+using namespace cannelloni;
+
+static canid_t randomId(std::mt19937 &rng, uint32_t range) {
+  uint32_t id = rng() % range;
+  switch (rng() % 4) {
+    case 0:
+      /* Same masked ID as the SFF ones, but extended */
+      return (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    case 1:
+      /* High bits spread over all digits of the radix sort */
+      return ((id << 18) & CAN_EFF_MASK) | id | CAN_EFF_FLAG;
+    case 2:
+      /* Flags and garbage above the mask must be ignored */
+      return (id & CAN_SFF_MASK) | CAN_RTR_FLAG | (rng() % 2 ? 0x1000 : 0);
+    default:
+      return id & CAN_SFF_MASK;
+  }
+}
+
+int main() {
+  std::mt19937 rng(4711);
+  const size_t sizes[] = { 0, 1, 2, FRAME_SORT_INSERTION_THRESHOLD - 1, FRAME_SORT_INSERTION_THRESHOLD,
+                           FRAME_SORT_INSERTION_THRESHOLD + 1, 100, 1000, 10000 };
+  const uint32_t ranges[] = { 1, 4, 64, 0x800, 0x20000000 };
+  FrameSorter sorter;
+  size_t runs = 0;
+
+  for (size_t size : sizes) {
+    for (uint32_t range : ranges) {
+      std::vector<canfd_frame> frames(size);
+      for (size_t i = 0; i < size; i++) {
+        memset(&frames[i], 0, sizeof(canfd_frame));
+        frames[i].can_id = randomId(rng, range);
+        frames[i].len = (rng() % 2) ? (CANFD_FRAME | 12) : 8;
+      }
+      std::vector<canfd_frame*> expected(size);
+      for (size_t i = 0; i < size; i++)
+        expected[i] = &frames[i];
+      std::list<canfd_frame*> list(expected.begin(), expected.end());
+      std::vector<canfd_frame*> sorted(expected);
+
+      std::stable_sort(expected.begin(), expected.end(), canfd_frame_comp());
+      list.sort(canfd_frame_comp());
+      sorter.sort(sorted.data(), sorted.size());
+
+      if (!std::equal(expected.begin(), expected.end(), list.begin())) {
+        fprintf(stderr, "std::list::sort and std::stable_sort disagree (%zu frames)\n", size);
+        return 1;
+      }
+      for (size_t i = 0; i < size; i++) {
+        if (sorted[i] != expected[i]) {
+          fprintf(stderr, "Frame %zu of %zu differs for IDs below 0x%x: input frame %zu instead of %zu\n",
+                  i, size, range, static_cast<size_t>(sorted[i] - frames.data()),
+                  static_cast<size_t>(expected[i] - frames.data()));
+          return 1;
+        }
+      }
+      runs++;
+    }
+  }
+  printf("FrameSorter matches a stable sort in %zu runs\n", runs);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Parses a full 1472 byte packet of classic frames over and over, once
+ * through the std::function overload of parseFrames, which wraps the
+ * callbacks for every packet like the receive path used to, and once
+ * through the template that UDPThread::parsePacket inlines.
+ *
+ * Not part of the default build or ctest, the numbers depend on the
+ * machine:
+ *   make parse_bench && tests/parse_bench [iterations]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "parser.h"
+
+using namespace cannelloni;
+
+template <class Parse>
+static double nsPerPacket(uint64_t iterations, Parse parse) {
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < iterations; i++)
+    parse();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+int main(int argc, char **argv) {
+  const uint64_t iterations = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+  std::vector<canfd_frame> frames(200);
+  std::vector<canfd_frame*> pointers;
+  for (size_t i = 0; i < frames.size(); i++) {
+    memset(&frames[i], 0, sizeof(canfd_frame));
+    frames[i].can_id = i;
+    frames[i].len = 8;
+    memset(frames[i].data, i, 8);
+    pointers.push_back(&frames[i]);
+  }
+  uint8_t packet[1472];
+  std::vector<canfd_frame*>::iterator it = pointers.begin();
+  uint16_t len = buildPacket(sizeof(packet), packet, it, pointers.end(), 0) - packet;
+  const size_t count = it - pointers.begin();
+
+  canfd_frame frame;
+  /* Keeps the compiler from dropping the parsing */
+  uint64_t sum = 0;
+  double erased = nsPerPacket(iterations, [&]() {
+    parseFrames(len, packet,
+                std::function<canfd_frame*()>([&]() { return &frame; }),
+                std::function<void(canfd_frame*, bool)>([&](canfd_frame *f, bool success) {
+                  sum += success + f->data[0];
+                }));
+  });
+  double inlined = nsPerPacket(iterations, [&]() {
+    parseFrames(len, packet,
+                [&](uint8_t) { return &frame; },
+                [&](canfd_frame *f, bool success) { sum += success + f->data[0]; });
+  });
+
+  printf("%zu frames per packet, %lu iterations\n", count, static_cast<unsigned long>(iterations));
+  printf("std::function: %.1f ns/packet\n", erased);
+  printf("template:      %.1f ns/packet\n", inlined);
+  printf("(%lu)\n", static_cast<unsigned long>(sum));
+  return 0;
+}
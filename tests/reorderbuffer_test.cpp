@@ -0,0 +1,170 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Inserts packets into a ReorderBuffer out of order and checks the
+ * order they are passed on in, with and without the hold time running
+ * out. Every packet carries its sequence number as payload.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "reorderbuffer.h"
+#include "check.h"
+
+using namespace cannelloni;
+
+/* Hold time of the tests (us) */
+#define HOLD_TIME 20000
+
+class Receiver {
+  public:
+    explicit Receiver(size_t packets) : m_buffer(HOLD_TIME, packets, sizeof(uint32_t)) {
+      memset(&m_peer, 0, sizeof(m_peer));
+      struct sockaddr_in *in = reinterpret_cast<struct sockaddr_in*>(&m_peer);
+      in->sin_family = AF_INET;
+      in->sin_port = htons(1);
+      in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+
+    void insert(uint32_t seqNo, uint8_t bits = 8) {
+      m_buffer.insert(&m_peer, seqNo, bits, false, reinterpret_cast<const uint8_t*>(&seqNo), sizeof(seqNo),
+                      [this](const uint8_t *packet, uint16_t) { deliver(packet); });
+    }
+
+    void expire() {
+      m_buffer.expire([this](const uint8_t *packet, uint16_t) { deliver(packet); });
+    }
+
+    /* Returns true if exactly expected has been passed on since the last call */
+    bool delivered(const std::vector<uint32_t> &expected) {
+      bool ret = m_delivered == expected;
+      if (!ret) {
+        fprintf(stderr, "delivered:");
+        for (uint32_t seqNo : m_delivered)
+          fprintf(stderr, " %u", seqNo);
+        fprintf(stderr, "\n");
+      }
+      m_delivered.clear();
+      return ret;
+    }
+
+    ReorderBuffer m_buffer;
+
+  private:
+    void deliver(const uint8_t *packet) {
+      uint32_t seqNo;
+      memcpy(&seqNo, packet, sizeof(seqNo));
+      m_delivered.push_back(seqNo);
+    }
+
+    struct sockaddr_storage m_peer;
+    std::vector<uint32_t> m_delivered;
+};
+
+static void testInOrderRelease() {
+  Receiver receiver(16);
+  receiver.insert(10);
+  receiver.insert(11);
+  CHECK(receiver.delivered({ 10, 11 }));
+  receiver.insert(14);
+  receiver.insert(13);
+  CHECK(receiver.delivered({}));
+  CHECK(receiver.m_buffer.nextExpiry() > 0);
+  receiver.insert(12);
+  CHECK(receiver.delivered({ 12, 13, 14 }));
+  CHECK(receiver.m_buffer.nextExpiry() == 0);
+  CHECK(receiver.m_buffer.getStats().held == 2);
+  CHECK(receiver.m_buffer.getStats().skipped == 0);
+  /* A second copy of a held packet is swallowed */
+  receiver.insert(16);
+  receiver.insert(16);
+  receiver.insert(15);
+  CHECK(receiver.delivered({ 15, 16 }));
+  CHECK(receiver.m_buffer.getStats().duplicate == 1);
+}
+
+static void testWrap() {
+  Receiver receiver(16);
+  receiver.insert(254);
+  receiver.insert(255);
+  receiver.insert(1);
+  CHECK(receiver.delivered({ 254, 255 }));
+  receiver.insert(0);
+  CHECK(receiver.delivered({ 0, 1 }));
+
+  Receiver wide(16);
+  wide.insert(0xffffffff, 32);
+  wide.insert(1, 32);
+  wide.insert(0, 32);
+  CHECK(wide.delivered({ 0xffffffff, 0, 1 }));
+}
+
+static void testExpiry() {
+  Receiver receiver(16);
+  receiver.insert(0);
+  receiver.insert(3);
+  receiver.insert(2);
+  CHECK(receiver.delivered({ 0 }));
+  /* Not yet due */
+  receiver.expire();
+  CHECK(receiver.delivered({}));
+  std::this_thread::sleep_for(std::chrono::microseconds(HOLD_TIME + 5000));
+  CHECK(receiver.m_buffer.nextExpiry() == 1);
+  receiver.expire();
+  CHECK(receiver.delivered({ 2, 3 }));
+  CHECK(receiver.m_buffer.getStats().skipped == 1);
+  CHECK(receiver.m_buffer.getStats().holdTimeMax >= HOLD_TIME);
+  /* The gap has been given up, its packet is passed on as it is */
+  receiver.insert(1);
+  CHECK(receiver.delivered({ 1 }));
+  CHECK(receiver.m_buffer.getStats().late == 1);
+  receiver.insert(4);
+  CHECK(receiver.delivered({ 4 }));
+}
+
+static void testFull() {
+  Receiver receiver(4);
+  receiver.insert(0);
+  receiver.insert(2);
+  receiver.insert(3);
+  receiver.insert(4);
+  CHECK(receiver.delivered({ 0 }));
+  /* Does not fit behind the gap, which is given up early */
+  receiver.insert(5);
+  CHECK(receiver.delivered({ 2, 3, 4, 5 }));
+  CHECK(receiver.m_buffer.getStats().skipped == 1);
+  CHECK(receiver.m_buffer.nextExpiry() == 0);
+}
+
+int main() {
+  testInOrderRelease();
+  testWrap();
+  testExpiry();
+  testFull();
+  return checkResult("ReorderBuffer");
+}
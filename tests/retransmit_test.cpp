@@ -0,0 +1,361 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Checks RetransmitRing and plays the NACK round trip of -N between a
+ * sender with a ring and a receiver with a SequenceTracker over a link
+ * that loses packets, without sockets.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <set>
+#include <vector>
+
+#include "cannelloni.h"
+#include "parser.h"
+#include "retransmitring.h"
+#include "sequencetracker.h"
+#include "check.h"
+
+using namespace cannelloni;
+
+#define PACKET_SIZE 24
+
+/* An empty DATA_SEQ32 packet with some payload to tell it apart */
+static uint16_t buildPacket(uint8_t *packet, uint32_t seqNo, uint32_t run = 0) {
+  memset(packet, 0, PACKET_SIZE);
+  struct CannelloniDataPacket header;
+  header.version = CANNELLONI_FRAME_VERSION;
+  header.op_code = DATA_SEQ32;
+  header.seq_no = static_cast<uint8_t>(seqNo);
+  header.count = 0;
+  memcpy(packet, &header, sizeof(header));
+  uint32_t wide = htonl(seqNo);
+  memcpy(packet + sizeof(header), &wide, sizeof(wide));
+  memcpy(packet + sizeof(header) + sizeof(wide), &seqNo, sizeof(seqNo));
+  memcpy(packet + sizeof(header) + sizeof(wide) + sizeof(seqNo), &run, sizeof(run));
+  return PACKET_SIZE;
+}
+
+static void testRing() {
+  /* Rounded up to 128 */
+  RetransmitRing ring(100, PACKET_SIZE);
+  uint8_t packet[PACKET_SIZE];
+  for (uint32_t seqNo = 0; seqNo < 300; seqNo++)
+    ring.store(seqNo, packet, buildPacket(packet, seqNo));
+
+  uint16_t len = 0;
+  const uint8_t *found = ring.find(299, 32, len);
+  CHECK(found && len == PACKET_SIZE);
+  uint32_t seqNo = 0;
+  CHECK(found && parseSequenceNumber(len, found, seqNo) == 32 && seqNo == 299);
+  CHECK(ring.find(299 - 127, 32, len) != NULL);
+  /* Overwritten by the packet 128 later */
+  CHECK(ring.find(299 - 128, 32, len) == NULL);
+  /* 8 bit sequence numbers find the same slot */
+  CHECK(ring.find(299 & 0xff, 8, len) == found);
+  CHECK(ring.find(299 & 0xff, 32, len) == NULL);
+
+  /* Too large packets are not kept */
+  uint8_t large[PACKET_SIZE + 1];
+  memset(large, 0, sizeof(large));
+  ring.store(300, large, sizeof(large));
+  CHECK(ring.find(300, 32, len) == NULL);
+}
+
+static void testMask() {
+  CHECK(nackMask(10, 11, 32) == 0);
+  CHECK(nackMask(10, 13, 32) == 0x3);
+  /* Only the first NACK_PACKETS of an outage */
+  CHECK(nackMask(10, 100, 32) == 0xffffffff);
+  CHECK(nackMask(0xfe, 0x01, 8) == 0x3);
+}
+
+static void testNackParser() {
+  uint8_t packet[sizeof(struct CannelloniNackPacket)];
+  uint8_t *end = buildNack(packet, 0x12345678, 0x80000001);
+  CHECK(end == packet + sizeof(packet));
+  uint32_t first = 0, mask = 0;
+  CHECK(parseNack(sizeof(packet), packet, first, mask));
+  CHECK(first == 0x12345678 && mask == 0x80000001);
+  CHECK(!parseNack(sizeof(packet) - 1, packet, first, mask));
+  uint8_t data[PACKET_SIZE];
+  buildPacket(data, 1);
+  CHECK(!parseNack(sizeof(data), data, first, mask));
+}
+
+class Link {
+  public:
+    explicit Link(size_t packets = RETRANSMIT_MAX_PACKETS)
+      : m_packets(packets)
+      , m_ring(packets, PACKET_SIZE)
+      , m_run(0)
+      , m_nackList(packets)
+      , m_now(1000000)
+      , m_lostNacks(0)
+      , m_nacks(0)
+      , m_retransmitted(0)
+    {
+      memset(&m_peer, 0, sizeof(m_peer));
+      struct sockaddr_in *in = reinterpret_cast<struct sockaddr_in*>(&m_peer);
+      in->sin_family = AF_INET;
+      in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+
+    /* The sender keeps a copy of every packet, lost ones never arrive */
+    void send(uint32_t seqNo, bool lost) {
+      uint8_t packet[PACKET_SIZE];
+      uint16_t len = buildPacket(packet, seqNo, m_run);
+      m_ring.store(seqNo, packet, len);
+      if (!lost)
+        receive(packet, len);
+    }
+
+    /* The sender starts over with an empty ring */
+    void restart() {
+      m_ring = RetransmitRing(m_packets, PACKET_SIZE);
+      m_run++;
+      m_delivered.clear();
+    }
+
+    /* The next NACKs the receiver sends get lost */
+    void loseNacks(size_t count) {
+      m_lostNacks = count;
+    }
+
+    /* Lets NACK_RETRY_INTERVAL pass, the receiver repeats its NACKs */
+    void wait() {
+      m_now += NACK_RETRY_INTERVAL;
+      m_nackList.retry(m_now, [this](const struct sockaddr_storage*, uint32_t first, uint32_t mask) {
+        queueNack(first, mask);
+      });
+      sendNacks();
+    }
+
+    /* Sends the packets of a NACK again */
+    void retransmit(const uint8_t *nack, uint16_t nackLen) {
+      uint32_t first, mask;
+      if (!parseNack(nackLen, nack, first, mask))
+        return;
+      for (uint32_t i = 0; i <= 32; i++) {
+        if (i && !(mask & (static_cast<uint32_t>(1) << (i - 1))))
+          continue;
+        uint16_t len;
+        const uint8_t *packet = m_ring.find(first + i, 32, len);
+        if (!packet)
+          continue;
+        m_retransmitted++;
+        receive(packet, len);
+      }
+    }
+
+    const std::set<uint32_t>& delivered() const { return m_delivered; }
+    const SequenceStats& stats() const { return m_tracker.getStats(); }
+    const NackList& nackList() const { return m_nackList; }
+    size_t nacks() const { return m_nacks; }
+    size_t retransmitted() const { return m_retransmitted; }
+
+  private:
+    /* What parsePacket does with -N */
+    void receive(const uint8_t *packet, uint16_t len) {
+      uint32_t seqNo;
+      uint8_t bits = parseSequenceNumber(len, packet, seqNo);
+      CHECK(bits == 32);
+      uint32_t expected;
+      SequenceResult result = m_tracker.track(&m_peer, seqNo, bits, packet, len, &expected);
+      if (result == SEQUENCE_RESYNC) {
+        m_nackList.reset(&m_peer);
+      } else if (result == SEQUENCE_GAP) {
+        m_nackList.lost(&m_peer, expected, seqNo, bits, m_now,
+                        [this](const struct sockaddr_storage*, uint32_t first, uint32_t mask) {
+                          queueNack(first, mask);
+                        });
+      } else {
+        m_nackList.received(&m_peer, seqNo, bits);
+      }
+      if (result != SEQUENCE_DUPLICATE) {
+        /* Every packet reaches the bus once */
+        CHECK(m_delivered.insert(seqNo).second);
+      }
+      sendNacks();
+    }
+
+    void queueNack(uint32_t first, uint32_t mask) {
+      uint8_t nack[sizeof(struct CannelloniNackPacket)];
+      buildNack(nack, first, mask);
+      m_nacks++;
+      if (m_lostNacks)
+        m_lostNacks--;
+      else
+        m_pendingNacks.push_back(std::vector<uint8_t>(nack, nack + sizeof(nack)));
+    }
+
+    /* The NACKs arrive at the sender once the receiver is done */
+    void sendNacks() {
+      std::vector<std::vector<uint8_t>> nacks;
+      nacks.swap(m_pendingNacks);
+      for (const std::vector<uint8_t> &nack : nacks)
+        retransmit(nack.data(), nack.size());
+    }
+
+  private:
+    struct sockaddr_storage m_peer;
+    size_t m_packets;
+    RetransmitRing m_ring;
+    uint32_t m_run;
+    SequenceTracker m_tracker;
+    NackList m_nackList;
+    uint64_t m_now;
+    std::vector<std::vector<uint8_t>> m_pendingNacks;
+    size_t m_lostNacks;
+    std::set<uint32_t> m_delivered;
+    size_t m_nacks;
+    size_t m_retransmitted;
+};
+
+static void testRoundTrip() {
+  Link link;
+  for (uint32_t seqNo = 0; seqNo < 1000; seqNo++)
+    link.send(seqNo, seqNo % 10 == 3 || seqNo % 50 == 4);
+  /* Every gap has been asked for and filled */
+  CHECK(link.delivered().size() == 1000);
+  CHECK(link.nacks() == 100);
+  CHECK(link.retransmitted() == 120);
+  CHECK(link.stats().lost == 0);
+  CHECK(link.stats().duplicate == 0);
+  CHECK(link.stats().reordered == 120);
+  CHECK(link.nackList().empty());
+
+  /* An outage takes a NACK per NACK_PACKETS */
+  Link outage;
+  for (uint32_t seqNo = 0; seqNo < 100; seqNo++)
+    outage.send(seqNo, seqNo >= 10 && seqNo < 60);
+  CHECK(outage.nacks() == 2);
+  CHECK(outage.retransmitted() == 50);
+  CHECK(outage.delivered().size() == 100);
+  CHECK(outage.stats().lost == 0);
+  CHECK(outage.nackList().empty());
+
+  /* A second NACK for the same packets only brings duplicates */
+  uint8_t nack[sizeof(struct CannelloniNackPacket)];
+  uint8_t *end = buildNack(nack, 10, 0x1);
+  outage.retransmit(nack, end - nack);
+  CHECK(outage.stats().duplicate == 2);
+  CHECK(outage.delivered().size() == 100);
+}
+
+static void testRetry() {
+  /* The first NACK is lost, the repeated one brings the packets */
+  Link link;
+  for (uint32_t seqNo = 0; seqNo < 20; seqNo++) {
+    if (seqNo == 10)
+      link.loseNacks(1);
+    link.send(seqNo, seqNo >= 5 && seqNo < 10);
+  }
+  CHECK(link.delivered().size() == 15);
+  CHECK(!link.nackList().empty());
+  link.wait();
+  CHECK(link.nacks() == 2);
+  CHECK(link.delivered().size() == 20);
+  CHECK(link.stats().lost == 0);
+  CHECK(link.nackList().empty());
+  /* Nothing left to ask for */
+  link.wait();
+  CHECK(link.nacks() == 2);
+
+  /* Only the packets still missing are asked for again */
+  Link partly;
+  for (uint32_t seqNo = 0; seqNo < 100; seqNo++) {
+    if (seqNo == 80)
+      partly.loseNacks(2);
+    partly.send(seqNo, seqNo >= 10 && seqNo < 80);
+  }
+  CHECK(partly.nacks() == 3);
+  CHECK(partly.delivered().size() == 100 - 70 + 4);
+  partly.wait();
+  CHECK(partly.nacks() == 5);
+  CHECK(partly.retransmitted() == 70);
+  CHECK(partly.delivered().size() == 100);
+  CHECK(partly.nackList().empty());
+
+  /* A peer that does not answer is given up on */
+  Link silent;
+  for (uint32_t seqNo = 0; seqNo < 20; seqNo++) {
+    if (seqNo == 5)
+      silent.loseNacks(NACK_MAX_TRIES + 1);
+    silent.send(seqNo, seqNo == 5);
+  }
+  for (int i = 0; i < NACK_MAX_TRIES + 1; i++)
+    silent.wait();
+  CHECK(silent.nacks() == NACK_MAX_TRIES);
+  CHECK(silent.nackList().empty());
+  CHECK(silent.stats().lost == 1);
+}
+
+static void testWindow() {
+  /* Only what the ring of the sender still holds is asked for */
+  Link outage(64);
+  for (uint32_t seqNo = 0; seqNo < 200; seqNo++)
+    outage.send(seqNo, seqNo >= 10 && seqNo < 110);
+  CHECK(outage.retransmitted() == 63);
+  CHECK(outage.stats().lost == 100 - 63);
+  CHECK(outage.nackList().empty());
+
+  /* Packets overwritten while the NACKs are lost are given up on */
+  Link link(64);
+  for (uint32_t seqNo = 0; seqNo < 20; seqNo++) {
+    if (seqNo == 10)
+      link.loseNacks(1);
+    link.send(seqNo, seqNo >= 5 && seqNo < 10);
+  }
+  for (uint32_t seqNo = 20; seqNo < 100; seqNo++)
+    link.send(seqNo, false);
+  link.wait();
+  CHECK(link.nacks() == 1);
+  CHECK(link.nackList().empty());
+  CHECK(link.stats().lost == 5);
+}
+
+static void testRestart() {
+  Link link;
+  for (uint32_t seqNo = 0; seqNo < 500; seqNo++)
+    link.send(seqNo, seqNo % 10 == 3);
+  /* The new packets reuse the sequence numbers of the old ones */
+  link.restart();
+  for (uint32_t seqNo = 0; seqNo < 500; seqNo++)
+    link.send(seqNo, seqNo % 10 == 3);
+  CHECK(link.delivered().size() == 500);
+  CHECK(link.stats().duplicate == 0);
+  CHECK(link.stats().lost == 0);
+}
+
+int main() {
+  testRing();
+  testMask();
+  testNackParser();
+  testRoundTrip();
+  testRetry();
+  testWindow();
+  testRestart();
+  return checkResult("RetransmitRing");
+}
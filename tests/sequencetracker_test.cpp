@@ -0,0 +1,200 @@
+/*
+ * This file is part of cannelloni, a SocketCAN over Ethernet tunnel.
+ *
+ * Copyright (C) 2014-2017 Maximilian Güntner <code@sourcediver.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License, version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/*
+ * Feeds SequenceTracker with hand made sequences of 8 and 32 bit
+ * sequence numbers and checks the classification of every packet and
+ * the statistics of every peer. The packets carry a number that tells
+ * them apart, a restarted peer sends other packets under the sequence
+ * numbers of the old ones.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include "sequencetracker.h"
+#include "check.h"
+
+using namespace cannelloni;
+
+static struct sockaddr_storage peerAddress(uint16_t port) {
+  struct sockaddr_storage addr;
+  memset(&addr, 0, sizeof(addr));
+  struct sockaddr_in *in = reinterpret_cast<struct sockaddr_in*>(&addr);
+  in->sin_family = AF_INET;
+  in->sin_port = htons(port);
+  in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return addr;
+}
+
+static SequenceResult trackPacket(SequenceTracker &tracker, const struct sockaddr_storage *peer,
+                                  uint32_t seqNo, uint8_t bits, uint64_t content,
+                                  uint32_t *expected = NULL) {
+  uint8_t packet[16];
+  memset(packet, 0, sizeof(packet));
+  memcpy(packet, &content, sizeof(content));
+  return tracker.track(peer, seqNo, bits, packet, sizeof(packet), expected);
+}
+
+static SequenceResult track(SequenceTracker &tracker, const struct sockaddr_storage *peer,
+                            uint32_t seqNo, uint8_t bits, uint32_t *expected = NULL) {
+  return trackPacket(tracker, peer, seqNo, bits, seqNo, expected);
+}
+
+static void testWrap8() {
+  SequenceTracker tracker;
+  struct sockaddr_storage peer = peerAddress(1);
+  CHECK(track(tracker, &peer, 250, 8) == SEQUENCE_RESYNC);
+  for (uint32_t seqNo = 251; seqNo < 256 + 10; seqNo++)
+    CHECK(track(tracker, &peer, seqNo & 0xff, 8) == SEQUENCE_IN_ORDER);
+  /* Only the low 8 bits count */
+  CHECK(track(tracker, &peer, 0x10a, 8) == SEQUENCE_IN_ORDER);
+  CHECK(tracker.getStats().received == 17);
+  CHECK(tracker.getStats().lost == 0);
+}
+
+static void testWrap32() {
+  SequenceTracker tracker;
+  struct sockaddr_storage peer = peerAddress(1);
+  CHECK(track(tracker, &peer, 0xfffffffe, 32) == SEQUENCE_RESYNC);
+  CHECK(track(tracker, &peer, 0xffffffff, 32) == SEQUENCE_IN_ORDER);
+  CHECK(track(tracker, &peer, 0, 32) == SEQUENCE_IN_ORDER);
+  uint32_t expected;
+  CHECK(track(tracker, &peer, 3, 32, &expected) == SEQUENCE_GAP);
+  CHECK(expected == 1);
+  CHECK(tracker.getStats().lost == 2);
+  /* Too far off to be a gap */
+  CHECK(track(tracker, &peer, 4 + SEQUENCE_RESYNC_DISTANCE + 1, 32) == SEQUENCE_RESYNC);
+  CHECK(track(tracker, &peer, 4 + SEQUENCE_RESYNC_DISTANCE + 2, 32) == SEQUENCE_IN_ORDER);
+}
+
+static void testClassification() {
+  SequenceTracker tracker;
+  struct sockaddr_storage peer = peerAddress(1);
+  CHECK(track(tracker, &peer, 100, 8) == SEQUENCE_RESYNC);
+  uint32_t expected;
+  CHECK(track(tracker, &peer, 104, 8, &expected) == SEQUENCE_GAP);
+  CHECK(expected == 101);
+  CHECK(tracker.getStats().lost == 3);
+  /* Filling the gap takes the packet off the lost ones */
+  CHECK(track(tracker, &peer, 102, 8) == SEQUENCE_REORDERED);
+  CHECK(tracker.getStats().lost == 2);
+  CHECK(tracker.getStats().reordered == 1);
+  CHECK(track(tracker, &peer, 102, 8) == SEQUENCE_DUPLICATE);
+  CHECK(track(tracker, &peer, 104, 8) == SEQUENCE_DUPLICATE);
+  CHECK(tracker.getStats().duplicate == 2);
+  /* The window ends SEQUENCE_WINDOW_SIZE packets behind the newest */
+  for (uint32_t seqNo = 105; seqNo < 105 + SEQUENCE_WINDOW_SIZE; seqNo++)
+    CHECK(track(tracker, &peer, seqNo & 0xff, 8) == SEQUENCE_IN_ORDER);
+  /* Behind the window a lost packet is still told from a duplicate */
+  CHECK(track(tracker, &peer, 101, 8) == SEQUENCE_LATE);
+  CHECK(tracker.getStats().lost == 1);
+  CHECK(track(tracker, &peer, 101, 8) == SEQUENCE_DUPLICATE);
+  CHECK(track(tracker, &peer, 104, 8) == SEQUENCE_DUPLICATE);
+  CHECK(track(tracker, &peer, 105, 8) == SEQUENCE_DUPLICATE);
+  CHECK(tracker.getStats().late == 1);
+  /* A different width restarts the sequence */
+  CHECK(track(tracker, &peer, 5, 32) == SEQUENCE_RESYNC);
+  CHECK(track(tracker, &peer, 6, 32) == SEQUENCE_IN_ORDER);
+}
+
+static void testRestart() {
+  SequenceTracker tracker;
+  struct sockaddr_storage peer = peerAddress(1);
+  for (uint32_t seqNo = 0; seqNo < 1000; seqNo++)
+    track(tracker, &peer, seqNo, 32);
+  /* The peer starts over, its first packet collides with an old one */
+  CHECK(trackPacket(tracker, &peer, 0, 32, 1000) == SEQUENCE_RESYNC);
+  for (uint32_t seqNo = 1; seqNo < 1000; seqNo++)
+    CHECK(trackPacket(tracker, &peer, seqNo, 32, 1000 + seqNo) == SEQUENCE_IN_ORDER);
+  CHECK(tracker.getStats().duplicate == 0);
+  CHECK(tracker.getStats().lost == 0);
+
+  /* The old packets only come in as duplicates now */
+  CHECK(trackPacket(tracker, &peer, 999, 32, 1999) == SEQUENCE_DUPLICATE);
+  CHECK(trackPacket(tracker, &peer, 500, 32, 1500) == SEQUENCE_DUPLICATE);
+
+  /* An outage of 200 packets makes an 8 bit sequence go backwards */
+  SequenceTracker narrow;
+  for (uint64_t packet = 0; packet < 300; packet++)
+    trackPacket(narrow, &peer, packet & 0xff, 8, packet);
+  CHECK(trackPacket(narrow, &peer, 500 & 0xff, 8, 500) == SEQUENCE_RESYNC);
+  for (uint64_t packet = 501; packet < 600; packet++)
+    CHECK(trackPacket(narrow, &peer, packet & 0xff, 8, packet) == SEQUENCE_IN_ORDER);
+}
+
+static void testSlowPath() {
+  SequenceTracker tracker;
+  struct sockaddr_storage peer = peerAddress(1);
+  for (uint32_t seqNo = 0; seqNo < 1000; seqNo++) {
+    if (seqNo % 100 != 50)
+      track(tracker, &peer, seqNo, 32);
+  }
+  /* The copies of a slower path, far behind the window */
+  for (uint32_t seqNo = 0; seqNo < 1000; seqNo++) {
+    SequenceResult result = track(tracker, &peer, seqNo, 32);
+    if (seqNo % 100 == 50)
+      CHECK(result == SEQUENCE_LATE || result == SEQUENCE_REORDERED);
+    else
+      CHECK(result == SEQUENCE_DUPLICATE);
+  }
+  CHECK(tracker.getStats().lost == 0);
+  CHECK(track(tracker, &peer, 1000, 32) == SEQUENCE_IN_ORDER);
+}
+
+static void testPeers() {
+  SequenceTracker tracker;
+  struct sockaddr_storage a = peerAddress(1);
+  struct sockaddr_storage b = peerAddress(2);
+  CHECK(tracker.getPeerStats(&a) == NULL);
+  track(tracker, &a, 0, 8);
+  track(tracker, &b, 0, 8);
+  track(tracker, &a, 1, 8);
+  /* Interleaved peers do not disturb each other */
+  CHECK(track(tracker, &b, 5, 8) == SEQUENCE_GAP);
+  CHECK(track(tracker, &a, 2, 8) == SEQUENCE_IN_ORDER);
+  CHECK(track(tracker, &b, 5, 8) == SEQUENCE_DUPLICATE);
+
+  const SequenceStats *statsA = tracker.getPeerStats(&a);
+  const SequenceStats *statsB = tracker.getPeerStats(&b);
+  CHECK(statsA && statsA->received == 3 && statsA->lost == 0 && statsA->duplicate == 0);
+  CHECK(statsB && statsB->received == 3 && statsB->lost == 4 && statsB->duplicate == 1);
+  CHECK(tracker.getStats().received == 6);
+  CHECK(tracker.getStats().lost == 4);
+
+  std::map<PeerKey, SequenceStats> peers;
+  tracker.collectPeerStats(peers);
+  tracker.collectPeerStats(peers);
+  CHECK(peers.size() == 2);
+  CHECK(peers[makePeerKey(&b)].lost == 8);
+  struct sockaddr_storage address = peerKeyAddress(makePeerKey(&b));
+  CHECK(makePeerKey(&address) == makePeerKey(&b));
+}
+
+int main() {
+  testWrap8();
+  testWrap32();
+  testClassification();
+  testRestart();
+  testSlowPath();
+  testPeers();
+  return checkResult("SequenceTracker");
+}
@@ -18,6 +18,7 @@
  *
  */
 
+#include <cerrno>
 #include <cstdint>
 #include <netinet/in.h>
 #include <stdlib.h>
@@ -37,13 +38,30 @@
 #include <sys/socket.h>
 
 #include <net/if.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
 #include "inet_address.h"
 #include "udpthread.h"
 #include "logging.h"
-#include "make_unique.h"
 #include "parser.h"
+#include "make_unique.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* Resizes buffer to hold size bytes starting at a cache line boundary,
+ * returns that start */
+static uint8_t* resizeAligned(std::vector<uint8_t> &buffer, size_t size) {
+  buffer.resize(size + CANNELLONI_CACHE_LINE_SIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t>(buffer.data());
+  uintptr_t aligned = (start + CANNELLONI_CACHE_LINE_SIZE - 1) & ~static_cast<uintptr_t>(CANNELLONI_CACHE_LINE_SIZE - 1);
+  return buffer.data() + (aligned - start);
+}
 
 UDPThread::UDPThread(const struct debugOptions_t &debugOptions,
                      const struct UDPThreadParams &params)
@@ -53,13 +71,53 @@ UDPThread::UDPThread(const struct debugOptions_t &debugOptions,
   , m_socket(0)
   , m_addressFamily(params.addressFamily)
   , m_sequenceNumber(0)
+  , m_wideSequence(false)
+  , m_reorderHoldTime(0)
+  , m_reorderPackets(0)
+  , m_reorderTimerArmed(false)
+  , m_retransmitPackets(0)
+  , m_nackRetrying(false)
+  , m_nackTxCount(0)
+  , m_nackRxCount(0)
+  , m_retransmitCount(0)
+  , m_fecGroupSize(0)
+  , m_fecTxCount(0)
+  , m_fecRecoveredCount(0)
+  , m_secondPath(false)
+  , m_secondSocket(-1)
+  , m_secondTxCount(0)
+  , m_currentRemote(0)
+  , m_failoverTimeout(0)
+  , m_heartbeatTxCount(0)
+  , m_heartbeatCount(0)
+  , m_failoverCount(0)
+  , m_congestionTargetDelay(0)
+  , m_congestionMaxRate(0)
+  , m_feedbackPending(false)
+  , m_feedbackSeqNo(0)
+  , m_feedbackTimestamp(0)
+  , m_feedbackTxCount(0)
   , m_timeout(100)
+  , m_latencyBudget(0)
+  , m_windowFrames(0)
+  , m_windowBytes(0)
+  , m_interArrival(0)
+  , m_frameSize(0)
+  , m_batchTimeout(0)
+  , m_fillRatio(0)
+  , m_fillBytes(0)
+  , m_fillCapacity(0)
   , m_rxCount(0)
   , m_txCount(0)
+  , m_segmentationOffload(false)
+  , m_receiveOffload(false)
+  , m_connectPeer(false)
+  , m_inputBuffer(NULL)
 {
   memcpy(&m_debugOptions, &debugOptions, sizeof(struct debugOptions_t));
   memcpy(&m_remoteAddr, &params.remoteAddr, sizeof(struct sockaddr_storage));
   memcpy(&m_localAddr, &params.localAddr, sizeof(struct sockaddr_storage));
+  m_remotes.push_back(FailoverRemote { m_remoteAddr, {}, {}, false });
   
   m_linkMtuSize = params.linkMtuSize;
   
@@ -68,29 +126,154 @@ UDPThread::UDPThread(const struct debugOptions_t &debugOptions,
   } else {
     m_payloadSize = m_linkMtuSize - IPv6_HEADER_SIZE - UDP_HEADER_SIZE;
   }
+  /* No padding between the packets, they are segments with -G */
+  uint8_t *packetBuffer = resizeAligned(m_packetBuffer, UDP_SEND_BATCH_SIZE * m_payloadSize);
+  m_maxSegments = std::min<size_t>({UDP_SEND_BATCH_SIZE, UDP_GSO_MAX_SEGMENTS,
+                                    UDP_GSO_MAX_SIZE / m_payloadSize});
+  m_sendMessages.resize(UDP_SEND_BATCH_SIZE);
+  m_sendIovecs.resize(UDP_SEND_BATCH_SIZE);
+  for (size_t i = 0; i < UDP_SEND_BATCH_SIZE; i++) {
+    m_sendIovecs[i].iov_base = packetBuffer + i * m_payloadSize;
+    memset(&m_sendMessages[i], 0, sizeof(struct mmsghdr));
+    m_sendMessages[i].msg_hdr.msg_iov = &m_sendIovecs[i];
+    m_sendMessages[i].msg_hdr.msg_iovlen = 1;
+  }
 }
 
-int UDPThread::start() {
-  /* Setup our connection */
-  m_socket = socket(m_addressFamily, SOCK_DGRAM, 0);
-  if (m_socket < 0) {
+void UDPThread::setupReceiveBuffers() {
+  size_t count = m_receiveOffload ? UDP_GRO_RECEIVE_BATCH_SIZE : UDP_RECEIVE_BATCH_SIZE;
+  size_t controlSize = m_receiveOffload ? CMSG_SPACE(sizeof(int)) : 0;
+  size_t slotSize = m_receiveOffload ? UDP_GRO_MAX_SIZE : m_linkMtuSize;
+  /* Every slot starts on its own cache line */
+  size_t slotStride = (slotSize + CANNELLONI_CACHE_LINE_SIZE - 1) & ~static_cast<size_t>(CANNELLONI_CACHE_LINE_SIZE - 1);
+  uint8_t *receiveBuffer = resizeAligned(m_receiveBuffer, count * slotStride);
+  m_receiveControl.resize(count * controlSize);
+  m_receiveMessages.resize(count);
+  m_receiveIovecs.resize(count);
+  m_receiveAddrs.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    m_receiveIovecs[i].iov_base = receiveBuffer + i * slotStride;
+    m_receiveIovecs[i].iov_len = slotSize;
+    memset(&m_receiveMessages[i], 0, sizeof(struct mmsghdr));
+    m_receiveMessages[i].msg_hdr.msg_iov = &m_receiveIovecs[i];
+    m_receiveMessages[i].msg_hdr.msg_iovlen = 1;
+    m_receiveMessages[i].msg_hdr.msg_name = &m_receiveAddrs[i];
+    if (controlSize)
+      m_receiveMessages[i].msg_hdr.msg_control = m_receiveControl.data() + i * controlSize;
+  }
+}
+
+int UDPThread::openSocket(struct sockaddr_storage &localAddr, struct sockaddr_storage &remoteAddr) {
+  int fd = socket(m_addressFamily, SOCK_DGRAM, 0);
+  if (fd < 0) {
     lerror << "socket Error" << std::endl;
     return -1;
   }
 
   /* Setup broadcast option */
   int broadcastEnable = 1;
-  if(setsockopt(m_socket,SOL_SOCKET,SO_BROADCAST,&broadcastEnable,sizeof(broadcastEnable)) < 0)
+  if(setsockopt(fd,SOL_SOCKET,SO_BROADCAST,&broadcastEnable,sizeof(broadcastEnable)) < 0)
   {
       lerror <<"Error in setting Broadcast option"<< std::endl;
-      close(m_socket);
+      close(fd);
       return -1;
   }
 
-  if (bind(m_socket, (struct sockaddr *)&m_localAddr, sizeof(m_localAddr)) < 0) {
-    lerror << "Could not bind to address" << std::endl;
-    close(m_socket);
+  if (m_segmentationOffload) {
+    int segmentSize;
+    socklen_t optionLen = sizeof(segmentSize);
+    if (getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segmentSize, &optionLen) < 0) {
+      lwarn << "UDP segmentation offload is not supported, sending packets one by one" << std::endl;
+      m_segmentationOffload = false;
+    }
+  }
+
+  if (m_receiveOffload) {
+    int enable = 1;
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) < 0) {
+      lwarn << "UDP receive offload is not supported, receiving packets one by one" << std::endl;
+      m_receiveOffload = false;
+    }
+  }
+
+  if (!m_receiveWorkers.empty() || m_inputBuffer) {
+    /* All workers share the local port */
+    int reusePort = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(reusePort)) < 0) {
+      lerror << "Could not set SO_REUSEPORT" << std::endl;
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (bind(fd, (struct sockaddr *)&localAddr, sizeof(localAddr)) < 0) {
+    lerror << "Could not bind to " << formatSocketAddress(getSocketAddress(&localAddr)) << std::endl;
+    close(fd);
+    return -1;
+  }
+
+  if (m_connectPeer) {
+    if (connect(fd, (struct sockaddr *)&remoteAddr, sizeof(remoteAddr)) < 0) {
+      lerror << "Could not connect to " << formatSocketAddress(getSocketAddress(&remoteAddr)) << std::endl;
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+int UDPThread::start() {
+  /* switchRemote does not reconnect, and failing back needs the packets
+   * of the other remotes, which the kernel would drop */
+  if (m_connectPeer && m_remotes.size() > 1) {
+    lerror << "A connected socket can't fail over to another remote" << std::endl;
+    return -1;
+  }
+  /* Setup our connection */
+  m_socket = openSocket(m_localAddr, m_remoteAddr);
+  if (m_socket < 0)
     return -1;
+  if (m_secondPath) {
+    m_secondSocket = openSocket(m_secondLocalAddr, m_secondRemoteAddr);
+    if (m_secondSocket < 0) {
+      close(m_socket);
+      return -1;
+    }
+  }
+
+  setupReceiveBuffers();
+  if (m_reorderHoldTime)
+    m_reorderBuffer = std::make_unique<ReorderBuffer>(m_reorderHoldTime, m_reorderPackets, m_linkMtuSize);
+  if (m_retransmitPackets) {
+    m_retransmitRing = std::make_unique<RetransmitRing>(m_retransmitPackets, m_payloadSize);
+    m_nackList = std::make_unique<NackList>(m_retransmitPackets);
+  }
+  if (m_fecGroupSize) {
+    /* The FEC packet carries a data packet plus its own header */
+    m_fecEncoder = std::make_unique<FecEncoder>(m_fecGroupSize, m_payloadSize - sizeof(struct CannelloniFecPacket));
+    m_fecDecoder = std::make_unique<FecDecoder>(m_linkMtuSize);
+    m_fecPacket.resize(m_linkMtuSize);
+  }
+  if (m_congestionTargetDelay) {
+    m_congestion = std::make_unique<CongestionController>(m_congestionTargetDelay, m_congestionMaxRate, m_payloadSize);
+    m_feedbackTimer.adjust(CC_FEEDBACK_INTERVAL, CC_FEEDBACK_INTERVAL);
+  }
+  if (m_failoverTimeout.count()) {
+    m_remoteSince = std::chrono::steady_clock::now();
+    uint64_t interval = m_failoverTimeout.count() / FAILOVER_HEARTBEATS;
+    m_failoverTimer.adjust(interval, interval);
+  }
+
+  for (auto &worker : m_receiveWorkers) {
+    worker->setPeerThread(m_peerThread);
+    worker->setReceiveOffload(m_receiveOffload);
+    worker->setReorder(m_reorderHoldTime, m_reorderPackets);
+    worker->setForwardErrorCorrection(m_fecGroupSize);
+    if (worker->start() < 0) {
+      stopReceiveWorkers();
+      close(m_socket);
+      return -1;
+    }
   }
   return Thread::start();
 }
@@ -101,29 +284,255 @@ void UDPThread::stop() {
   m_blockTimer.fire();
 }
 
+void UDPThread::stopReceiveWorkers() {
+  for (auto &worker : m_receiveWorkers) {
+    worker->stop();
+    worker->join();
+  }
+}
+
+void UDPThread::addReceiveWorker(FrameBuffer *buffer) {
+  auto worker = std::make_unique<UDPThread>(m_debugOptions, UDPThreadParams {
+    .remoteAddr = m_remoteAddr,
+    .localAddr = m_localAddr,
+    .addressFamily = m_addressFamily,
+    .sortFrames = m_sort,
+    .checkPeer = m_checkPeer,
+    .linkMtuSize = static_cast<uint16_t>(m_linkMtuSize),
+  });
+  worker->m_inputBuffer = buffer;
+  m_receiveWorkers.push_back(std::move(worker));
+}
+
+FrameBuffer* UDPThread::receiveFrameBuffer() {
+  return m_inputBuffer ? m_inputBuffer : m_peerThread->getFrameBuffer();
+}
+
+bool UDPThread::isSameHost(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+  if (m_addressFamily == AF_INET)
+    return memcmp(&((struct sockaddr_in *) a)->sin_addr, &((struct sockaddr_in *) b)->sin_addr, sizeof(struct in_addr)) == 0;
+  return memcmp(&((struct sockaddr_in6 *) a)->sin6_addr, &((struct sockaddr_in6 *) b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+bool UDPThread::isRemote(const struct sockaddr_storage *clientAddr, const struct sockaddr_storage *remoteAddr) {
+  /* A connected socket only receives datagrams of the peer */
+  if (m_connectPeer || !m_checkPeer)
+    return true;
+  if (isSameHost(clientAddr, remoteAddr))
+    return true;
+  if (m_failoverTimeout.count()) {
+    for (const FailoverRemote &remote : m_remotes) {
+      if (isSameHost(clientAddr, &remote.addr))
+        return true;
+    }
+  }
+  lwarn << "Got a connection attempt from " << formatSocketAddress(getSocketAddress(clientAddr))
+        << ", which is not set as a remote. Restart with -p argument to override." << std::endl;
+  return false;
+}
+
+void UDPThread::noteHeard(const struct sockaddr_storage *clientAddr, bool heartbeat) {
+  const auto now = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < m_remotes.size(); i++) {
+    FailoverRemote &remote = m_remotes[i];
+    if (!isSameHost(clientAddr, &remote.addr))
+      continue;
+    if (i == m_currentRemote && remoteSilence(now) >= m_failoverTimeout / 2) {
+      linfo << "Remote " << formatSocketAddress(getSocketAddress(&remote.addr)) << " is back" << std::endl;
+      /* Send what has been kept in the meantime */
+      if (m_frameBuffer->getFrameBufferSize())
+        m_transmitTimer.fire();
+    }
+    if (now - remote.lastHeard >= m_failoverTimeout)
+      remote.heardSince = now;
+    remote.lastHeard = now;
+    if (heartbeat)
+      remote.sendsHeartbeats = true;
+    return;
+  }
+}
+
+std::chrono::microseconds UDPThread::remoteSilence(std::chrono::steady_clock::time_point now) {
+  const FailoverRemote &remote = m_remotes[m_currentRemote];
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      now - std::max(remote.lastHeard, m_remoteSince));
+}
+
+bool UDPThread::isRemoteSuspect() {
+  /* Otherwise a remote without -H that has nothing to send stalls the tunnel */
+  return m_failoverTimeout.count() && m_remotes[m_currentRemote].sendsHeartbeats &&
+         remoteSilence(std::chrono::steady_clock::now()) >= m_failoverTimeout / 2;
+}
+
+void UDPThread::checkRemotes() {
+  const auto now = std::chrono::steady_clock::now();
+  /* Fail back once a remote that comes earlier has been alive for a while */
+  for (size_t i = 0; i < m_currentRemote; i++) {
+    const FailoverRemote &remote = m_remotes[i];
+    if (now - remote.lastHeard < m_failoverTimeout && now - remote.heardSince >= m_failoverTimeout) {
+      linfo << "Failing back to " << formatSocketAddress(getSocketAddress(&remote.addr)) << std::endl;
+      switchRemote(i);
+      break;
+    }
+  }
+  if (m_remotes.size() > 1 && remoteSilence(now) >= m_failoverTimeout) {
+    /* Prefer the next remote that is known to be alive */
+    size_t next = (m_currentRemote + 1) % m_remotes.size();
+    for (size_t i = 1; i < m_remotes.size(); i++) {
+      size_t candidate = (m_currentRemote + i) % m_remotes.size();
+      if (now - m_remotes[candidate].lastHeard < m_failoverTimeout) {
+        next = candidate;
+        break;
+      }
+    }
+    linfo << "Remote " << formatSocketAddress(getSocketAddress(&m_remoteAddr))
+          << " is silent, failing over to "
+          << formatSocketAddress(getSocketAddress(&m_remotes[next].addr)) << std::endl;
+    switchRemote(next);
+  }
+  if (m_txCount == m_heartbeatTxCount)
+    sendHeartbeat();
+  m_heartbeatTxCount = m_txCount;
+}
+
+void UDPThread::switchRemote(size_t index) {
+  m_currentRemote = index;
+  memcpy(&m_remoteAddr, &m_remotes[index].addr, sizeof(struct sockaddr_storage));
+  m_remoteSince = std::chrono::steady_clock::now();
+  m_failoverCount++;
+  /* The new remote gets the frames that have been kept */
+  if (m_frameBuffer->getFrameBufferSize())
+    m_transmitTimer.fire();
+}
+
+void UDPThread::sendHeartbeat() {
+  /* An empty packet, the peer accounts its sequence number */
+  std::vector<canfd_frame*> none;
+  std::vector<canfd_frame*>::iterator it = none.begin();
+  uint8_t *packetBuffer = static_cast<uint8_t*>(m_sendIovecs[0].iov_base);
+  uint8_t *data = buildPacket(m_payloadSize, packetBuffer, it, none.end(),
+                              m_sequenceNumber, m_wideSequence);
+  m_sendIovecs[0].iov_len = data - packetBuffer;
+  if (m_retransmitRing)
+    m_retransmitRing->store(m_sequenceNumber, packetBuffer, m_sendIovecs[0].iov_len);
+  if (m_congestion)
+    m_congestion->onPacketSent(m_sequenceNumber, m_sendIovecs[0].iov_len, CongestionController::clock());
+  m_sequenceNumber++;
+  if (sendPackets(1))
+    m_heartbeatCount++;
+}
+
 bool UDPThread::parsePacket(uint8_t *buffer, uint16_t len, struct sockaddr_storage *clientAddr) {
-  if ((m_addressFamily == AF_INET && (memcmp(&((struct sockaddr_in *) clientAddr)->sin_addr, &((struct sockaddr_in *) &m_remoteAddr)->sin_addr, sizeof(struct in_addr)) != 0) && m_checkPeer) ||
-      (m_addressFamily == AF_INET6 && (memcmp(&((struct sockaddr_in6 *) clientAddr)->sin6_addr, &((struct sockaddr_in6 *) &m_remoteAddr)->sin6_addr, sizeof(struct in6_addr)) != 0) && m_checkPeer)) {
-    lwarn << "Got a connection attempt from " << formatSocketAddress(getSocketAddress(clientAddr))
-          << ", which is not set as a remote. Restart with -p argument to override." << std::endl;
+  if (!isRemote(clientAddr, &m_remoteAddr))
     return false;
+  if (m_failoverTimeout.count()) {
+    /* A heartbeat is a data packet without frames */
+    struct CannelloniDataPacket header;
+    bool heartbeat = false;
+    if (len >= CANNELLONI_DATA_PACKET_BASE_SIZE) {
+      memcpy(&header, buffer, CANNELLONI_DATA_PACKET_BASE_SIZE);
+      heartbeat = (header.op_code == DATA || header.op_code == DATA_SEQ32) && header.count == 0;
+    }
+    noteHeard(clientAddr, heartbeat);
   }
   if (m_debugOptions.udp) {
     linfo << "Received " << std::dec << len << " Bytes from Host " << formatSocketAddress(getSocketAddress(clientAddr)) << std::endl;
   }
-  auto allocator = [this]()
+  uint32_t seqNo;
+  if (m_retransmitRing) {
+    uint32_t mask;
+    if (parseNack(len, buffer, seqNo, mask)) {
+      m_nackRxCount++;
+      retransmit(seqNo, mask);
+      return false;
+    }
+  }
+  if (m_congestion) {
+    uint32_t timestamp, received, lost;
+    if (parseFeedback(len, buffer, seqNo, timestamp, received, lost)) {
+      m_congestion->onFeedback(seqNo, m_wideSequence ? 32 : 8, timestamp, received, lost,
+                               CongestionController::clock());
+      return false;
+    }
+  }
+  if (m_fecDecoder && len > 1 && buffer[1] == FEC) {
+    uint16_t recovered = m_fecDecoder->recover(clientAddr, buffer, len, m_fecPacket.data());
+    if (recovered) {
+      m_fecRecoveredCount++;
+      if (m_debugOptions.udp)
+        linfo << "Rebuilt a lost packet from FEC" << std::endl;
+      parsePacket(m_fecPacket.data(), recovered, clientAddr);
+    }
+    return false;
+  }
+  uint8_t seqBits = parseSequenceNumber(len, buffer, seqNo);
+  if (seqBits && m_fecDecoder)
+    m_fecDecoder->store(clientAddr, seqNo, seqBits, buffer, len);
+  if (seqBits) {
+    uint32_t expected;
+    SequenceResult result = m_sequenceTracker.track(clientAddr, seqNo, seqBits, buffer, len, &expected);
+    if (m_debugOptions.udp && result != SEQUENCE_IN_ORDER) {
+      linfo << "Packet " << seqNo << " from " << formatSocketAddress(getSocketAddress(clientAddr))
+            << " is " << sequenceResultName(result) << std::endl;
+    }
+    if (m_congestion && (result == SEQUENCE_IN_ORDER || result == SEQUENCE_GAP || result == SEQUENCE_RESYNC)) {
+      m_feedbackPending = true;
+      m_feedbackSeqNo = seqNo;
+      m_feedbackTimestamp = CongestionController::clock();
+      memcpy(&m_feedbackPeer, clientAddr, sizeof(struct sockaddr_storage));
+    }
+    if (m_nackList) {
+      if (result == SEQUENCE_RESYNC) {
+        m_nackList->reset(clientAddr);
+      } else if (result == SEQUENCE_GAP) {
+        m_nackList->lost(clientAddr, expected, seqNo, seqBits, NackList::clock(),
+                         [this](const struct sockaddr_storage *peer, uint32_t first, uint32_t mask) {
+                           sendNack(peer, first, mask);
+                         });
+        if (!m_nackRetrying) {
+          m_blockTimer.adjust(NACK_RETRY_INTERVAL, NACK_RETRY_INTERVAL);
+          m_nackRetrying = true;
+        }
+      } else {
+        m_nackList->received(clientAddr, seqNo, seqBits);
+      }
+    }
+    /* A packet may be retransmitted or rebuilt from FEC although it
+     * was only late. A late one that is no duplicate is still new */
+    if ((m_retransmitRing || m_secondPath || m_fecDecoder) && result == SEQUENCE_DUPLICATE)
+      return false;
+    if (m_reorderBuffer) {
+      m_reorderBuffer->insert(clientAddr, seqNo, seqBits, result == SEQUENCE_RESYNC, buffer, len,
+                              [this](const uint8_t *packet, uint16_t packetLen) {
+                                deliverPacket(packet, packetLen);
+                              });
+      armReorderTimer();
+      return false;
+    }
+  }
+  return deliverPacket(buffer, len);
+}
+
+bool UDPThread::deliverPacket(const uint8_t *buffer, uint16_t len) {
+  /* Inlined into parseFrames, no type erasure per packet */
+  FrameBuffer *peerBuffer = receiveFrameBuffer();
+  auto allocator = [this, peerBuffer](uint8_t frameLen)
   {
-      return m_peerThread->getFrameBuffer()->requestFrame(true, m_debugOptions.buffer);
+      return peerBuffer->requestFrame(frameSizeClass(frameLen), true,
+                                      m_debugOptions.buffer);
   };
-  auto receiver = [this](canfd_frame* f, bool success)
+  auto receiver = [this, peerBuffer](canfd_frame* f, bool success)
   {
       if (!success)
       {
-          m_peerThread->getFrameBuffer()->insertFramePool(f);
+          peerBuffer->discardFrame(f);
           return;
       }
 
-      m_peerThread->transmitFrame(f);
+      if (m_inputBuffer)
+        m_peerThread->transmitFrame(m_inputBuffer, f);
+      else
+        m_peerThread->transmitFrame(f);
       if (m_debugOptions.can)
       {
           printCANInfo(f);
@@ -142,16 +551,148 @@ bool UDPThread::parsePacket(uint8_t *buffer, uint16_t len, struct sockaddr_stora
   return false;
 }
 
+void UDPThread::sendNack(const struct sockaddr_storage *peer, uint32_t first, uint32_t mask) {
+  uint8_t packet[sizeof(struct CannelloniNackPacket)];
+  uint8_t *packetEnd = buildNack(packet, first, mask);
+  /* A connected socket only talks to the peer anyway */
+  if (sendto(m_socket, packet, packetEnd - packet, 0,
+             m_connectPeer ? NULL : reinterpret_cast<const struct sockaddr*>(peer),
+             m_connectPeer ? 0 : sizeof(struct sockaddr_storage)) < 0) {
+    logSendError();
+    return;
+  }
+  m_nackTxCount++;
+  if (m_debugOptions.udp) {
+    linfo << "Sent NACK for " << first << " mask " << std::hex << mask << std::dec
+          << " to " << formatSocketAddress(getSocketAddress(peer)) << std::endl;
+  }
+}
+
+void UDPThread::retryNacks() {
+  m_nackList->retry(NackList::clock(),
+                    [this](const struct sockaddr_storage *peer, uint32_t first, uint32_t mask) {
+                      sendNack(peer, first, mask);
+                    });
+  if (m_nackList->empty()) {
+    m_blockTimer.adjust(SELECT_TIMEOUT, SELECT_TIMEOUT);
+    m_nackRetrying = false;
+  }
+}
+
+void UDPThread::sendFeedback() {
+  /* The counters of the peer the feedback goes to */
+  const SequenceStats *stats = m_sequenceTracker.getPeerStats(&m_feedbackPeer);
+  if (!stats)
+    return;
+  uint8_t packet[sizeof(struct CannelloniFeedbackPacket)];
+  uint8_t *packetEnd = buildFeedback(packet, m_feedbackSeqNo, m_feedbackTimestamp,
+                                     stats->received, stats->lost);
+  m_feedbackPending = false;
+  if (sendto(m_socket, packet, packetEnd - packet, 0,
+             m_connectPeer ? NULL : reinterpret_cast<const struct sockaddr*>(&m_feedbackPeer),
+             m_connectPeer ? 0 : sizeof(struct sockaddr_storage)) < 0) {
+    logSendError();
+    return;
+  }
+  m_feedbackTxCount++;
+}
+
+void UDPThread::queueFecPacket(size_t &count) {
+  uint8_t *packetBuffer = static_cast<uint8_t*>(m_sendIovecs[count].iov_base);
+  m_sendIovecs[count].iov_len = m_fecEncoder->finish(packetBuffer);
+  if (m_congestion)
+    m_congestion->onSent(m_sendIovecs[count].iov_len, CongestionController::clock());
+  m_fecTxCount++;
+  if (++count == UDP_SEND_BATCH_SIZE) {
+    sendPackets(count);
+    count = 0;
+  }
+}
+
+void UDPThread::retransmit(uint32_t first, uint32_t mask) {
+  const uint8_t bits = m_wideSequence ? 32 : 8;
+  for (uint32_t i = 0; i <= 32; i++) {
+    if (i && !(mask & (static_cast<uint32_t>(1) << (i - 1))))
+      continue;
+    uint16_t len;
+    const uint8_t *packet = m_retransmitRing->find(first + i, bits, len);
+    if (!packet) {
+      if (m_debugOptions.udp)
+        linfo << "Packet " << first + i << " is no longer available for retransmission" << std::endl;
+      continue;
+    }
+    if (sendto(m_socket, packet, len, 0,
+               m_connectPeer ? NULL : reinterpret_cast<const struct sockaddr*>(&m_remoteAddr),
+               m_connectPeer ? 0 : sizeof(m_remoteAddr)) < 0) {
+      logSendError();
+      continue;
+    }
+    if (m_congestion)
+      m_congestion->onSent(len, CongestionController::clock());
+    m_retransmitCount++;
+  }
+}
+
+void UDPThread::armReorderTimer() {
+  if (m_reorderTimerArmed)
+    return;
+  uint64_t expiry = m_reorderBuffer->nextExpiry();
+  if (expiry) {
+    m_reorderTimer.adjust(m_reorderHoldTime, expiry);
+    m_reorderTimerArmed = true;
+  }
+}
+
+void UDPThread::receivePackets(int socket) {
+  const size_t controlSize = m_receiveControl.size() / m_receiveMessages.size();
+  for (struct mmsghdr &message : m_receiveMessages) {
+    /* Updated by the kernel on every call */
+    message.msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    message.msg_hdr.msg_controllen = controlSize;
+  }
+  /* Don't wait for the batch to fill up, take what is there */
+  int received = recvmmsg(socket, m_receiveMessages.data(), m_receiveMessages.size(),
+                          MSG_DONTWAIT, NULL);
+  if (received < 0) {
+    /* ECONNREFUSED: the peer of a connected socket is not listening */
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+      lerror << "recvmmsg error." << std::endl;
+    return;
+  }
+  for (int i = 0; i < received; i++) {
+    uint8_t *buffer = static_cast<uint8_t*>(m_receiveIovecs[i].iov_base);
+    size_t len = m_receiveMessages[i].msg_len;
+    struct sockaddr_storage *clientAddr = &m_receiveAddrs[i];
+    if (socket == m_secondSocket) {
+      if (!isRemote(clientAddr, &m_secondRemoteAddr))
+        continue;
+      /* Both paths carry the same sequence of packets */
+      clientAddr = &m_remoteAddr;
+    }
+    /* A coalesced datagram consists of packets of segmentSize bytes,
+     * only the last one may be shorter */
+    size_t segmentSize = len;
+    struct msghdr *header = &m_receiveMessages[i].msg_hdr;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(header); cmsg; cmsg = CMSG_NXTHDR(header, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int size;
+        memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+        if (size > 0)
+          segmentSize = size;
+      }
+    }
+    for (size_t offset = 0; offset < len; offset += segmentSize) {
+      parsePacket(buffer + offset, std::min(segmentSize, len - offset), clientAddr);
+    }
+  }
+}
+
 void UDPThread::run() {
   fd_set readfds;
-  ssize_t receivedBytes;
-  std::vector<uint8_t> bufferVector(m_linkMtuSize);
-  uint8_t *buffer = bufferVector.data();
-  struct sockaddr_storage clientAddr;
-  socklen_t clientAddrLen = sizeof(clientAddr);
-
-  /* Set interval to m_timeout */
-  m_transmitTimer.adjust(m_timeout, m_timeout);
+
+  /* Set interval to m_timeout, receive workers never transmit */
+  if (!m_inputBuffer)
+    m_transmitTimer.adjust(currentTimeout(), currentTimeout());
   m_blockTimer.adjust(SELECT_TIMEOUT, SELECT_TIMEOUT);
 
   linfo << "UDPThread up and running" << std::endl;
@@ -161,8 +702,15 @@ void UDPThread::run() {
     FD_SET(m_socket, &readfds);
     FD_SET(m_transmitTimer.getFd(), &readfds);
     FD_SET(m_blockTimer.getFd(), &readfds);
+    FD_SET(m_reorderTimer.getFd(), &readfds);
+    FD_SET(m_failoverTimer.getFd(), &readfds);
+    FD_SET(m_feedbackTimer.getFd(), &readfds);
+    if (m_secondPath)
+      FD_SET(m_secondSocket, &readfds);
 
-    int ret = select(std::max({m_socket, m_transmitTimer.getFd(), m_blockTimer.getFd()})+1,
+    int ret = select(std::max({m_socket, m_transmitTimer.getFd(), m_blockTimer.getFd(),
+                               m_reorderTimer.getFd(), m_failoverTimer.getFd(),
+                               m_feedbackTimer.getFd(), m_secondSocket})+1,
                      &readfds, NULL, NULL, NULL);
     if (ret < 0) {
       lerror << "select error" << std::endl;
@@ -170,42 +718,151 @@ void UDPThread::run() {
     }
     if (FD_ISSET(m_transmitTimer.getFd(), &readfds)) {
       if (m_transmitTimer.read() > 0) {
-        if (m_frameBuffer->getFrameBufferSize())
-          prepareBuffer();
-        else {
+        if (m_frameBuffer->getFrameBufferSize()) {
+          /* Keep the frames until the remote is back or replaced */
+          if (isRemoteSuspect())
+            keepBuffer();
+          else
+            prepareBuffer();
+        } else {
           m_transmitTimer.disable();
         }
       }
     }
     if (FD_ISSET(m_blockTimer.getFd(), &readfds)) {
       m_blockTimer.read();
+      /* We are the producer of our peer's pool */
+      receiveFrameBuffer()->trimPool(m_debugOptions.buffer);
+      if (m_nackRetrying)
+        retryNacks();
+    }
+    if (FD_ISSET(m_failoverTimer.getFd(), &readfds)) {
+      m_failoverTimer.read();
+      checkRemotes();
+    }
+    if (FD_ISSET(m_feedbackTimer.getFd(), &readfds)) {
+      m_feedbackTimer.read();
+      if (m_feedbackPending)
+        sendFeedback();
+      m_congestion->checkFeedback(CongestionController::clock());
     }
     if (FD_ISSET(m_socket, &readfds)) {
-      /* Clear buffer */
-      memset(buffer, 0, m_linkMtuSize);
-      receivedBytes = recvfrom(m_socket, buffer, m_linkMtuSize,
-          0, (struct sockaddr *)&clientAddr, &clientAddrLen);
-      if (receivedBytes < 0) {
-        lerror << "recvfrom error." << std::endl;
-        continue;
-      } else if (receivedBytes > 0) {
-        parsePacket(buffer, receivedBytes, &clientAddr);
-      }
+      receivePackets(m_socket);
+    }
+    if (m_secondPath && FD_ISSET(m_secondSocket, &readfds)) {
+      receivePackets(m_secondSocket);
+    }
+    if (FD_ISSET(m_reorderTimer.getFd(), &readfds)) {
+      m_reorderTimer.read();
+      m_reorderTimerArmed = false;
+      m_reorderBuffer->expire([this](const uint8_t *packet, uint16_t packetLen) {
+        deliverPacket(packet, packetLen);
+      });
+      armReorderTimer();
+      if (!m_reorderTimerArmed)
+        m_reorderTimer.disable();
     }
   }
-  if (m_debugOptions.buffer) {
+  stopReceiveWorkers();
+  if (m_debugOptions.buffer && m_frameBuffer) {
     m_frameBuffer->debug();
   }
-  linfo << "Shutting down. UDP Transmission Summary: TX: " << m_txCount << " RX: " << m_rxCount << std::endl;
+  /* Workers are accounted for in the summary of their main thread */
+  if (!m_inputBuffer)
+    printSummary();
   shutdown(m_socket, SHUT_RDWR);
   close(m_socket);
+  if (m_secondPath) {
+    shutdown(m_secondSocket, SHUT_RDWR);
+    close(m_secondSocket);
+  }
+}
+
+void UDPThread::printSummary() {
+  SequenceStats stats = m_sequenceTracker.getStats();
+  uint64_t rxCount = m_rxCount;
+  uint64_t fecRecoveredCount = m_fecRecoveredCount;
+  for (auto &worker : m_receiveWorkers) {
+    const SequenceStats &workerStats = worker->m_sequenceTracker.getStats();
+    stats.received += workerStats.received;
+    stats.lost += workerStats.lost;
+    stats.duplicate += workerStats.duplicate;
+    stats.late += workerStats.late;
+    stats.reordered += workerStats.reordered;
+    rxCount += worker->m_rxCount;
+    fecRecoveredCount += worker->m_fecRecoveredCount;
+  }
+  linfo << "Shutting down. UDP Transmission Summary: TX: " << m_txCount << " RX: " << rxCount
+        << " LOST: " << stats.lost << " DUP: " << stats.duplicate << " LATE: " << stats.late
+        << " REORDERED: " << stats.reordered << std::endl;
+  std::map<PeerKey, SequenceStats> peerStats;
+  m_sequenceTracker.collectPeerStats(peerStats);
+  for (auto &worker : m_receiveWorkers)
+    worker->m_sequenceTracker.collectPeerStats(peerStats);
+  if (peerStats.size() > 1) {
+    for (const auto &peer : peerStats) {
+      struct sockaddr_storage addr = peerKeyAddress(peer.first);
+      linfo << "Peer " << formatSocketAddress(getSocketAddress(&addr)) << ": RX: " << peer.second.received
+            << " LOST: " << peer.second.lost << " DUP: " << peer.second.duplicate
+            << " LATE: " << peer.second.late << " REORDERED: " << peer.second.reordered << std::endl;
+    }
+  }
+  if (m_secondPath) {
+    linfo << "Second Path Summary: TX: " << m_secondTxCount << std::endl;
+  }
+  if (m_latencyBudget) {
+    linfo << "Batching Summary: TIMEOUT: " << m_batchTimeout << "us FILL: "
+          << static_cast<unsigned>(m_fillRatio * 100) << "% AVG FILL: "
+          << (m_fillCapacity ? m_fillBytes * 100 / m_fillCapacity : 0) << "%" << std::endl;
+  }
+  if (m_failoverTimeout.count()) {
+    linfo << "Failover Summary: HEARTBEATS: " << m_heartbeatCount << " SWITCHES: " << m_failoverCount
+          << " REMOTE: " << formatSocketAddress(getSocketAddress(&m_remoteAddr)) << std::endl;
+  }
+  if (m_reorderBuffer) {
+    ReorderStats reorder = m_reorderBuffer->getStats();
+    for (auto &worker : m_receiveWorkers) {
+      const ReorderStats &workerReorder = worker->m_reorderBuffer->getStats();
+      reorder.held += workerReorder.held;
+      reorder.skipped += workerReorder.skipped;
+      reorder.duplicate += workerReorder.duplicate;
+      reorder.late += workerReorder.late;
+      reorder.holdTimeTotal += workerReorder.holdTimeTotal;
+      reorder.holdTimeMax = std::max(reorder.holdTimeMax, workerReorder.holdTimeMax);
+    }
+    linfo << "Reorder Summary: HELD: " << reorder.held << " SKIPPED: " << reorder.skipped
+          << " DUP: " << reorder.duplicate << " LATE: " << reorder.late
+          << " AVG HOLD: " << (reorder.held ? reorder.holdTimeTotal / reorder.held : 0) << "us"
+          << " MAX HOLD: " << reorder.holdTimeMax << "us" << std::endl;
+  }
+  if (m_congestion) {
+    const CongestionStats &congestion = m_congestion->getStats();
+    linfo << "Congestion Summary: RATE: " << m_congestion->getRate() * 8 / 1000 << "kbit/s"
+          << " QUEUE DELAY: " << congestion.queueDelay << "us MAX QUEUE DELAY: " << congestion.queueDelayMax << "us"
+          << " FEEDBACK TX: " << m_feedbackTxCount << " RX: " << congestion.feedback
+          << " DECREASES LOSS: " << congestion.lossDecreases << " DELAY: " << congestion.delayDecreases
+          << " TIMEOUT: " << congestion.timeoutDecreases << " PACED: " << congestion.paced << std::endl;
+  }
+  if (m_fecEncoder) {
+    linfo << "FEC Summary: TX: " << m_fecTxCount << " RECOVERED: " << fecRecoveredCount << std::endl;
+  }
+  if (m_retransmitRing) {
+    linfo << "Retransmit Summary: NACK TX: " << m_nackTxCount << " NACK RX: " << m_nackRxCount
+          << " RETRANSMITTED: " << m_retransmitCount << std::endl;
+  }
 }
 
 void UDPThread::transmitFrame(canfd_frame *frame) {
+  /* The frame may be sent and gone right after the insert */
+  if (m_latencyBudget)
+    updateBatchTimeout(frame);
   m_frameBuffer->insertFrame(frame);
   /* If we have stopped the timer, enable it */
   if (!m_transmitTimer.isEnabled()) {
-    m_transmitTimer.enable();
+    if (m_latencyBudget)
+      m_transmitTimer.adjust(m_batchTimeout, m_batchTimeout);
+    else
+      m_transmitTimer.enable();
   }
   /*
    * We want that at least this frame and next frame fits into
@@ -213,7 +870,7 @@ void UDPThread::transmitFrame(canfd_frame *frame) {
    * which is just the ID * plus the DLC
    */
   if (m_frameBuffer->getFrameBufferSize() +
-      CANNELLONI_DATA_PACKET_BASE_SIZE +
+      CANNELLONI_DATA_PACKET_BASE_SIZE + (m_wideSequence ? CANNELLONI_SEQ32_SIZE : 0) +
       CANNELLONI_FRAME_BASE_SIZE >= m_payloadSize) {
     m_transmitTimer.fire();
   } else {
@@ -227,13 +884,13 @@ void UDPThread::transmitFrame(canfd_frame *frame) {
     it = m_timeoutTable.find(can_id);
     if (it != m_timeoutTable.end()) {
       uint32_t timeout = it->second;
-      if (timeout < m_timeout) {
+      if (timeout < currentTimeout()) {
         if (timeout < m_transmitTimer.getValue()) {
           if (m_debugOptions.timer) {
             linfo << "Found timeout entry for ID " << can_id << ". Adjusting timer." << std::endl;
           }
           /* Let buffer expire in timeout ms */
-          m_transmitTimer.adjust(m_timeout, timeout);
+          m_transmitTimer.adjust(currentTimeout(), timeout);
         }
       }
 
@@ -250,6 +907,74 @@ uint32_t UDPThread::getTimeout() {
   return m_timeout;
 }
 
+uint32_t UDPThread::currentTimeout() const {
+  return m_latencyBudget ? m_batchTimeout.load() : m_timeout;
+}
+
+void UDPThread::updateBatchTimeout(const canfd_frame *frame) {
+  const auto now = std::chrono::steady_clock::now();
+  m_windowFrames++;
+  m_windowBytes += CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame) +
+                   ((frame->len & CANFD_FRAME) ? sizeof(frame->flags) : 0);
+  uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - m_windowStart).count();
+  if (elapsed < BATCH_RATE_WINDOW)
+    return;
+  /* The first window starts with the first frame */
+  if (m_windowStart != std::chrono::steady_clock::time_point()) {
+    /* A longer pause would not fill a packet within the budget anyway */
+    double interArrival = std::min<double>(static_cast<double>(elapsed) / m_windowFrames, m_latencyBudget);
+    m_interArrival += (interArrival - m_interArrival) / BATCH_EWMA_WEIGHT;
+    double size = static_cast<double>(m_windowBytes) / m_windowFrames;
+    m_frameSize += (size - m_frameSize) / BATCH_EWMA_WEIGHT;
+  }
+  m_windowStart = now;
+  m_windowFrames = 0;
+  m_windowBytes = 0;
+
+  double room = m_payloadSize - CANNELLONI_DATA_PACKET_BASE_SIZE - (m_wideSequence ? CANNELLONI_SEQ32_SIZE : 0);
+  double timeout = m_interArrival * room / m_frameSize;
+  uint32_t batchTimeout = std::min<double>(std::max<double>(timeout, BATCH_MIN_TIMEOUT), m_latencyBudget);
+  if (m_debugOptions.timer && batchTimeout != m_batchTimeout) {
+    linfo << "Frame every " << static_cast<uint64_t>(m_interArrival) << " us, batch timeout "
+          << batchTimeout << " us" << std::endl;
+  }
+  m_batchTimeout = batchTimeout;
+}
+
+bool UDPThread::fillsPacket(std::vector<canfd_frame*>::iterator first,
+                            std::vector<canfd_frame*>::iterator last, size_t packetSize) {
+  size_t size = CANNELLONI_DATA_PACKET_BASE_SIZE + (m_wideSequence ? CANNELLONI_SEQ32_SIZE : 0) +
+                CANNELLONI_FRAME_BASE_SIZE;
+  for (; first != last && size < packetSize; ++first) {
+    canfd_frame *frame = *first;
+    size += CANNELLONI_FRAME_BASE_SIZE + canfd_len(frame) + ((frame->len & CANFD_FRAME) ? sizeof(frame->flags) : 0);
+  }
+  return size >= packetSize;
+}
+
+void UDPThread::updateFillRatio(size_t len, size_t packetSize) {
+  double fillRatio = m_fillRatio;
+  m_fillRatio = fillRatio + (static_cast<double>(len) / packetSize - fillRatio) / BATCH_EWMA_WEIGHT;
+  m_fillBytes += len;
+  m_fillCapacity += packetSize;
+}
+
+void UDPThread::setLatencyBudget(uint32_t budget) {
+  m_latencyBudget = budget;
+  /* Start out as if the frames were too slow to fill a packet */
+  m_interArrival = budget;
+  m_frameSize = CANNELLONI_FRAME_BASE_SIZE + CAN_MAX_DLEN;
+  m_batchTimeout = budget;
+}
+
+uint32_t UDPThread::getBatchTimeout() const {
+  return m_batchTimeout;
+}
+
+double UDPThread::getFillRatio() const {
+  return m_fillRatio;
+}
+
 void UDPThread::setTimeoutTable(std::map<uint32_t,uint32_t> &timeoutTable) {
   m_timeoutTable = timeoutTable;
 }
@@ -258,40 +983,238 @@ std::map<uint32_t,uint32_t>& UDPThread::getTimeoutTable() {
   return m_timeoutTable;
 }
 
-void UDPThread::prepareBuffer() {
-  // TODO : this should be a std::array, since payloadSize is really known at
-  // compile time.
-  auto bufWrap = std::make_unique<uint8_t[]>(m_payloadSize);
-  auto packetBuffer = bufWrap.get();
+void UDPThread::setSegmentationOffload(bool enable) {
+  m_segmentationOffload = enable;
+}
 
-  ssize_t transmittedBytes = 0;
+void UDPThread::setReceiveOffload(bool enable) {
+  m_receiveOffload = enable;
+}
 
+void UDPThread::setConnectPeer(bool enable) {
+  m_connectPeer = enable;
+}
+
+void UDPThread::setReorder(uint64_t holdTime, size_t packets) {
+  m_reorderHoldTime = holdTime;
+  m_reorderPackets = packets;
+}
+
+void UDPThread::setRetransmit(size_t packets) {
+  m_retransmitPackets = packets;
+}
+
+void UDPThread::setForwardErrorCorrection(size_t groupSize) {
+  m_fecGroupSize = groupSize;
+}
+
+void UDPThread::setSecondPath(const struct sockaddr_storage &remoteAddr,
+                              const struct sockaddr_storage &localAddr) {
+  m_secondPath = true;
+  memcpy(&m_secondRemoteAddr, &remoteAddr, sizeof(struct sockaddr_storage));
+  memcpy(&m_secondLocalAddr, &localAddr, sizeof(struct sockaddr_storage));
+}
+
+void UDPThread::setFailoverTimeout(uint64_t timeout) {
+  m_failoverTimeout = std::chrono::microseconds(timeout);
+}
+
+void UDPThread::addFailoverRemote(const struct sockaddr_storage &remoteAddr) {
+  m_remotes.push_back(FailoverRemote { remoteAddr, {}, {}, false });
+}
+
+void UDPThread::setCongestionControl(uint64_t targetDelay, uint64_t maxRate) {
+  m_congestionTargetDelay = targetDelay;
+  m_congestionMaxRate = maxRate;
+}
+
+void UDPThread::setWideSequence(bool enable) {
+  m_wideSequence = enable;
+}
+
+const SequenceStats& UDPThread::getSequenceStats() const {
+  return m_sequenceTracker.getStats();
+}
+
+ssize_t UDPThread::sendSegmented(int socket, struct sockaddr_storage *remoteAddr, size_t first, size_t count) {
+  /* The packet buffers are contiguous. All segments but the last one
+   * must be exactly m_payloadSize bytes, the receiver ignores the
+   * padding after the last frame of a packet */
+  const size_t last = first + count - 1;
+  for (size_t i = first; i < last; i++) {
+    uint8_t *packet = static_cast<uint8_t*>(m_sendIovecs[i].iov_base);
+    memset(packet + m_sendIovecs[i].iov_len, 0, m_payloadSize - m_sendIovecs[i].iov_len);
+  }
+  struct iovec iov;
+  iov.iov_base = m_sendIovecs[first].iov_base;
+  iov.iov_len = (count - 1) * m_payloadSize + m_sendIovecs[last].iov_len;
+
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  memset(control, 0, sizeof(control));
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  if (!m_connectPeer) {
+    message.msg_name = remoteAddr;
+    message.msg_namelen = sizeof(struct sockaddr_storage);
+  }
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  uint16_t segmentSize = m_payloadSize;
+  memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+
+  return sendmsg(socket, &message, 0);
+}
+
+void UDPThread::prepareBuffer() {
+  uint64_t now = 0;
+  if (m_congestion) {
+    /* Come back once the pacer lets the next packet through */
+    now = CongestionController::clock();
+    uint64_t delay = m_congestion->sendDelay(now);
+    if (delay) {
+      m_transmitTimer.adjust(currentTimeout(), delay);
+      return;
+    }
+  }
   m_frameBuffer->swapBuffers();
   if (m_sort)
     m_frameBuffer->sortIntermediateBuffer();
 
-  std::list<canfd_frame*> *buffer = m_frameBuffer->getIntermediateBuffer();
+  std::vector<canfd_frame*> *buffer = m_frameBuffer->getIntermediateBuffer();
+  std::vector<canfd_frame*>::iterator it = buffer->begin();
+  /* Leave room for the header of the FEC packet */
+  const uint16_t packetSize = m_fecEncoder ? m_payloadSize - sizeof(struct CannelloniFecPacket) : m_payloadSize;
+  size_t count = 0;
+  size_t packets = 0;
+  bool paced = false;
+  while (it != buffer->end()) {
+    if (m_congestion && !m_congestion->canSend(now)) {
+      paced = true;
+      break;
+    }
+    /* Frames that came in after the packet filled up start the next
+     * batch instead of going out in a nearly empty packet */
+    if (m_latencyBudget && packets && !fillsPacket(it, buffer->end(), packetSize))
+      break;
+    uint8_t *packetBuffer = static_cast<uint8_t*>(m_sendIovecs[count].iov_base);
+    std::vector<canfd_frame*>::iterator first = it;
+    uint8_t *data = buildPacket(packetSize, packetBuffer, it, buffer->end(),
+                                m_sequenceNumber, m_wideSequence);
+    if (it == first) {
+      /* It never will, don't let it hold up the ones behind it */
+      lerror << "Frame does not fit into a packet, dropping it" << std::endl;
+      m_frameBuffer->countDropped(DROP_OVERSIZED, 1);
+      /* Goes back to the pool with the frames that have been sent */
+      ++it;
+      continue;
+    }
+    m_sendIovecs[count].iov_len = data - packetBuffer;
+    if (m_latencyBudget)
+      updateFillRatio(m_sendIovecs[count].iov_len, packetSize);
+    if (m_retransmitRing)
+      m_retransmitRing->store(m_sequenceNumber, packetBuffer, m_sendIovecs[count].iov_len);
+    if (m_congestion)
+      m_congestion->onPacketSent(m_sequenceNumber, m_sendIovecs[count].iov_len, now);
+    bool groupComplete = m_fecEncoder &&
+        m_fecEncoder->add(m_sequenceNumber, packetBuffer, m_sendIovecs[count].iov_len);
+    m_sequenceNumber++;
+    packets++;
+    if (++count == UDP_SEND_BATCH_SIZE) {
+      sendPackets(count);
+      count = 0;
+    }
+    if (groupComplete)
+      queueFecPacket(count);
+  }
+  /* Don't keep the last packets of the flush unprotected until the next one */
+  if (m_fecEncoder && m_fecEncoder->pending())
+    queueFecPacket(count);
+  if (count)
+    sendPackets(count);
+  /* Keep the frames that could not be packed */
+  if (it != buffer->end())
+    m_frameBuffer->returnIntermediateBuffer(it);
+  if (paced) {
+    m_congestion->countPaced();
+    m_transmitTimer.adjust(currentTimeout(), m_congestion->sendDelay(now));
+  } else if (m_latencyBudget) {
+    /* The next batch gets the timeout of the current frame rate */
+    m_transmitTimer.adjust(m_batchTimeout, m_batchTimeout);
+    if (m_debugOptions.timer) {
+      linfo << "Packet fill " << static_cast<unsigned>(m_fillRatio * 100) << "%, next batch in "
+            << m_batchTimeout << " us" << std::endl;
+    }
+  }
+  m_frameBuffer->mergeIntermediateBuffer();
+}
 
-  auto overflowHandler = [this](std::list<canfd_frame*>&, std::list<canfd_frame*>::iterator it)
-  {
-      /* Move all remaining frames back to m_buffer */
-      m_frameBuffer->returnIntermediateBuffer(it);
-  };
+void UDPThread::keepBuffer() {
+  /* Coalescing, the overflow policy and the age limit apply on the way */
+  m_frameBuffer->swapBuffers();
+  m_frameBuffer->returnIntermediateBuffer(m_frameBuffer->getIntermediateBuffer()->begin());
+  m_frameBuffer->mergeIntermediateBuffer();
+}
 
-  uint8_t* data = buildPacket(m_payloadSize, packetBuffer, *buffer,
-          m_sequenceNumber++, overflowHandler);
+size_t UDPThread::sendPackets(size_t count) {
+  size_t sent = sendPacketsTo(m_socket, &m_remoteAddr, count);
+  if (m_secondPath)
+    m_secondTxCount += sendPacketsTo(m_secondSocket, &m_secondRemoteAddr, count);
+  m_txCount += sent;
+  return sent;
+}
 
-  transmittedBytes = sendBuffer(packetBuffer, data-packetBuffer);
-  if (transmittedBytes != data-packetBuffer) {
-    lerror << "UDP Socket error. Error while transmitting" << std::endl;
-  } else {
-    m_txCount++;
+size_t UDPThread::sendPacketsTo(int socket, struct sockaddr_storage *remoteAddr, size_t count) {
+  /* A connected socket already knows the peer */
+  for (size_t i = 0; i < count; i++) {
+    m_sendMessages[i].msg_hdr.msg_name = m_connectPeer ? NULL : remoteAddr;
+    m_sendMessages[i].msg_hdr.msg_namelen = m_connectPeer ? 0 : sizeof(struct sockaddr_storage);
   }
-  m_frameBuffer->unlockIntermediateBuffer();
-  m_frameBuffer->mergeIntermediateBuffer();
+  size_t next = 0;
+  size_t sent = 0;
+  while (next < count) {
+    if (m_segmentationOffload && count - next > 1) {
+      size_t segments = std::min(count - next, m_maxSegments);
+      if (sendSegmented(socket, remoteAddr, next, segments) >= 0) {
+        next += segments;
+        sent += segments;
+        continue;
+      }
+      if (errno != EIO && errno != EINVAL) {
+        logSendError();
+        next += segments;
+        continue;
+      }
+      /* The route does not support it after all */
+      lwarn << "UDP segmentation offload failed, sending packets one by one" << std::endl;
+      m_segmentationOffload = false;
+    }
+    /* Returns early if sending one of the packets failed */
+    int ret = sendmmsg(socket, m_sendMessages.data() + next, count - next, 0);
+    if (ret < 0) {
+      logSendError();
+      /* Skip the packet that failed */
+      next++;
+      continue;
+    }
+    next += ret;
+    sent += ret;
+  }
+  return sent;
 }
 
-ssize_t UDPThread::sendBuffer(uint8_t *buffer, uint16_t len) {
-  return sendto(m_socket, buffer, len, 0,
-               (struct sockaddr *) &m_remoteAddr, sizeof(m_remoteAddr));
+void UDPThread::logSendError() {
+  if (errno == ECONNREFUSED) {
+    /* A connected socket reports ICMP port unreachable messages */
+    if (m_debugOptions.udp)
+      linfo << "Peer is not listening" << std::endl;
+    return;
+  }
+  lerror << "UDP Socket error. Error while transmitting" << std::endl;
 }
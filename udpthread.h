@@ -20,13 +20,22 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <memory>
+#include <vector>
 
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 
+#include "congestion.h"
 #include "connection.h"
+#include "fec.h"
+#include "reorderbuffer.h"
+#include "retransmitring.h"
+#include "sequencetracker.h"
 #include "timer.h"
 
 
@@ -39,6 +48,28 @@ namespace cannelloni {
 /* Block select max. for 500ms */
 #define SELECT_TIMEOUT 500000
 
+/* Maximum number of datagrams received per wakeup */
+#define UDP_RECEIVE_BATCH_SIZE 16
+/* Same with UDP_GRO, each datagram may hold up to 64 KiB of packets */
+#define UDP_GRO_RECEIVE_BATCH_SIZE 4
+#define UDP_GRO_MAX_SIZE 65535
+/* Number of packet buffers, a larger backlog is sent in several batches */
+#define UDP_SEND_BATCH_SIZE 16
+/* See addReceiveWorker */
+#define UDP_MAX_RECEIVE_WORKERS 64
+/* Limits of a single UDP_SEGMENT send */
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_SIZE 65507
+/* Heartbeats per failover timeout, see setFailoverTimeout */
+#define FAILOVER_HEARTBEATS 4
+/* Shortest timeout of setLatencyBudget (us) */
+#define BATCH_MIN_TIMEOUT 100
+/* The frame rate is measured over windows of this many us, so bursts
+ * of frames average out */
+#define BATCH_RATE_WINDOW 10000
+/* Estimates follow a new measurement by 1 / BATCH_EWMA_WEIGHT */
+#define BATCH_EWMA_WEIGHT 4
+
 struct UDPThreadParams {
   struct sockaddr_storage &remoteAddr;
   struct sockaddr_storage &localAddr;
@@ -65,9 +96,158 @@ class UDPThread : public ConnectionThread {
     void setTimeoutTable(std::map<uint32_t,uint32_t> &timeoutTable);
     std::map<uint32_t,uint32_t>& getTimeoutTable();
 
+    /* Replaces the fixed timeout with the time it takes the recent
+     * frame rate to fill a packet, at least BATCH_MIN_TIMEOUT and at
+     * most budget us. 0 disables it. Call before start. */
+    void setLatencyBudget(uint32_t budget);
+    /* Timeout chosen for the current batch (us) */
+    uint32_t getBatchTimeout() const;
+    /* Share of the payload size used by the recent packets, 0 to 1 */
+    double getFillRatio() const;
+
+    /* Sends consecutive packets of a flush as one UDP_SEGMENT (GSO)
+     * datagram, every segment is a complete packet. Falls back to
+     * sendmmsg if the kernel does not support it. Call before start. */
+    void setSegmentationOffload(bool enable);
+
+    /* Lets the kernel coalesce received packets of a peer into one
+     * datagram (UDP_GRO), which is split up again before parsing.
+     * Call before start. */
+    void setReceiveOffload(bool enable);
+
+    /* Connects the socket to the remote address, so the kernel drops
+     * datagrams of anyone else (including other ports of the peer)
+     * and sends without a route lookup. start fails if failover remotes
+     * have been added as well. Call before start. */
+    void setConnectPeer(bool enable);
+
+    /* Opens another socket on the local port (SO_REUSEPORT) that is
+     * served by a thread of its own. The kernel assigns every peer to
+     * one of the sockets, so the frames of a peer stay in order. The
+     * worker hands its frames to the peer thread through buffer, which
+     * must have been registered with the peer's addInputBuffer.
+     * Call before start. */
+    void addReceiveWorker(FrameBuffer *buffer);
+
+    /* Sends DATA_SEQ32 packets with a 32 bit sequence number instead
+     * of DATA packets, the peer must understand them */
+    void setWideSequence(bool enable);
+
+    /* Loss, duplicates and reordering of the received packets */
+    const SequenceStats& getSequenceStats() const;
+
+    /* Holds received packets that overtook others for up to holdTime
+     * us, at most packets per peer, and passes them on in sequence
+     * order. 0 disables it. Call before start. */
+    void setReorder(uint64_t holdTime, size_t packets);
+
+    /* Keeps the last packets sent so the peer can ask for lost ones
+     * with a NACK, and sends NACKs for lost packets of the peer until
+     * they arrive, see NackList. 0 disables it. Call before start. */
+    void setRetransmit(size_t packets);
+
+    /* Sends a FEC packet after every groupSize packets and at the end
+     * of a flush, and rebuilds single lost packets of the peer from its
+     * FEC packets. 0 disables it. Call before start. */
+    void setForwardErrorCorrection(size_t groupSize);
+
+    /* Sends every packet over a second socket bound to localAddr to
+     * remoteAddr as well. Packets received on either socket are one
+     * sequence, the copy that arrives second is dropped as a duplicate.
+     * Call before start. */
+    void setSecondPath(const struct sockaddr_storage &remoteAddr,
+                       const struct sockaddr_storage &localAddr);
+
+    /* Considers the remote dead once nothing has been received from it
+     * for timeout us. While idle, an empty packet is sent as heartbeat
+     * every timeout / FAILOVER_HEARTBEATS. After half the timeout the
+     * frames are kept in the buffer if the remote has sent heartbeats
+     * before, after the timeout the next remote (see addFailoverRemote)
+     * takes over. 0 disables it.
+     * Call before start. */
+    void setFailoverTimeout(uint64_t timeout);
+
+    /* Adds a remote to fail over to, they are tried in the order they
+     * were added after the remote address. Once a remote that comes
+     * earlier has been heard from for the failover timeout again, the
+     * tunnel fails back to it. Call before start. */
+    void addFailoverRemote(const struct sockaddr_storage &remoteAddr);
+
+    /* Paces the packets to the rate the path takes without queueing
+     * more than targetDelay us, up to maxRate bytes per second, and
+     * sends the feedback the peer needs for the same. Frames that have
+     * to wait stay in the buffer. 0 disables it. Call before start. */
+    void setCongestionControl(uint64_t targetDelay, uint64_t maxRate);
+
   protected:
+    /* Creates, configures and binds a socket, returns -1 on errors */
+    int openSocket(struct sockaddr_storage &localAddr, struct sockaddr_storage &remoteAddr);
+    /* Checks the sender of a packet unless -p is given, any failover
+     * remote is accepted as well */
+    bool isRemote(const struct sockaddr_storage *clientAddr, const struct sockaddr_storage *remoteAddr);
+    /* Compares the addresses without the ports */
+    bool isSameHost(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+    /* Updates the liveness of the failover remote clientAddr belongs to,
+     * heartbeat if the packet was an empty data packet */
+    void noteHeard(const struct sockaddr_storage *clientAddr, bool heartbeat);
+    /* Time the current remote has been silent for, its grace period
+     * after becoming current counts as heard */
+    std::chrono::microseconds remoteSilence(std::chrono::steady_clock::time_point now);
+    /* Whether the frames are kept in the buffer for now. Only a remote
+     * that sends heartbeats is expected to be heard from while idle */
+    bool isRemoteSuspect();
+    /* Fails over or back if needed and sends a heartbeat while idle */
+    void checkRemotes();
+    void switchRemote(size_t index);
+    void sendHeartbeat();
+    /* Reports the newest packet received to the peer */
+    void sendFeedback();
+    /* Sizes the receive batch, depends on m_receiveOffload */
+    void setupReceiveBuffers();
+    /* Parses the frames of a packet and passes them on */
+    bool deliverPacket(const uint8_t *buffer, uint16_t len);
+    /* Asks peer for first and the packets of mask after it */
+    void sendNack(const struct sockaddr_storage *peer, uint32_t first, uint32_t mask);
+    /* Repeats the unanswered NACKs, m_blockTimer ticks every
+     * NACK_RETRY_INTERVAL while there are any */
+    void retryNacks();
+    /* Adds the FEC packet of the current group to the send batch */
+    void queueFecPacket(size_t &count);
+    /* Sends the packets of a NACK again */
+    void retransmit(uint32_t first, uint32_t mask);
+    /* Arms m_reorderTimer for the next held packet to expire */
+    void armReorderTimer();
+    /* Receives and parses all pending datagrams, up to
+     * UDP_RECEIVE_BATCH_SIZE with a single recvmmsg */
+    void receivePackets(int socket);
+    /* Packs the whole buffer into as many packets as needed */
     void prepareBuffer();
-    virtual ssize_t sendBuffer(uint8_t *buffer, uint16_t len);
+    /* Coalesces and trims the buffer like prepareBuffer, but keeps all
+     * frames while the remote is suspect */
+    void keepBuffer();
+    /* m_timeout, or the one of the current batch with setLatencyBudget */
+    uint32_t currentTimeout() const;
+    /* Accounts frame for the batch timeout */
+    void updateBatchTimeout(const canfd_frame *frame);
+    /* Whether the frames leave less than a minimal frame of packetSize */
+    bool fillsPacket(std::vector<canfd_frame*>::iterator first,
+                     std::vector<canfd_frame*>::iterator last, size_t packetSize);
+    void updateFillRatio(size_t len, size_t packetSize);
+    /* Sends the first count packets of m_sendIovecs,
+     * returns the number of packets sent */
+    virtual size_t sendPackets(size_t count);
+    /* Sends the packets over one of the paths */
+    size_t sendPacketsTo(int socket, struct sockaddr_storage *remoteAddr, size_t count);
+    /* Sends count packets starting at first as the segments of one
+     * datagram, returns a negative value if it could not be sent */
+    ssize_t sendSegmented(int socket, struct sockaddr_storage *remoteAddr, size_t first, size_t count);
+    /* Logs the error of a failed send in errno */
+    void logSendError();
+    /* Buffer the received frames are requested from */
+    FrameBuffer* receiveFrameBuffer();
+    void stopReceiveWorkers();
+    /* Logs the statistics of this thread and its receive workers */
+    void printSummary();
 
   protected:
     struct debugOptions_t m_debugOptions;
@@ -81,16 +261,110 @@ class UDPThread : public ConnectionThread {
     struct sockaddr_storage m_localAddr;
     struct sockaddr_storage m_remoteAddr;
 
-    uint8_t m_sequenceNumber;
+    uint32_t m_sequenceNumber;
+    /* See setWideSequence */
+    bool m_wideSequence;
+    SequenceTracker m_sequenceTracker;
+    /* See setReorder */
+    uint64_t m_reorderHoldTime;
+    size_t m_reorderPackets;
+    std::unique_ptr<ReorderBuffer> m_reorderBuffer;
+    Timer m_reorderTimer;
+    bool m_reorderTimerArmed;
+    /* See setRetransmit */
+    size_t m_retransmitPackets;
+    std::unique_ptr<RetransmitRing> m_retransmitRing;
+    std::unique_ptr<NackList> m_nackList;
+    bool m_nackRetrying;
+    uint64_t m_nackTxCount;
+    uint64_t m_nackRxCount;
+    uint64_t m_retransmitCount;
+    /* See setForwardErrorCorrection */
+    size_t m_fecGroupSize;
+    std::unique_ptr<FecEncoder> m_fecEncoder;
+    std::unique_ptr<FecDecoder> m_fecDecoder;
+    std::vector<uint8_t> m_fecPacket;
+    uint64_t m_fecTxCount;
+    uint64_t m_fecRecoveredCount;
+    /* See setSecondPath */
+    bool m_secondPath;
+    int m_secondSocket;
+    struct sockaddr_storage m_secondRemoteAddr;
+    struct sockaddr_storage m_secondLocalAddr;
+    uint64_t m_secondTxCount;
+    /* See setFailoverTimeout and addFailoverRemote */
+    struct FailoverRemote {
+      struct sockaddr_storage addr;
+      std::chrono::steady_clock::time_point lastHeard;
+      /* Start of the current streak of being heard from */
+      std::chrono::steady_clock::time_point heardSince;
+      /* An empty packet has been received, the remote runs -H */
+      bool sendsHeartbeats;
+    };
+    /* The remote address comes first */
+    std::vector<FailoverRemote> m_remotes;
+    size_t m_currentRemote;
+    std::chrono::steady_clock::time_point m_remoteSince;
+    std::chrono::microseconds m_failoverTimeout;
+    Timer m_failoverTimer;
+    /* m_txCount after the last check, no heartbeat if it has changed */
+    uint64_t m_heartbeatTxCount;
+    uint64_t m_heartbeatCount;
+    uint64_t m_failoverCount;
+    /* See setCongestionControl */
+    uint64_t m_congestionTargetDelay;
+    uint64_t m_congestionMaxRate;
+    std::unique_ptr<CongestionController> m_congestion;
+    Timer m_feedbackTimer;
+    /* Newest packet received since the last feedback */
+    bool m_feedbackPending;
+    uint32_t m_feedbackSeqNo;
+    uint32_t m_feedbackTimestamp;
+    struct sockaddr_storage m_feedbackPeer;
+    uint64_t m_feedbackTxCount;
     /* Timeout variables */
     uint32_t m_timeout;
     std::map<uint32_t,uint32_t> m_timeoutTable;
+    /* See setLatencyBudget, only the CAN thread updates the estimates */
+    uint32_t m_latencyBudget;
+    std::chrono::steady_clock::time_point m_windowStart;
+    uint32_t m_windowFrames;
+    uint64_t m_windowBytes;
+    double m_interArrival;
+    double m_frameSize;
+    std::atomic<uint32_t> m_batchTimeout;
+    /* Of the sent packets, updated with setLatencyBudget only */
+    std::atomic<double> m_fillRatio;
+    uint64_t m_fillBytes;
+    uint64_t m_fillCapacity;
     /* Performance Counters */
     uint64_t m_rxCount;
     uint64_t m_txCount;
 
     uint32_t m_linkMtuSize; // mtu of the network interface
     uint32_t m_payloadSize; // payload usable by cannelloni
+    /* Send batch, one packet of m_payloadSize bytes per slot,
+     * starts at a cache line boundary */
+    std::vector<uint8_t> m_packetBuffer;
+    std::vector<struct mmsghdr> m_sendMessages;
+    std::vector<struct iovec> m_sendIovecs;
+    /* See setSegmentationOffload */
+    bool m_segmentationOffload;
+    size_t m_maxSegments;
+
+    /* See setReceiveOffload */
+    bool m_receiveOffload;
+    /* See setConnectPeer */
+    bool m_connectPeer;
+    /* See addReceiveWorker, a worker only receives into m_inputBuffer */
+    std::vector<std::unique_ptr<UDPThread>> m_receiveWorkers;
+    FrameBuffer *m_inputBuffer;
+    /* Receive batch, one cache line aligned slot per datagram */
+    std::vector<uint8_t> m_receiveBuffer;
+    std::vector<uint8_t> m_receiveControl;
+    std::vector<struct mmsghdr> m_receiveMessages;
+    std::vector<struct iovec> m_receiveIovecs;
+    std::vector<struct sockaddr_storage> m_receiveAddrs;
 };
 
 }